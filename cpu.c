@@ -0,0 +1,77 @@
+
+/*
+ * mod_authn_otp - Apache module for one-time password authentication
+ *
+ * Copyright 2009 Archie L. Cobbs <archie@dellroad.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * $Id$
+ */
+
+#include "config.h"
+
+#include <stddef.h>
+
+#include "cpu.h"
+
+#if CPU_X86
+#include <cpuid.h>
+#endif
+
+/* Features to ignore, so each digest implementation can be tested on one CPU */
+static int          cpu_disabled;
+
+/*
+ * Make cpu_features() ignore some features from now on. This only affects implementations selected afterwards.
+ */
+void
+cpu_disable(int features)
+{
+    cpu_disabled = features;
+}
+
+/*
+ * Determine which of the CPU_* features the CPU supports and the operating system has enabled.
+ */
+int
+cpu_features(void)
+{
+#if CPU_X86
+    unsigned int eax, ebx, ecx, edx;
+    unsigned int ecx1, ebx7;
+    unsigned int xcr0_lo, xcr0_hi;
+    int features = 0;
+
+    /* Get feature flags */
+    if (__get_cpuid_max(0, NULL) < 7)
+        return 0;
+    __cpuid(1, eax, ebx, ecx1, edx);
+    __cpuid_count(7, 0, eax, ebx7, ecx, edx);
+    if ((ecx1 & bit_SSE4_1) != 0 && (ebx7 & (1 << 29)) != 0)
+        features |= CPU_SHANI;
+
+    /* Vector registers are only usable if the OS saves their state (XCR0) */
+    if ((ecx1 & bit_OSXSAVE) == 0 || (ecx1 & bit_AVX) == 0)
+        return features & ~cpu_disabled;
+    __asm__ volatile ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & 0x06) == 0x06 && (ebx7 & bit_AVX2) != 0)            /* XMM, YMM */
+        features |= CPU_AVX2;
+    if ((xcr0_lo & 0xe6) == 0xe6 && (ebx7 & bit_AVX512F) != 0)         /* XMM, YMM, opmask, ZMM */
+        features |= CPU_AVX512;
+    return features & ~cpu_disabled;
+#else
+    return 0;
+#endif
+}
+
@@ -0,0 +1,39 @@
+
+/*
+ * mod_authn_otp - Apache module for one-time password authentication
+ *
+ * Copyright 2009 Archie L. Cobbs <archie@dellroad.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * $Id$
+ */
+
+/*
+ * Runtime detection of the x86 instruction set extensions used by the digest kernels.
+ * The extensions are only used when the compiler supports them.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && HAVE_CPUID_H
+#define CPU_X86                     1
+#endif
+
+/* CPU features */
+#define CPU_SHANI                   0x01        /* SHA extensions and SSE4.1 */
+#define CPU_AVX2                    0x02        /* AVX2, with OS support for YMM state */
+#define CPU_AVX512                  0x04        /* AVX-512F, with OS support for ZMM state */
+
+/* cpu.c */
+extern int          cpu_features(void);
+extern void         cpu_disable(int features);
+
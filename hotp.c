@@ -21,38 +21,164 @@
 
 #include "otptool.h"
 
+/* HMAC-SHA1 definitions */
+#define SHA1_BLOCK_SIZE     64
+#define HMAC_IPAD           0x36
+#define HMAC_OPAD           0x5c
+
+/* Internal functions */
+static int          hotp_value(const struct hotp_key *hkey, u_long counter);
+static int          hotp_truncate(const u_char *hash);
+
 /* Powers of ten */
 static const int    powers10[] = { 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000, 1000000000 };
 
+/* SHA-1 digest, fetched once */
+static const EVP_MD *sha1_md;
+
+/* Scratch digest context reused by hotp() */
+static EVP_MD_CTX   *scratch_ctx;
+
+/* Internal SHA-1 implementation, or NULL to use OpenSSL */
+static const char   *sha1_impl;
+static int          sha1_selected;
+
+/*
+ * Precompute the HMAC inner and outer hash states for a key, so that each
+ * hotp() invocation costs only two SHA-1 compressions.
+ * Returns 0 if successful, else -1.
+ */
+int
+hotp_key_init(struct hotp_key *hkey, const u_char *key, size_t keylen)
+{
+    u_char keybuf[SHA1_BLOCK_SIZE];
+    u_char pad[SHA1_BLOCK_SIZE];
+    u_int hash_len;
+    int i;
+
+    /* Select the internal SHA-1 implementation once; this also runs the RFC 4226 self-check */
+    if (!sha1_selected) {
+        sha1_impl = hmac_sha1_select();
+        sha1_selected = 1;
+    }
+    memset(hkey, 0, sizeof(*hkey));
+    if (sha1_impl != NULL) {
+        hmac_sha1_key_init(&hkey->state, key, keylen);
+        return 0;
+    }
+
+    /* Fetch the SHA-1 implementation once, instead of implicitly on every digest initialization */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    if (sha1_md == NULL)
+        sha1_md = EVP_MD_fetch(NULL, "SHA1", NULL);
+#endif
+    if (sha1_md == NULL)
+        sha1_md = EVP_sha1();
+    if (scratch_ctx == NULL && (scratch_ctx = EVP_MD_CTX_create()) == NULL)
+        return -1;
+
+    /* Keys longer than the block size are hashed first (RFC 2104) */
+    memset(keybuf, 0, sizeof(keybuf));
+    if (keylen > sizeof(keybuf)) {
+        if (EVP_Digest(key, keylen, keybuf, &hash_len, sha1_md, NULL) != 1)
+            return -1;
+    } else
+        memcpy(keybuf, key, keylen);
+
+    /* Absorb (key ^ ipad) and (key ^ opad) */
+    if ((hkey->ictx = EVP_MD_CTX_create()) == NULL || (hkey->octx = EVP_MD_CTX_create()) == NULL)
+        return -1;
+    for (i = 0; i < sizeof(pad); i++)
+        pad[i] = keybuf[i] ^ HMAC_IPAD;
+    if (EVP_DigestInit_ex(hkey->ictx, sha1_md, NULL) != 1 || EVP_DigestUpdate(hkey->ictx, pad, sizeof(pad)) != 1)
+        return -1;
+    for (i = 0; i < sizeof(pad); i++)
+        pad[i] = keybuf[i] ^ HMAC_OPAD;
+    if (EVP_DigestInit_ex(hkey->octx, sha1_md, NULL) != 1 || EVP_DigestUpdate(hkey->octx, pad, sizeof(pad)) != 1)
+        return -1;
+    return 0;
+}
+
 /*
  * Generate an OTP using the algorithm specified in RFC 4226,
  */
 void
-hotp(const u_char *key, size_t keylen, u_long counter, int ndigits, char *buf10, char *buf16, size_t buflen)
+hotp(const struct hotp_key *hkey, u_long counter, int ndigits, char *buf10, char *buf16, size_t buflen)
 {
-    const int max10 = sizeof(powers10) / sizeof(*powers10);
-    const int max16 = 8;
-    const EVP_MD *sha1_md = EVP_sha1();
+    hotp_format(hotp_value(hkey, counter), ndigits, buf10, buf16, buflen);
+}
+
+/*
+ * Compute the 31 bit truncated HMAC value for a counter using the algorithm specified in RFC 4226.
+ */
+static int
+hotp_value(const struct hotp_key *hkey, u_long counter)
+{
+    EVP_MD_CTX *const ctx = scratch_ctx;
     u_char hash[EVP_MAX_MD_SIZE];
     u_int hash_len;
     u_char tosign[8];
-    int offset;
-    int value;
     int i;
 
-    /* Encode counter */
-    for (i = sizeof(tosign) - 1; i >= 0; i--) {
-        tosign[i] = counter & 0xff;
-        counter >>= 8;
+    /* Use the internal SHA-1 if the key state was initialized for it */
+    memset(hash, 0, sizeof(hash));
+    hash_len = SHA_DIGEST_LENGTH;
+    if (hkey->ictx == NULL)
+        hmac_sha1_counter(&hkey->state, counter, hash);
+    else {
+        /* Encode counter */
+        for (i = sizeof(tosign) - 1; i >= 0; i--) {
+            tosign[i] = counter & 0xff;
+            counter >>= 8;
+        }
+
+        /* Compute HMAC by resuming from the precomputed inner and outer states */
+        if (EVP_MD_CTX_copy_ex(ctx, hkey->ictx) == 1
+          && EVP_DigestUpdate(ctx, tosign, sizeof(tosign)) == 1
+          && EVP_DigestFinal_ex(ctx, hash, &hash_len) == 1
+          && EVP_MD_CTX_copy_ex(ctx, hkey->octx) == 1
+          && EVP_DigestUpdate(ctx, hash, hash_len) == 1)
+            EVP_DigestFinal_ex(ctx, hash, &hash_len);
     }
+    return hotp_truncate(hash);
+}
 
-    /* Compute HMAC */
-    HMAC(sha1_md, key, keylen, tosign, sizeof(tosign), hash, &hash_len);
+/*
+ * Compute the HOTP values for several counters. When the internal SHA-1 is in use,
+ * up to HMAC_SHA1_MAX_BATCH values are computed at a time with multi-buffer SHA-1.
+ */
+void
+hotp_values(const struct hotp_key *hkey, const u_long *counters, int count, int *values)
+{
+    u_char hashes[HMAC_SHA1_MAX_BATCH][SHA1_DIGEST_LEN];
+    uint64_t batch[HMAC_SHA1_MAX_BATCH];
+    int num;
+    int i;
+    int j;
 
-    /* Extract selected bytes to get 32 bit integer value */
-    offset = hash[hash_len - 1] & 0x0f;
-    value = ((hash[offset] & 0x7f) << 24) | ((hash[offset + 1] & 0xff) << 16)
-        | ((hash[offset + 2] & 0xff) << 8) | (hash[offset + 3] & 0xff);
+    if (hkey->ictx != NULL || hmac_sha1_batch_size() == 1) {
+        for (i = 0; i < count; i++)
+            values[i] = hotp_value(hkey, counters[i]);
+        return;
+    }
+    for (i = 0; i < count; i += num) {
+        num = count - i < HMAC_SHA1_MAX_BATCH ? count - i : HMAC_SHA1_MAX_BATCH;
+        for (j = 0; j < num; j++)
+            batch[j] = counters[i + j];
+        hmac_sha1_counter_batch(&hkey->state, batch, num, hashes);
+        for (j = 0; j < num; j++)
+            values[i + j] = hotp_truncate(hashes[j]);
+    }
+}
+
+/*
+ * Format an HOTP value as decimal and/or hexadecimal digits.
+ */
+void
+hotp_format(int value, int ndigits, char *buf10, char *buf16, size_t buflen)
+{
+    const int max10 = sizeof(powers10) / sizeof(*powers10);
+    const int max16 = 8;
 
     /* Sanity check max # digits */
     if (ndigits < 1)
@@ -71,3 +197,15 @@ hotp(const u_char *key, size_t keylen, u_long counter, int ndigits, char *buf10,
     }
 }
 
+/*
+ * Extract selected bytes from an HMAC-SHA1 hash to get a 31 bit integer value (RFC 4226, section 5.3).
+ */
+static int
+hotp_truncate(const u_char *hash)
+{
+    const int offset = hash[SHA_DIGEST_LENGTH - 1] & 0x0f;
+
+    return ((hash[offset] & 0x7f) << 24) | ((hash[offset + 1] & 0xff) << 16)
+        | ((hash[offset + 2] & 0xff) << 8) | (hash[offset + 3] & 0xff);
+}
+
@@ -0,0 +1,426 @@
+
+/*
+ * mod_authn_otp - Apache module for one-time password authentication
+ *
+ * Copyright 2009 Archie L. Cobbs <archie@dellroad.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * $Id$
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "cpu.h"
+#include "md5.h"
+
+#if CPU_X86
+#include <immintrin.h>
+#endif
+
+/* MD5 words are little endian; on little endian hosts message bytes can be copied directly */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define MD5_LITTLE_ENDIAN           1
+#endif
+
+/*
+ * Compression function: update the states of "lanes" messages with one block each.
+ * Lane "i" has state words state[i * 4 ...] and message words words[i * 16 ...].
+ */
+typedef void (*md5_compress_t)(uint32_t *state, const uint32_t *words);
+
+/* Internal functions */
+static void         md5_compress_generic(uint32_t *state, const uint32_t *words);
+#if CPU_X86
+static void         md5_compress_avx2(uint32_t *state, const uint32_t *words);
+static void         md5_compress_avx512(uint32_t *state, const uint32_t *words);
+#endif
+static void         md5_block(const u_char *msg, size_t len, int block, uint32_t *words);
+static int          md5_self_check(void);
+
+/* MD5 initial state */
+static const uint32_t md5_iv[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+
+/* Test vectors from RFC 1321, appendix A.5 */
+static const char   *const md5_test_msgs[] = {
+    "",
+    "a",
+    "abc",
+    "message digest",
+    "abcdefghijklmnopqrstuvwxyz",
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+    "12345678901234567890123456789012345678901234567890123456789012345678901234567890",
+};
+static const u_char md5_test_digests[][MD5_DIGEST_LEN] = {
+    { 0xd4, 0x1d, 0x8c, 0xd9, 0x8f, 0x00, 0xb2, 0x04, 0xe9, 0x80, 0x09, 0x98, 0xec, 0xf8, 0x42, 0x7e },
+    { 0x0c, 0xc1, 0x75, 0xb9, 0xc0, 0xf1, 0xb6, 0xa8, 0x31, 0xc3, 0x99, 0xe2, 0x69, 0x77, 0x26, 0x61 },
+    { 0x90, 0x01, 0x50, 0x98, 0x3c, 0xd2, 0x4f, 0xb0, 0xd6, 0x96, 0x3f, 0x7d, 0x28, 0xe1, 0x7f, 0x72 },
+    { 0xf9, 0x6b, 0x69, 0x7d, 0x7c, 0xb7, 0x93, 0x8d, 0x52, 0x5a, 0x2f, 0x31, 0xaa, 0xf1, 0x61, 0xd0 },
+    { 0xc3, 0xfc, 0xd3, 0xd7, 0x61, 0x92, 0xe4, 0x00, 0x7d, 0xfb, 0x49, 0x6c, 0xca, 0x67, 0xe1, 0x3b },
+    { 0xd1, 0x74, 0xab, 0x98, 0xd2, 0x77, 0xd9, 0xf5, 0xa5, 0x61, 0x1c, 0x2c, 0x9f, 0x41, 0x9d, 0x9f },
+    { 0x57, 0xed, 0xf4, 0xa2, 0x2b, 0xe3, 0xc9, 0x55, 0xac, 0x49, 0xda, 0x2e, 0x21, 0x07, 0xb6, 0x7a },
+};
+
+/* The selected compression function and its number of lanes */
+static md5_compress_t md5_compress = md5_compress_generic;
+static int          md5_lanes = 1;
+
+/*
+ * Select the widest MD5 implementation supported by this CPU that passes the RFC 1321
+ * self-check. This should be invoked once at startup, before any other threads are
+ * using this code.
+ *
+ * Returns the name of the selected implementation, or NULL if the self-check failed.
+ */
+const char *
+md5_select(void)
+{
+#if CPU_X86
+    const int features = cpu_features();
+
+    if ((features & CPU_AVX512) != 0) {
+        md5_compress = md5_compress_avx512;
+        md5_lanes = 16;
+        if (md5_self_check() == 0)
+            return "AVX-512";
+    }
+    if ((features & CPU_AVX2) != 0) {
+        md5_compress = md5_compress_avx2;
+        md5_lanes = 8;
+        if (md5_self_check() == 0)
+            return "AVX2";
+    }
+#endif
+    md5_compress = md5_compress_generic;
+    md5_lanes = 1;
+    if (md5_self_check() == 0)
+        return "generic";
+    return NULL;
+}
+
+/*
+ * Get the number of messages md5_batch() computes in parallel.
+ */
+int
+md5_batch_size(void)
+{
+    return md5_lanes;
+}
+
+/*
+ * Compute the MD5 digests of several messages. Messages may have different lengths;
+ * the batch runs for as many blocks as the longest message in it needs.
+ */
+void
+md5_batch(const u_char *const *msgs, const size_t *lens, int count, u_char (*digests)[MD5_DIGEST_LEN])
+{
+    const int lanes = md5_lanes;
+    uint32_t state[MD5_MAX_BATCH][4];
+    uint32_t words[MD5_MAX_BATCH][16];
+    int nblocks[MD5_MAX_BATCH];
+    int max_blocks;
+    int block;
+    int num;
+    int i;
+#if !MD5_LITTLE_ENDIAN
+    int j;
+#endif
+
+    for (; count > 0; msgs += num, lens += num, digests += num, count -= num) {
+        num = count < lanes ? count : lanes;
+
+        /* Initialize state and count blocks, including padding and length */
+        max_blocks = 0;
+        for (i = 0; i < lanes; i++) {
+            memcpy(state[i], md5_iv, sizeof(state[i]));
+            nblocks[i] = i < num ? (int)((lens[i] + 8) / MD5_BLOCK_LEN) + 1 : 0;
+            if (nblocks[i] > max_blocks)
+                max_blocks = nblocks[i];
+        }
+
+        /* Compress blocks; save each lane's digest after its last block */
+        for (block = 0; block < max_blocks; block++) {
+            for (i = 0; i < lanes; i++) {
+                if (block < nblocks[i])
+                    md5_block(msgs[i], lens[i], block, words[i]);
+                else
+                    memset(words[i], 0, sizeof(words[i]));
+            }
+            (*md5_compress)(state[0], words[0]);
+            for (i = 0; i < num; i++) {
+                if (block != nblocks[i] - 1)
+                    continue;
+#if MD5_LITTLE_ENDIAN
+                memcpy(digests[i], state[i], MD5_DIGEST_LEN);
+#else
+                for (j = 0; j < MD5_DIGEST_LEN; j++)
+                    digests[i][j] = (u_char)(state[i][j / 4] >> (8 * (j % 4)));
+#endif
+            }
+        }
+    }
+}
+
+/*
+ * Get block number "block" of a message, with MD5 padding and length applied, as message words.
+ */
+static void
+md5_block(const u_char *msg, size_t len, int block, uint32_t *words)
+{
+    const size_t off = (size_t)block * MD5_BLOCK_LEN;
+    const uint64_t bits = (uint64_t)len * 8;
+#if !MD5_LITTLE_ENDIAN
+    size_t i;
+#endif
+
+    memset(words, 0, MD5_BLOCK_LEN);
+    if (off < len) {
+#if MD5_LITTLE_ENDIAN
+        memcpy(words, msg + off, len - off < MD5_BLOCK_LEN ? len - off : MD5_BLOCK_LEN);
+#else
+        for (i = 0; i < len - off && i < MD5_BLOCK_LEN; i++)
+            words[i / 4] |= (uint32_t)msg[off + i] << (8 * (i % 4));
+#endif
+    }
+    if (len >= off && len < off + MD5_BLOCK_LEN)
+        words[(len - off) / 4] |= (uint32_t)0x80 << (8 * ((len - off) % 4));
+    if (block == (int)((len + 8) / MD5_BLOCK_LEN)) {
+        words[14] = (uint32_t)bits;
+        words[15] = (uint32_t)(bits >> 32);
+    }
+}
+
+/*
+ * Verify the selected compression function using the RFC 1321 test vectors, computed
+ * together as one batch of messages with different lengths. Returns 0 if successful, else -1.
+ */
+static int
+md5_self_check(void)
+{
+    const int num = sizeof(md5_test_msgs) / sizeof(*md5_test_msgs);
+    u_char digests[sizeof(md5_test_msgs) / sizeof(*md5_test_msgs)][MD5_DIGEST_LEN];
+    size_t lens[sizeof(md5_test_msgs) / sizeof(*md5_test_msgs)];
+    int i;
+
+    for (i = 0; i < num; i++)
+        lens[i] = strlen(md5_test_msgs[i]);
+    md5_batch((const u_char *const *)md5_test_msgs, lens, num, digests);
+    return memcmp(digests, md5_test_digests, sizeof(digests)) == 0 ? 0 : -1;
+}
+
+/*
+ * MD5 step structure (RFC 1321), shared by the scalar and multi-buffer compression functions.
+ * Each implementation defines ADD(), ROTL(), K(), F(), G(), H(), and I() over its word type,
+ * and provides the message words in "w".
+ */
+#define STEP(f, a, b, c, d, k, t, s)    (a = ADD(b, ROTL(ADD(ADD(a, f(b, c, d)), ADD(w[k], K(t))), s)))
+#define MD5_ROUNDS(a, b, c, d)          do {                                            \
+                                        STEP(F, a, b, c, d,  0, 0xd76aa478,  7);        \
+                                        STEP(F, d, a, b, c,  1, 0xe8c7b756, 12);        \
+                                        STEP(F, c, d, a, b,  2, 0x242070db, 17);        \
+                                        STEP(F, b, c, d, a,  3, 0xc1bdceee, 22);        \
+                                        STEP(F, a, b, c, d,  4, 0xf57c0faf,  7);        \
+                                        STEP(F, d, a, b, c,  5, 0x4787c62a, 12);        \
+                                        STEP(F, c, d, a, b,  6, 0xa8304613, 17);        \
+                                        STEP(F, b, c, d, a,  7, 0xfd469501, 22);        \
+                                        STEP(F, a, b, c, d,  8, 0x698098d8,  7);        \
+                                        STEP(F, d, a, b, c,  9, 0x8b44f7af, 12);        \
+                                        STEP(F, c, d, a, b, 10, 0xffff5bb1, 17);        \
+                                        STEP(F, b, c, d, a, 11, 0x895cd7be, 22);        \
+                                        STEP(F, a, b, c, d, 12, 0x6b901122,  7);        \
+                                        STEP(F, d, a, b, c, 13, 0xfd987193, 12);        \
+                                        STEP(F, c, d, a, b, 14, 0xa679438e, 17);        \
+                                        STEP(F, b, c, d, a, 15, 0x49b40821, 22);        \
+                                        STEP(G, a, b, c, d,  1, 0xf61e2562,  5);        \
+                                        STEP(G, d, a, b, c,  6, 0xc040b340,  9);        \
+                                        STEP(G, c, d, a, b, 11, 0x265e5a51, 14);        \
+                                        STEP(G, b, c, d, a,  0, 0xe9b6c7aa, 20);        \
+                                        STEP(G, a, b, c, d,  5, 0xd62f105d,  5);        \
+                                        STEP(G, d, a, b, c, 10, 0x02441453,  9);        \
+                                        STEP(G, c, d, a, b, 15, 0xd8a1e681, 14);        \
+                                        STEP(G, b, c, d, a,  4, 0xe7d3fbc8, 20);        \
+                                        STEP(G, a, b, c, d,  9, 0x21e1cde6,  5);        \
+                                        STEP(G, d, a, b, c, 14, 0xc33707d6,  9);        \
+                                        STEP(G, c, d, a, b,  3, 0xf4d50d87, 14);        \
+                                        STEP(G, b, c, d, a,  8, 0x455a14ed, 20);        \
+                                        STEP(G, a, b, c, d, 13, 0xa9e3e905,  5);        \
+                                        STEP(G, d, a, b, c,  2, 0xfcefa3f8,  9);        \
+                                        STEP(G, c, d, a, b,  7, 0x676f02d9, 14);        \
+                                        STEP(G, b, c, d, a, 12, 0x8d2a4c8a, 20);        \
+                                        STEP(H, a, b, c, d,  5, 0xfffa3942,  4);        \
+                                        STEP(H, d, a, b, c,  8, 0x8771f681, 11);        \
+                                        STEP(H, c, d, a, b, 11, 0x6d9d6122, 16);        \
+                                        STEP(H, b, c, d, a, 14, 0xfde5380c, 23);        \
+                                        STEP(H, a, b, c, d,  1, 0xa4beea44,  4);        \
+                                        STEP(H, d, a, b, c,  4, 0x4bdecfa9, 11);        \
+                                        STEP(H, c, d, a, b,  7, 0xf6bb4b60, 16);        \
+                                        STEP(H, b, c, d, a, 10, 0xbebfbc70, 23);        \
+                                        STEP(H, a, b, c, d, 13, 0x289b7ec6,  4);        \
+                                        STEP(H, d, a, b, c,  0, 0xeaa127fa, 11);        \
+                                        STEP(H, c, d, a, b,  3, 0xd4ef3085, 16);        \
+                                        STEP(H, b, c, d, a,  6, 0x04881d05, 23);        \
+                                        STEP(H, a, b, c, d,  9, 0xd9d4d039,  4);        \
+                                        STEP(H, d, a, b, c, 12, 0xe6db99e5, 11);        \
+                                        STEP(H, c, d, a, b, 15, 0x1fa27cf8, 16);        \
+                                        STEP(H, b, c, d, a,  2, 0xc4ac5665, 23);        \
+                                        STEP(I, a, b, c, d,  0, 0xf4292244,  6);        \
+                                        STEP(I, d, a, b, c,  7, 0x432aff97, 10);        \
+                                        STEP(I, c, d, a, b, 14, 0xab9423a7, 15);        \
+                                        STEP(I, b, c, d, a,  5, 0xfc93a039, 21);        \
+                                        STEP(I, a, b, c, d, 12, 0x655b59c3,  6);        \
+                                        STEP(I, d, a, b, c,  3, 0x8f0ccc92, 10);        \
+                                        STEP(I, c, d, a, b, 10, 0xffeff47d, 15);        \
+                                        STEP(I, b, c, d, a,  1, 0x85845dd1, 21);        \
+                                        STEP(I, a, b, c, d,  8, 0x6fa87e4f,  6);        \
+                                        STEP(I, d, a, b, c, 15, 0xfe2ce6e0, 10);        \
+                                        STEP(I, c, d, a, b,  6, 0xa3014314, 15);        \
+                                        STEP(I, b, c, d, a, 13, 0x4e0811a1, 21);        \
+                                        STEP(I, a, b, c, d,  4, 0xf7537e82,  6);        \
+                                        STEP(I, d, a, b, c, 11, 0xbd3af235, 10);        \
+                                        STEP(I, c, d, a, b,  2, 0x2ad7d2bb, 15);        \
+                                        STEP(I, b, c, d, a,  9, 0xeb86d391, 21);        \
+                                    } while (0)
+
+/*
+ * Portable MD5 compression function (one lane).
+ */
+#define ADD(x, y)                   ((x) + (y))
+#define ROTL(x, n)                  (((x) << (n)) | ((x) >> (32 - (n))))
+#define K(t)                        ((uint32_t)(t))
+#define F(b, c, d)                  ((d) ^ ((b) & ((c) ^ (d))))
+#define G(b, c, d)                  ((c) ^ ((d) & ((b) ^ (c))))
+#define H(b, c, d)                  ((b) ^ (c) ^ (d))
+#define I(b, c, d)                  ((c) ^ ((b) | ~(d)))
+
+static void
+md5_compress_generic(uint32_t *state, const uint32_t *words)
+{
+    const uint32_t *const w = words;
+    uint32_t a, b, c, d;
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    MD5_ROUNDS(a, b, c, d);
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+#undef ADD
+#undef ROTL
+#undef K
+#undef F
+#undef G
+#undef H
+#undef I
+
+#if CPU_X86
+
+/*
+ * Multi-buffer MD5 compression function body for vector type VEC. The lanes are
+ * transposed in and out of vectors using gathers and scatters.
+ */
+#define MD5_COMPRESS(VEC)                                                                   \
+    VEC w[16];                                                                              \
+    VEC a, b, c, d;                                                                         \
+    VEC a0, b0, c0, d0;                                                                     \
+    int i;                                                                                  \
+                                                                                            \
+    for (i = 0; i < 16; i++)                                                                \
+        w[i] = GATHER(words + i, 16);                                                       \
+    a = a0 = GATHER(state + 0, 4);                                                          \
+    b = b0 = GATHER(state + 1, 4);                                                          \
+    c = c0 = GATHER(state + 2, 4);                                                          \
+    d = d0 = GATHER(state + 3, 4);                                                          \
+    MD5_ROUNDS(a, b, c, d);                                                                 \
+    SCATTER(state + 0, 4, ADD(a0, a));                                                      \
+    SCATTER(state + 1, 4, ADD(b0, b));                                                      \
+    SCATTER(state + 2, 4, ADD(c0, c));                                                      \
+    SCATTER(state + 3, 4, ADD(d0, d));
+
+/* AVX2: eight lanes */
+#define ADD(x, y)                   _mm256_add_epi32(x, y)
+#define ROTL(x, n)                  _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+#define K(t)                        _mm256_set1_epi32((int)(t))
+#define F(b, c, d)                  _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)))
+#define G(b, c, d)                  _mm256_xor_si256(c, _mm256_and_si256(d, _mm256_xor_si256(b, c)))
+#define H(b, c, d)                  _mm256_xor_si256(_mm256_xor_si256(b, c), d)
+#define I(b, c, d)                  _mm256_xor_si256(c, _mm256_or_si256(b, _mm256_xor_si256(d, _mm256_set1_epi32(-1))))
+#define GATHER(p, stride)           _mm256_i32gather_epi32((const int *)(p),                               \
+                                      _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),         \
+                                        _mm256_set1_epi32(stride)), 4)
+#define SCATTER(p, stride, x)       do {                                                                    \
+                                        uint32_t _lanes[8];                                                 \
+                                        int _i;                                                             \
+                                                                                                            \
+                                        _mm256_storeu_si256((__m256i *)_lanes, x);                          \
+                                        for (_i = 0; _i < 8; _i++)                                          \
+                                            (p)[_i * (stride)] = _lanes[_i];                                \
+                                    } while (0)
+
+__attribute__((target("avx2")))
+static void
+md5_compress_avx2(uint32_t *state, const uint32_t *words)
+{
+    MD5_COMPRESS(__m256i)
+}
+
+#undef ADD
+#undef ROTL
+#undef K
+#undef F
+#undef G
+#undef H
+#undef I
+#undef GATHER
+#undef SCATTER
+
+/* AVX-512: sixteen lanes, with native rotates and three-input logic */
+#define ADD(x, y)                   _mm512_add_epi32(x, y)
+#define ROTL(x, n)                  _mm512_rol_epi32(x, n)
+#define K(t)                        _mm512_set1_epi32((int)(t))
+#define F(b, c, d)                  _mm512_ternarylogic_epi32(b, c, d, 0xca)
+#define G(b, c, d)                  _mm512_ternarylogic_epi32(b, c, d, 0xe4)
+#define H(b, c, d)                  _mm512_ternarylogic_epi32(b, c, d, 0x96)
+#define I(b, c, d)                  _mm512_ternarylogic_epi32(b, c, d, 0x39)
+#define GATHER(p, stride)           _mm512_i32gather_epi32(_mm512_mullo_epi32(                             \
+                                      _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), \
+                                      _mm512_set1_epi32(stride)), (const void *)(p), 4)
+#define SCATTER(p, stride, x)       _mm512_i32scatter_epi32((void *)(p), _mm512_mullo_epi32(                \
+                                      _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), \
+                                      _mm512_set1_epi32(stride)), x, 4)
+
+__attribute__((target("avx512f")))
+static void
+md5_compress_avx512(uint32_t *state, const uint32_t *words)
+{
+    MD5_COMPRESS(__m512i)
+}
+
+#undef ADD
+#undef ROTL
+#undef K
+#undef F
+#undef G
+#undef H
+#undef I
+#undef GATHER
+#undef SCATTER
+
+#endif  /* CPU_X86 */
+
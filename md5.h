@@ -0,0 +1,42 @@
+
+/*
+ * mod_authn_otp - Apache module for one-time password authentication
+ *
+ * Copyright 2009 Archie L. Cobbs <archie@dellroad.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * $Id$
+ */
+
+/*
+ * Internal MD5 used for Mobile-OTP. This computes the digests of several short messages
+ * at once, one per vector lane when the CPU supports it. The implementation is selected
+ * once at startup.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/* MD5 sizes */
+#define MD5_BLOCK_LEN               64
+#define MD5_DIGEST_LEN              16
+
+/* Maximum number of messages md5_batch() computes in parallel */
+#define MD5_MAX_BATCH               16
+
+/* md5.c */
+extern const char   *md5_select(void);
+extern int          md5_batch_size(void);
+extern void         md5_batch(const u_char *const *msgs, const size_t *lens, int count, u_char (*digests)[MD5_DIGEST_LEN]);
+
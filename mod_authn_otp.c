@@ -37,6 +37,15 @@
 #include "apr_want.h"
 #include "apr_strings.h"
 #include "apr_file_io.h"
+#include "apr_global_mutex.h"
+#include "apr_shm.h"
+#include "apr_atomic.h"
+#include "apr_base64.h"
+#include "apr_optional_hooks.h"
+#include "apr_hash.h"
+#include "apr_thread_cond.h"
+#include "apr_thread_pool.h"
+#include "apr_thread_proc.h"
 #include "apr_time.h"
 
 #include "httpd.h"
@@ -46,12 +55,21 @@
 #include "http_protocol.h"
 #include "http_request.h"
 #include "util_md5.h"
+#include "mod_status.h"
+#ifdef AP_NEED_SET_MUTEX_PERMS
+#include "unixd.h"
+#endif
 
 #include <time.h>
 #include <limits.h>
+#include <stdlib.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
 #include <openssl/md5.h>
+#include <openssl/sha.h>
+
+#include "md5.h"
+#include "sha1.h"
 
 /* Apache backward-compat */
 #ifndef AUTHN_PROVIDER_VERSION
@@ -62,6 +80,14 @@
 #else
 #define USER_AGENT_IP(req)  ((req)->connection->remote_ip)
 #endif
+#if AP_MODULE_MAGIC_AT_LEAST(20150222, 13)
+#define MASTER_CONN(conn)   ((conn)->master != NULL ? (conn)->master : (conn))
+#else
+#define MASTER_CONN(conn)   (conn)
+#endif
+#if defined(AP_NEED_SET_MUTEX_PERMS) && !AP_MODULE_MAGIC_AT_LEAST(20081201, 0)
+#define ap_unixd_set_global_mutex_perms unixd_set_global_mutex_perms
+#endif
 
 /* Module definition */
 module AP_MODULE_DECLARE_DATA authn_otp_module;
@@ -77,9 +103,10 @@ module AP_MODULE_DECLARE_DATA authn_otp_module;
 #define PIN_NONE                        "-"
 
 /* Formatting of time values */
-#if HAVE_STRPTIME
-#define TIME_FORMAT                     "%Y-%m-%dT%H:%M:%SL"
-#endif
+#define TIME_FORMAT_LOCAL               0           /* e.g., 2009-06-12T17:52:32L */
+#define TIME_FORMAT_UTC                 1           /* e.g., 2009-06-12T17:52:32Z */
+#define TIME_FORMAT_EPOCH               2           /* e.g., 1244829152 */
+#define TIME_LENGTH                     20          /* length of local or UTC timestamp */
 
 /* OTP counter algorithms */
 #define OTP_ALGORITHM_HOTP              1
@@ -91,6 +118,17 @@ module AP_MODULE_DECLARE_DATA authn_otp_module;
 #define DEFAULT_MAX_LINGER              (10 * 60)   /* 10 minutes */
 #define DEFAULT_LOGOUT_IP_CHANGE        0
 #define DEFAULT_ALLOW_FALLTHROUGH       0
+#define DEFAULT_TIME_FORMAT             TIME_FORMAT_LOCAL
+#define DEFAULT_PRECOMPUTE              0
+#define DEFAULT_RESYNC_WINDOW           0           /* resynchronization disabled */
+#define MAX_RESYNC_WINDOW               1000000
+#define DEFAULT_SESSION_LIFETIME        0           /* session cookies disabled */
+#define DEFAULT_SESSION_BIND_IP         1
+#define DEFAULT_MAX_FAILURE_RATE        0           /* no limit */
+#define DEFAULT_PIN_CACHE_TIME          0           /* PIN cache disabled */
+#define DEFAULT_PARALLEL_PIN            0
+#define DEFAULT_USERNAMELESS            0
+#define DEFAULT_USERNAMELESS_FAILURE_RATE 10        /* OTPAuthMaxFailureRate if zero with OTPAuthUsernameless on */
 
 /* PIN configuration */
 #define PIN_CONFIG_LITERAL              0
@@ -100,9 +138,107 @@ module AP_MODULE_DECLARE_DATA authn_otp_module;
 /* MobileOTP defaults */
 #define MOTP_TIME_INTERVAL              10
 
+/* MobileOTP message: decimal counter, hex key, and PIN, truncated to MOTP_MAX_MESSAGE bytes */
+#define MOTP_MAX_MESSAGE                255
+#define MOTP_MAX_COUNTER                20          /* decimal digits in a 64 bit counter */
+
 /* Buffer size for OTPs */
 #define OTP_BUF_SIZE                    16
 
+/* Per-process cache of HOTP values: number of consecutive values kept per user, and number of users */
+#define OTP_WINDOW_SIZE                 64          /* must be a power of two */
+#define OTP_WINDOW_SLOTS                256
+
+/* Tokens per user, and how otp_token_select() checks each token */
+#define OTP_MAX_TOKENS                  8           /* tokens beyond this many are ignored */
+#define OTP_SELECT_SKIP                 0           /* PIN or OTP length can't match */
+#define OTP_SELECT_WINDOW               1           /* search cached window */
+#define OTP_SELECT_SEARCH               2           /* search without caching */
+#define OTP_SELECT_RESYNC               3           /* resynchronize */
+
+/* Per-process cache of users file entries: number of users */
+#define OTP_USER_CACHE_SLOTS            256
+
+/* Per-process memo of the PIN auth provider that last recognized each user: number of users, and name length */
+#define OTP_AFFINITY_SLOTS              256
+#define MAX_PROVIDER_NAME               64
+
+/* Per-process cache of digest authentication HA1 hashes: number of users, and realm length */
+#define OTP_HA1_SLOTS                   256
+#define MAX_REALM                       128
+
+/* Per-process reverse index of the OTPs time-based tokens currently show, for logins without a username */
+#define OTP_INDEX_RELOAD_TIME           60          /* minimum seconds between reloads of a changed users file */
+#define OTP_INDEX_MAX_GROUPS            16          /* distinct time intervals indexed */
+#define OTP_INDEX_MAX_CANDIDATES        8           /* users tried for one OTP */
+#define OTP_INDEX_EMPTY                 LONG_MIN    /* token has no counters indexed yet */
+
+/* Shared memory cache of granted credentials, for reuse within the linger time: number of entries, and tag key length */
+#define OTP_LINGER_SLOTS                1024
+#define OTP_LINGER_SECRET_LEN           SHA1_DIGEST_LEN
+
+/* Shared memory counts of revocations of users' grants, which connections' last grants are checked against */
+#define OTP_REVOCATION_SLOTS            1024
+
+/* How long a rejected credential is rejected again without verifying it */
+#define OTP_REJECT_TIME                 10          /* seconds */
+
+/*
+ * Shared memory counts of wrong OTPs not yet written to the users file: number of users, and when to write them.
+ * A count is written on the user's next failure once due, or after any request using the same users file once it
+ * is OTP_FAILURE_FLUSH_TIME seconds old, so at most OTP_FAILURE_FLUSH - 1 failures per user are lost on a restart.
+ */
+#define OTP_FAILURE_SLOTS               1024
+#define OTP_FAILURE_FLUSH               8           /* after this many unwritten failures */
+#define OTP_FAILURE_FLUSH_TIME          60          /* or once the oldest unwritten failure is this old (seconds) */
+#define OTP_FAILURE_FLUSH_BATCH         8           /* most users' counts written after one request */
+
+/*
+ * Shared memory per-IP throttles of wrong passwords: number of IP addresses. Wrong passwords given without a username
+ * are also limited from all IP addresses together, since an attacker spreading guesses across many addresses may
+ * match any of the users' tokens.
+ */
+#define OTP_THROTTLE_SLOTS              1024
+#define OTP_USERNAMELESS_FAILURE_RATE   100         /* wrong passwords without username per minute, from all clients */
+
+/* Shared memory cache of PINs granted by OTPAuthPINAuthProvider providers: number of entries */
+#define OTP_PIN_SLOTS                   1024
+
+/* Verification stages, cheapest first; each request is counted at the stage that decided it */
+#define OTP_STAGE_SYNTAX                0           /* malformed password */
+#define OTP_STAGE_NEGATIVE              1           /* wrong OTP rejected recently */
+#define OTP_STAGE_THROTTLE              2           /* client IP address sent too many wrong passwords */
+#define OTP_STAGE_LINGER                3           /* granted from the linger caches */
+#define OTP_STAGE_COALESCED             4           /* took the result of a concurrent identical verification */
+#define OTP_STAGE_USER                  5           /* unknown, locked out, or logging out */
+#define OTP_STAGE_PIN                   6           /* PIN checked */
+#define OTP_STAGE_OTP                   7           /* OTP checked */
+#define OTP_STAGE_MAX                   8
+
+/* Session cookies: cookie name, and minimum key length */
+#define SESSION_COOKIE_NAME             "OTPAuthSession"
+#define SESSION_MIN_KEY                 16
+
+/* Coalescing of concurrent identical verifications: number of verifications in flight at once, and how long to wait for one */
+#define OTP_FLIGHT_SLOTS                32
+#define OTP_FLIGHT_WAIT                 5           /* seconds, then verify independently */
+
+/* Background precomputation of time-based windows: how far ahead of each time step, and for how long after a user was last seen */
+#define OTP_PRECOMPUTE_LEAD             2           /* seconds */
+#define OTP_PRECOMPUTE_IDLE             (10 * 60)   /* 10 minutes */
+
+/* Resynchronization searches: number of threads, and number of counters searched between checks for another thread's match */
+#define OTP_RESYNC_THREADS              4
+#define OTP_RESYNC_CHUNK                4096
+
+/* Offset at position "step" of a nearest-first search around "center", trying direction "dir" first */
+#define NEAREST_OFFSET(center, dir, step)   ((center) + (((step) & 1) != 0 ? (dir) : -(dir)) * (((step) + 1) / 2))
+
+/* HMAC-SHA1 definitions */
+#define SHA1_BLOCK_SIZE                 64
+#define HMAC_IPAD                       0x36
+#define HMAC_OPAD                       0x5c
+
 /* Other buffer sizes */
 #define MAX_USERNAME                    128
 #define MAX_PIN                         128
@@ -110,6 +246,7 @@ module AP_MODULE_DECLARE_DATA authn_otp_module;
 #define MAX_OTP                         128
 #define MAX_IP                          128
 #define MAX_TOKEN                       128
+#define MAX_FILE                        1024
 
 /* Per-directory configuration */
 struct otp_config {
@@ -119,9 +256,166 @@ struct otp_config {
     u_int               max_otp_failures;       /* Maximum wrong OTP values before account becomes locked, or zero for no limit */
     int                 logout_ip_change;       /* Auto-logout user if IP address changes */
     int                 allow_fallthrough;      /* Allow fall-through if OTP auth fails */
+    int                 time_format;            /* Format for timestamps written to the users file */
+    int                 resync_window;          /* Maximum counter offset searched when resynchronizing, or zero to disable */
+    int                 session_lifetime;       /* Lifetime of session cookies issued after a successful OTP, or zero to disable */
+    int                 session_bind_ip;        /* Session cookies are only valid from the IP address they were issued to */
+    struct hotp_key     *session_key;           /* HMAC state for the session cookie key */
+    char                *session_path;          /* Path session cookies apply to, or NULL for the request URI's directory */
+    int                 max_failure_rate;       /* Maximum wrong passwords per minute from one IP address, or zero for no limit */
+    int                 pin_cache_time;         /* Time for which a PIN auth provider's grant is reused, or zero */
+    int                 parallel_pin;           /* Check PINs with PIN auth providers while searching for the OTP */
+    int                 usernameless;           /* Find the user by the OTP when no username is given */
     authn_provider_list *provlist;              /* Authorization providers for checking PINs */
 };
 
+/* Per-server configuration */
+struct otp_server_config {
+    int                 precompute;             /* Precompute time-based OTP windows in a background thread */
+};
+
+/* Precomputed HMAC-SHA1 key state */
+struct hotp_key {
+    struct hmac_sha1_key state;                 /* inner and outer states for the internal SHA-1 */
+    EVP_MD_CTX          *ictx;                  /* inner hash state after absorbing (key ^ ipad), or NULL if internal */
+    EVP_MD_CTX          *octx;                  /* outer hash state after absorbing (key ^ opad), or NULL if internal */
+};
+
+/* Precomputed Mobile-OTP messages, one per batch lane; each lane holds room for the counter, the suffix, and a NUL */
+struct motp_key {
+    char                msgs[MD5_MAX_BATCH][MOTP_MAX_COUNTER + MOTP_MAX_MESSAGE + 1];
+    int                 suffix_len;             /* length of hex key plus PIN */
+};
+
+/* An OTP provided by the user, parsed once into each encoding it could represent */
+struct otp_given {
+    const char          *str;                   /* OTP as given */
+    int                 value10;                /* decimal value, or -1 if not valid decimal */
+    int                 value16;                /* hexadecimal value, or -1 if not valid hexadecimal */
+};
+
+/* Recently computed HOTP values for one user, for counters "first" through "first + count - 1" */
+struct otp_window {
+    char                username[MAX_USERNAME];
+    u_char              key[MAX_KEY];           /* key the values were computed from */
+    int                 keylen;
+    u_int               version;                /* incremented on every update */
+    time_t              last_used;              /* time of the most recent request using this window */
+    int                 time_interval;          /* user's time interval, or zero for event-based tokens */
+    long                offset;                 /* user's time slew, if time-based */
+    int                 window_lo;              /* offsets checked relative to the expected counter */
+    int                 window_hi;
+    int                 drift;                  /* average offset adjustment on success, in 1/16 steps */
+    int                 precomputed;            /* extended in the background since the last request */
+    long                first;                  /* counter of the first cached value */
+    int                 count;                  /* number of cached values, or zero if empty */
+    int                 values[OTP_WINDOW_SIZE];    /* truncated HOTP values, indexed by counter modulo OTP_WINDOW_SIZE */
+};
+
+/* HOTP values to compute together, under the keys of several tokens, and where to store each of them */
+struct otp_hash_queue {
+    int                 count;
+    const struct hmac_sha1_key *keys[OTP_MAX_TOKENS * OTP_WINDOW_SIZE];
+    uint64_t            counters[OTP_MAX_TOKENS * OTP_WINDOW_SIZE];
+    int                 *values[OTP_MAX_TOKENS * OTP_WINDOW_SIZE];
+};
+
+/* A granted or rejected credential, identified by a keyed hash of the users file, username, password, client IP, and linger time */
+struct otp_linger {
+    u_char              tag[SHA1_DIGEST_LEN];
+    char                username[MAX_USERNAME]; /* for invalidation; empty if unused */
+    time_t              expiry;                 /* end of the linger time, or of the rejection */
+    int                 rejected;               /* credential was rejected, not granted */
+    u_int               failures;               /* user's failure count in the users file when granted */
+};
+
+/* A user's wrong OTPs not yet added to the failure count in the users file */
+struct otp_failure {
+    apr_uint32_t        file_hash;              /* hash of the users file name */
+    char                username[MAX_USERNAME]; /* empty if unused */
+    u_int               pending;                /* number of unwritten failures */
+    time_t              since;                  /* time of the oldest unwritten failure */
+};
+
+/* A token bucket limiting the rate of wrong passwords from one IP address */
+struct otp_throttle {
+    char                ip[MAX_IP];             /* empty if unused */
+    double              tokens;                 /* wrong passwords allowed right now */
+    apr_time_t          updated;                /* when "tokens" was last refilled */
+};
+
+/* A PIN granted by a PIN auth provider, identified by a keyed hash of the provider name, username, and PIN */
+struct otp_pin {
+    u_char              tag[SHA1_DIGEST_LEN];
+    time_t              expiry;                 /* end of the PIN cache time; zero if unused */
+};
+
+/* Shared memory cache of credentials, unwritten failure counts, per-IP throttles, and granted PINs */
+struct otp_linger_table {
+    volatile apr_uint32_t revocations[OTP_REVOCATION_SLOTS];   /* incremented whenever a user's grants are forgotten */
+    struct otp_linger   entries[OTP_LINGER_SLOTS];
+    struct otp_failure  failures[OTP_FAILURE_SLOTS];
+    time_t              failures_due;           /* when the oldest unwritten failure count is due, or zero if none */
+    struct otp_throttle throttles[OTP_THROTTLE_SLOTS];
+    struct otp_throttle usernameless;           /* wrong passwords without username from any IP address */
+    struct otp_pin      pins[OTP_PIN_SLOTS];
+};
+
+/* The last credential granted on a connection, shared by all of its requests (and HTTP/2 streams) */
+struct otp_conn {
+    char                users_file[MAX_FILE];
+    apr_dev_t           device;                 /* state of the users file when granted */
+    apr_ino_t           inode;
+    apr_time_t          mtime;
+    apr_off_t           size;
+    char                username[MAX_USERNAME]; /* empty if none */
+    char                password[MAX_PIN + MAX_OTP];
+    char                ip[MAX_IP];
+    int                 max_linger;
+    time_t              expiry;                 /* end of the linger time */
+    u_int               failures;               /* user's failure count in the users file when granted */
+    apr_uint32_t        revocations;            /* user's shared revocation count when granted */
+};
+
+/* A verification in flight, which concurrent requests with the same credentials wait for instead of repeating */
+struct otp_flight {
+    int                 in_use;                 /* slot is in use by a leader or waiters */
+    int                 done;                   /* leader has finished; "status" is valid */
+    int                 waiters;                /* number of requests waiting for the result */
+    const struct otp_config *conf;              /* leader's configuration and strings; only valid while not done */
+    const char          *username;
+    const char          *password;
+    const char          *ip;
+    authn_status        status;                 /* leader's result */
+    int                 stage;                  /* stage that decided the leader's result */
+};
+
+/* A resynchronization search, split into jobs run by the thread pool */
+struct otp_resync {
+    const struct otp_given *given1;             /* first OTP */
+    const struct otp_given *given2;             /* second OTP, which must match at the next counter */
+    int                 counter;                /* expected counter */
+    volatile int        stop;                   /* set once any job finds a match */
+    int                 pending;                /* number of jobs not yet finished */
+    apr_thread_mutex_t  *mutex;
+    apr_thread_cond_t   *cond;                  /* signalled when the last job finishes */
+};
+
+/* An OTP search run by the thread pool while the request's thread checks the PIN with a PIN auth provider */
+struct otp_overlap {
+    struct otp_user     *user;
+    const struct otp_given *given;
+    int                 counter;
+    int                 lo;
+    int                 hi;
+    int                 drift;
+    int                 done;                   /* search has finished */
+    int                 found;                  /* whether a match was found */
+    int                 offset;                 /* offset of the match, if found */
+    apr_thread_mutex_t  *mutex;
+    apr_thread_cond_t   *cond;                  /* signalled when the search finishes */
+};
+
 /* User info structure */
 struct otp_user {
     int                 algorithm;              /* one of OTP_ALGORITHM_* */
@@ -137,24 +431,267 @@ struct otp_user {
     time_t              last_auth;
     char                last_ip[MAX_IP];
     u_int               num_otp_failures;
+    struct hotp_key     *hkey;                  /* precomputed HMAC state for key (HOTP only) */
+    struct motp_key     *mkey;                  /* precomputed message suffix (mOTP only) */
+    u_int               num_hashes;             /* number of OTP values computed while verifying */
+    int                 cached;                 /* user was found in the per-process users cache */
+    int                 token;                  /* which of the user's tokens this is, in users file order */
+    int                 num_tokens;             /* number of tokens the user has */
+};
+
+/* A cached users file entry, valid only while the users file has the same identity, modification time, and size */
+struct otp_user_entry {
+    apr_dev_t           device;
+    apr_ino_t           inode;
+    apr_time_t          mtime;
+    apr_off_t           size;
+    struct otp_user     user;                   /* user as read from the file; empty username if unused */
+};
+
+/* The PIN auth provider that last recognized a user */
+struct otp_affinity {
+    char                username[MAX_USERNAME]; /* empty if unused */
+    char                provider_name[MAX_PROVIDER_NAME];
+};
+
+/* A per-process cache: fixed-size entries, each item hashed to one slot, guarded by one mutex */
+struct otp_cache {
+    void                *slots;                 /* NULL if the cache could not be created */
+    size_t              slot_size;
+    int                 num_slots;
+    apr_thread_mutex_t  *mutex;
+};
+
+/* A digest authentication update of a user's record, made once the request turns out to be authenticated */
+struct otp_digest_commit {
+    struct otp_config   conf;
+    struct otp_user     user;                   /* user's record with the counter advanced */
+};
+
+/* A digest authentication HA1 hash, valid for the same user, key, PIN, realm, and either counter or OTP */
+struct otp_ha1 {
+    char                username[MAX_USERNAME]; /* empty if unused */
+    char                realm[MAX_REALM];
+    int                 algorithm;
+    int                 num_digits;
+    u_char              key[MAX_KEY];
+    int                 keylen;
+    char                pin[MAX_PIN];
+    int                 counter_valid;          /* whether "counter" is known */
+    int                 counter;
+    char                otp[32];                /* OTP hashed */
+    char                ha1[33];                /* hex MD5 of "username:realm:PIN+OTP" */
+};
+
+/* A time-based token in the reverse index, which indexes its OTPs for counters "first" through "first + width - 1" */
+struct otp_index_token {
+    const char          *username;
+    struct hmac_sha1_key state;
+    int                 num_digits;
+    long                offset;                 /* time slew */
+    int                 pincfg;                 /* one of PIN_CONFIG_* */
+    int                 pin_len;                /* length and hash of a literal PIN */
+    apr_uint32_t        pin_hash;
+    int                 lo;                     /* first offset indexed, relative to the expected counter */
+    int                 width;                  /* number of counters indexed */
+    long                first;                  /* first counter indexed, or OTP_INDEX_EMPTY */
+    int                 nodes;                  /* the token's nodes; the one for counter "c" is nodes + c % width */
+};
+
+/* One indexed OTP, in a doubly linked chain of the OTPs in its hash bucket */
+struct otp_index_node {
+    int                 value;                  /* OTP as a decimal value */
+    int                 token;
+    int                 next;                   /* -1 if last in bucket */
+    int                 prev;                   /* -1 if first in bucket */
+};
+
+/* The tokens with the same time interval, which all move to the next time step together */
+struct otp_index_group {
+    int                 time_interval;
+    long                step;                   /* time step the tokens are indexed for, or -1 */
+    int                 first;                  /* the group's tokens */
+    int                 count;
+};
+
+/* Reverse index from the OTPs that time-based tokens currently show to the tokens, as of a users file state */
+struct otp_index {
+    apr_pool_t          *pool;                  /* holds everything below; cleared on reload */
+    char                users_file[MAX_FILE];
+    int                 max_offset;
+    apr_dev_t           device;
+    apr_ino_t           inode;
+    apr_time_t          mtime;
+    apr_off_t           size;
+    time_t              checked;                /* when the users file was last loaded or found unchanged */
+    struct otp_index_token *tokens;
+    int                 num_tokens;
+    struct otp_index_node *nodes;
+    int                 *buckets;               /* first node in each bucket, or -1 */
+    u_int               bucket_mask;
+    struct otp_index_group groups[OTP_INDEX_MAX_GROUPS];
+    int                 num_groups;
+    int                 digit_mask;             /* bit N is set if any token has N digits */
+};
+
+/* One job of a resynchronization search: offsets "lo" through "hi" */
+struct otp_resync_job {
+    struct otp_resync   *resync;
+    struct otp_user     user;                   /* private copy, since verifying updates it */
+    struct motp_key     mkey;                   /* private copy, since computing mOTP digests updates it */
+    int                 lo;
+    int                 hi;
+    int                 found;                  /* whether a match was found */
+    int                 offset;                 /* offset of the first OTP, if found */
 };
 
 /* Internal functions */
-static authn_status find_update_user(request_rec *r, const char *usersfile, struct otp_user *const user, int update);
-static void         hotp(const u_char *key, size_t keylen, u_long counter, int ndigits, char *buf10, char *buf16, size_t buflen);
-static void         motp(const u_char *key, size_t keylen, const char *pin, u_long counter, int ndigits, char *buf, size_t buflen);
+static authn_status find_update_user(request_rec *r, const struct otp_config *conf, struct otp_user *const user, int update);
+static int          parse_user_line(char *line, const char *username, struct otp_user *entry, char *reason,
+                        size_t reason_len);
+static void         otp_cache_create(struct otp_cache *cache, int num_slots, size_t slot_size, const char *what,
+                        apr_pool_t *p, server_rec *s);
+static void         *otp_cache_slot(const struct otp_cache *cache, const char *key, const char *key2, int token);
+static void         otp_cache_lock(struct otp_cache *cache);
+static void         otp_cache_unlock(struct otp_cache *cache);
+static int          user_cache_lookup(const apr_finfo_t *finfo, struct otp_user *user);
+static void         user_cache_store(const apr_finfo_t *finfo, const struct otp_user *user);
+static int          otp_users_file_stat(request_rec *r, const struct otp_config *conf, apr_finfo_t *finfo);
+static int          otp_linger_tag(request_rec *r, const struct otp_config *conf, const apr_finfo_t *finfo,
+                        const char *username, const char *password, u_char *tag);
+static int          otp_linger_lookup(request_rec *r, const struct otp_config *conf, const char *username, const char *password);
+static void         otp_linger_reject(request_rec *r, const struct otp_config *conf, const char *username, const char *password,
+                        int time_interval);
+static void         otp_linger_store(request_rec *r, const struct otp_config *conf, const char *username, const char *password,
+                        time_t expiry, u_int failures);
+static void         otp_linger_forget(const char *username);
+static volatile apr_uint32_t *otp_revocations(const char *username);
+static struct       otp_failure *otp_failure_slot(const struct otp_config *conf, const char *username,
+                        apr_uint32_t *file_hashp);
+static u_int        otp_failure_pending(const struct otp_config *conf, const char *username);
+static int          otp_failure_defer(const struct otp_config *conf, struct otp_user *user);
+static void         otp_failure_clear(const struct otp_config *conf, const char *username);
+static void         otp_failure_add(request_rec *r, const struct otp_config *conf, const char *username);
+static void         otp_failure_flush(request_rec *r, const struct otp_config *conf);
+static int          otp_throttle_check(request_rec *r, const struct otp_config *conf);
+static void         otp_throttle_charge(request_rec *r, const struct otp_config *conf);
+static double       otp_throttle_refill(struct otp_throttle *throttle, int rate, apr_time_t now);
+static int          otp_usernameless_check(void);
+static void         otp_usernameless_charge(void);
+static int          otp_pin_tag(const char *provider_name, const char *username, const char *pin, u_char *tag);
+static authn_provider_list *otp_pin_lookup(const struct otp_config *conf, const char *username, const char *pin);
+static void         otp_pin_store(const struct otp_config *conf, const char *provider_name, const char *username,
+                        const char *pin);
+static int          otp_hmac(const struct hotp_key *hkey, const void *data, size_t len, u_char *mac);
+static int          otp_tag_slot(const u_char *tag, int num_slots);
+static int          otp_session_mac(request_rec *r, const struct otp_config *conf, const char *username, long expiry,
+                        u_char *mac);
+static const char   *otp_session_path(request_rec *r, const struct otp_config *conf);
+static void         otp_session_issue(request_rec *r, const struct otp_config *conf, const char *username);
+static void         otp_session_clear(request_rec *r, const struct otp_config *conf);
+static int          authn_otp_check_session(request_rec *r);
+static int          otp_conn_lookup(request_rec *r, const struct otp_config *conf, const apr_finfo_t *finfo,
+                        const char *username, const char *password, u_int *failuresp);
+static void         otp_conn_store(request_rec *r, const struct otp_config *conf, const apr_finfo_t *finfo,
+                        const char *username, const char *password, time_t expiry, u_int failures, apr_uint32_t revocations);
+static int          hotp_key_init(request_rec *r, struct otp_user *user);
+static int          hotp_key_absorb(struct hotp_key *hkey, const u_char *key, size_t keylen);
+static apr_status_t hotp_key_cleanup(void *data);
+static EVP_MD_CTX   *hotp_thread_ctx(void);
+static void         hotp_thread_ctx_destroy(void *data);
+static int          hotp_value(const struct hotp_key *hkey, u_long counter);
+static int          hotp_truncate(const u_char *hash);
+static void         hotp(const struct hotp_key *hkey, u_long counter, int ndigits, char *buf10, char *buf16, size_t buflen);
+static int          parse_otp(const char *otp, int ndigits, struct otp_given *given);
+static int          otp_matches(struct otp_user *user, const struct otp_given *given, u_long counter);
+static int          otp_matches_value(const struct otp_user *user, const struct otp_given *given, int value);
+static int          otp_matches_digest(const struct otp_user *user, const struct otp_given *given, const u_char *digest);
+static int          otp_search(struct otp_user *user, const struct otp_given *given, int counter, int lo, int hi, int drift, int *offsetp);
+static int          otp_search_values(const struct otp_user *user, const struct otp_given *given, const int *values,
+                        int lo, int hi, int drift, int *offsetp);
+static int          otp_search_center(int lo, int hi, int drift);
+static int          otp_resync(request_rec *r, struct otp_user *user, const struct otp_given *given1, const struct otp_given *given2,
+                        int counter, int lo, int hi, int *offsetp);
+static int          otp_resync_search(struct otp_user *user, struct otp_resync *resync, int lo, int hi, int *offsetp);
+static void         *APR_THREAD_FUNC otp_resync_thread(apr_thread_t *thread, void *data);
+static int          otp_overlap_start(request_rec *r, struct otp_overlap *overlap);
+static int          otp_overlap_finish(struct otp_overlap *overlap, int *offsetp);
+static void         *APR_THREAD_FUNC otp_overlap_thread(apr_thread_t *thread, void *data);
+static int          otp_drift(const struct otp_user *user);
+static void         otp_drift_update(const struct otp_user *user, int offset);
+static int          otp_window_values(request_rec *r, struct otp_user *user, int counter, int lo, int hi, time_t now, int *values);
+static int          otp_window_begin(request_rec *r, struct otp_user *user, int counter, int lo, int hi,
+                        struct otp_window *window, struct otp_hash_queue *queue);
+static void         otp_window_end(const struct otp_user *user, int counter, int lo, int hi, time_t now,
+                        struct otp_window *window, int *values);
+static void         otp_hash_flush(struct otp_hash_queue *queue);
+static int          otp_window_extend(struct otp_window *window, const struct hotp_key *hkey, long lo, long hi,
+                        struct otp_hash_queue *queue);
+static void         otp_precompute(time_t when);
+static void         *APR_THREAD_FUNC otp_precompute_thread(apr_thread_t *thread, void *data);
+static apr_status_t otp_precompute_cleanup(void *data);
+static void         hotp_range(const struct hotp_key *hkey, long first, int count, int *values,
+                        struct otp_hash_queue *queue);
+static void         motp_key_init(request_rec *r, struct otp_user *user);
+static void         motp(struct motp_key *mkey, u_long counter, int ndigits, char *buf, size_t buflen);
+static void         motp_digests(struct motp_key *mkey, const uint64_t *counters, int count, u_char (*digests)[MD5_DIGEST_LEN]);
 static int          parse_token_type(const char *type, struct otp_user *tokinfo);
-static apr_status_t print_user(apr_file_t *file, const struct otp_user *user);
+static apr_status_t print_user(apr_file_t *file, const struct otp_user *user, int time_format);
+static int          parse_timestamp(const char *s, time_t *tp);
+static void         format_timestamp(char *buf, time_t when, int time_format);
+static int          parse_digits(const char *s, int len);
+static void         format_digits(char *buf, long value, int len);
+static long         days_from_civil(long year, int month, int day);
+static void         civil_from_days(long days, long *yearp, int *monthp, int *dayp);
 static void         printhex(char *buf, size_t buflen, const u_char *data, size_t dlen, int max_digits);
 static authn_status authn_otp_check_pin(request_rec *r, struct otp_config *const conf, struct otp_user *const user, const char *pin);
 static authn_status authn_otp_check_pin_external(request_rec *r, struct otp_config *const conf, const char *user, const char *pin);
+static authn_status otp_pin_provider_check(request_rec *r, authn_provider_list *pentry, const char *username,
+                        const char *pin);
+static authn_provider_list *otp_affinity_lookup(const struct otp_config *conf, const char *username, int *positionp);
+static void         otp_affinity_store(const char *username, const char *provider_name);
+static int          otp_ha1_lookup(const struct otp_user *user, const char *realm, const char *otp, int counter, char *otpbuf,
+                        char *ha1);
+static void         otp_ha1_store(const struct otp_user *user, const char *realm, int counter_valid, int counter,
+                        const char *otp, const char *ha1);
 static authn_status authn_otp_check_password(request_rec *r, const char *username, const char *password);
+static authn_status authn_otp_verify_password(request_rec *r, struct otp_config *const conf, const char *username,
+                        const char *password, int probe, int *stagep, int *intervalp);
+static int          otp_flight_begin(request_rec *r, const struct otp_config *conf, const char *username,
+                        const char *password, struct otp_flight **flightp, authn_status *statusp, int *stagep);
+static void         otp_flight_end(struct otp_flight *flight, authn_status status, int stage);
+static int          otp_config_equivalent(const struct otp_config *conf1, const struct otp_config *conf2);
+static int          otp_expected_counter(const struct otp_config *conf, const struct otp_user *user, time_t now,
+                        int *lop, int *hip);
+static int          otp_token_select(request_rec *r, struct otp_config *conf, struct otp_user *tokens, int num_tokens,
+                        const char *password, time_t now, int *searchedp, int *offsetp, int *pin_checkedp);
+static authn_status authn_otp_check_usernameless(request_rec *r, struct otp_config *const conf, const char *password);
+static int          otp_index_lookup(request_rec *r, const struct otp_config *conf, const char *password,
+                        char **candidates);
+static int          otp_index_load(request_rec *r, const struct otp_config *conf, const apr_finfo_t *finfo, time_t now);
+static void         otp_index_advance(struct otp_index *index, struct otp_index_group *group, long step);
+static void         otp_index_compute(struct otp_index *index, const struct hmac_sha1_key *const *keys,
+                        const uint64_t *counters, const int *nodes, int count);
+static u_int        otp_index_bucket(const struct otp_index *index, int value, int digits);
+static void         otp_index_link(struct otp_index *index, int n);
+static void         otp_index_unlink(struct otp_index *index, int n);
 static authn_status authn_otp_get_realm_hash(request_rec *r, const char *username, const char *realm, char **rethash);
 static void         *create_authn_otp_dir_config(apr_pool_t *p, char *d);
 static void         *merge_authn_otp_dir_config(apr_pool_t *p, void *base_conf, void *new_conf);
+static void         *create_authn_otp_server_config(apr_pool_t *p, server_rec *s);
+static void         *merge_authn_otp_server_config(apr_pool_t *p, void *base_conf, void *new_conf);
 static const char   *add_authn_provider(cmd_parms *cmd, void *config, const char *provider_name);
+static const char   *set_time_format(cmd_parms *cmd, void *config, const char *arg);
+static const char   *set_precompute(cmd_parms *cmd, void *config, int flag);
+static const char   *set_resync_window(cmd_parms *cmd, void *config, const char *arg);
+static const char   *set_session_key_file(cmd_parms *cmd, void *config, const char *arg);
 static void         copy_provider_list(apr_pool_t *p, authn_provider_list **dstp, authn_provider_list *src);
-static struct       otp_config *get_config(request_rec *r);
+static struct       otp_config *get_config(request_rec *r, struct otp_config *conf);
+static int          authn_otp_status(request_rec *r, int flags);
+static int          authn_otp_pre_connection(conn_rec *c, void *csd);
+static int          authn_otp_log_transaction(request_rec *r);
+static int          authn_otp_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s);
+static void         authn_otp_child_init(apr_pool_t *p, server_rec *s);
 static void         register_hooks(apr_pool_t *p);
 
 /* Powers of ten */
@@ -163,14 +700,100 @@ static const int    powers10[] = { 10, 100, 1000, 10000, 100000, 1000000, 100000
 /* Mutex to augment file locking for multi-threaded processes */
 static apr_thread_mutex_t *mutex;
 
+/* SHA-1 digest, fetched once per child process */
+static const EVP_MD *sha1_md;
+
+/* Internal SHA-1 implementation selected for this process, or NULL to use OpenSSL */
+static const char   *sha1_impl;
+
+/* Internal MD5 implementation selected for this process, or NULL to use OpenSSL */
+static const char   *md5_impl;
+
+/* Thread-local scratch digest context reused by hotp() */
+static apr_threadkey_t *hotp_ctx_key;
+
+/* Mutex protecting per-connection caches, which HTTP/2 streams access concurrently */
+static apr_thread_mutex_t *otp_conn_mutex;
+
+/* Verifications in flight in this process, and the condition variable signalled when any of them finishes */
+static struct otp_flight otp_flights[OTP_FLIGHT_SLOTS];
+static apr_thread_mutex_t *otp_flight_mutex;
+static apr_thread_cond_t *otp_flight_cond;
+
+/* Per-process cache of users file entries (struct otp_user_entry), hashed by username and token */
+static struct otp_cache user_cache;
+
+/* Per-process memo of the PIN auth provider that last recognized each user (struct otp_affinity), hashed by username */
+static struct otp_cache otp_affinity_cache;
+
+/* Per-process cache of digest authentication HA1 hashes (struct otp_ha1), hashed by username and realm */
+static struct otp_cache otp_ha1_cache;
+
+/* Per-process reverse index of current time-based OTPs, for OTPAuthUsernameless */
+static struct otp_index otp_index;
+static apr_thread_mutex_t *otp_index_mutex;
+
+/* Number of PIN auth provider calls made, and avoided by trying each user's last provider first, for mod_status */
+static volatile apr_uint32_t otp_pin_calls;
+static volatile apr_uint32_t otp_pin_calls_saved;
+
+/* Shared memory caches and throttles, created before forking children, and the key for credential tags */
+static apr_shm_t    *otp_linger_shm;
+static struct otp_linger_table *otp_linger_table;
+static struct otp_linger *otp_lingers;
+static apr_global_mutex_t *otp_linger_mutex;
+static u_char       otp_linger_secret[OTP_LINGER_SECRET_LEN];
+static struct hotp_key otp_linger_key;          /* HMAC state for the key, per process */
+
+/* Per-process cache of recently computed HOTP values (struct otp_window), hashed by username and token */
+static struct otp_cache otp_window_cache;
+
+/* Background thread precomputing time-based windows; signalled via the condition variable to exit */
+static apr_thread_t *otp_precompute_tid;
+static apr_thread_cond_t *otp_precompute_cond;
+static int          otp_precompute_stop;
+
+/* When this process last looked for unwritten failure counts that are due */
+static time_t       otp_failure_scanned;
+
+/* Number of time-based requests whose values were, or were not, already computed in the background, for mod_status */
+static volatile apr_uint32_t otp_precompute_hits;
+static volatile apr_uint32_t otp_precompute_misses;
+
+/* Thread pool for resynchronization searches, and for OTP searches overlapping PIN auth provider calls */
+static apr_thread_pool_t *otp_resync_pool;
+
+/* Number of OTP verifications and of OTP values computed for them by this process, for mod_status */
+static volatile apr_uint32_t otp_num_verifies;
+static volatile apr_uint32_t otp_num_hashes;
+
+/* Number of reuses of a cached user's OTP verified, and (with pool debugging) the bytes allocated for them, for mod_status */
+static volatile apr_uint32_t otp_reuse_verifies;
+#if APR_POOL_DEBUG
+static volatile apr_uint32_t otp_reuse_bytes;
+#endif
+
+/* Number of time-based OTPs accepted, and of those found at the offset predicted by the user's drift, for mod_status */
+static volatile apr_uint32_t otp_drift_accepts;
+static volatile apr_uint32_t otp_drift_predicted;
+
+/* Number of requests decided at each verification stage by this process, for mod_status */
+static volatile apr_uint32_t otp_stage_counts[OTP_STAGE_MAX];
+static const char   *const otp_stage_names[OTP_STAGE_MAX] = {
+    "Syntax", "NegativeCache", "Throttle", "LingerCache", "Coalesced", "UserState", "PIN", "OTP"
+};
+
 /*
- * Find/update a user in the users file.
+ * Find/update a user in the users file. A user may have several tokens, one per valid entry with the user's
+ * username; "user->token" selects which one, in the order they appear in the file, and "user->num_tokens"
+ * is set to how many there are.
  *
- * Note: finding, the "user" structure must be initialized with zeroes.
+ * Note: finding, the "user" structure must be initialized with zeroes (other than the username and token).
  */
 static authn_status
-find_update_user(request_rec *r, const char *usersfile, struct otp_user *const user, const int update)
+find_update_user(request_rec *r, const struct otp_config *conf, struct otp_user *const user, const int update)
 {
+    const char *const usersfile = conf->users_file;
     char invalid_reason[128];
     char newusersfile[APR_PATH_MAX];
     char lockusersfile[APR_PATH_MAX];
@@ -178,11 +801,23 @@ find_update_user(request_rec *r, const char *usersfile, struct otp_user *const u
     apr_file_t *file = NULL;
     apr_file_t *newfile = NULL;
     apr_file_t *lockfile = NULL;
+    apr_finfo_t finfo;
     apr_status_t status;
+    int got_finfo = 0;
     int got_mutex = 0;
     char errbuf[64];
+    int num_tokens = 0;
     int found = 0;
     int linenum;
+    int token;
+
+    /* If finding, use the cached entry if the users file hasn't changed since it was read */
+    if (!update && user_cache.slots != NULL
+      && apr_stat(&finfo, usersfile, APR_FINFO_IDENT|APR_FINFO_MTIME|APR_FINFO_SIZE, r->pool) == APR_SUCCESS) {
+        if (user_cache_lookup(&finfo, user))
+            return AUTH_USER_FOUND;
+        got_finfo = 1;
+    }
 
     /* If updating, open and lock lockfile and grab mutex */
     if (update) {
@@ -230,169 +865,38 @@ find_update_user(request_rec *r, const char *usersfile, struct otp_user *const u
     /* Scan entries */
     for (linenum = 1; apr_file_gets(linebuf, sizeof(linebuf), file) == 0; linenum++) {
         struct otp_user tokinfo;
-        int nibs[2];
         char linecopy[1024];
-        char *fields[4];
-        int field_count;
-        char *fail_count;
-        char *timestamp;
-        char *last_otp;
-        char *last_ip;
-        char *last;
-        char *s;
-        int i;
 
         /* Save a copy of the line */
         apr_snprintf(linecopy, sizeof(linecopy), "%s", linebuf);
 
-        /* Ignore lines starting with '#' and empty lines */
-        if (*linebuf == '#')
-            goto copy;
-        if ((s = apr_strtok(linebuf, WHITESPACE, &last)) == NULL)
-            goto copy;
-
-        /* Parse token type */
-        if (parse_token_type(s, &tokinfo) != 0) {
-            apr_snprintf(invalid_reason, sizeof(invalid_reason), "invalid token type \"%s\"", s);
-            goto invalid;
-        }
-
-        /* Get username */
-        if ((s = apr_strtok(NULL, WHITESPACE, &last)) == NULL) {
-            apr_snprintf(invalid_reason, sizeof(invalid_reason), "missing username field");
+        /* Parse the line if it's an entry for the user we're interested in */
+        switch (parse_user_line(linebuf, user->username, &tokinfo, invalid_reason, sizeof(invalid_reason))) {
+        case -1:
             goto invalid;
+        case 1:
+            goto copy;
+        default:
+            break;
         }
 
-        /* Is this the user we're interested in? */
-        if (strcmp(s, user->username) != 0)
+        /* Each valid entry for the user is one of the user's tokens; is this the token we're interested in? */
+        if (num_tokens++ != user->token)
             goto copy;
         found = 1;
 
         /* If we're updating, print out updated user info to new file */
         if (update) {
-            if ((status = print_user(newfile, user)) != 0)
+            if ((status = print_user(newfile, user, conf->time_format)) != 0)
                 goto write_error;
             continue;
         }
 
-        /* Initialize user record */
-        memset(user, 0, sizeof(*user));
-        apr_snprintf(user->username, sizeof(user->username), "%s", s);
-        user->algorithm = tokinfo.algorithm;
-        user->time_interval = tokinfo.time_interval;
-        user->num_digits = tokinfo.num_digits;
-
-        /* Read PIN and decode special values */
-        if ((s = apr_strtok(NULL, WHITESPACE, &last)) == NULL) {
-            apr_snprintf(invalid_reason, sizeof(invalid_reason), "missing PIN field");
-            goto invalid;
-        }
-        if (strcmp(s, PIN_NONE) == 0) {
-            *s = '\0';
-            user->pincfg = PIN_CONFIG_NONE;
-        } else if (strcmp(s, PIN_EXTERNAL) == 0) {
-            *s = '\0';
-            user->pincfg = PIN_CONFIG_EXTERNAL;
-        } else
-            user->pincfg = PIN_CONFIG_LITERAL;
-        apr_snprintf(user->pin, sizeof(user->pin), "%s", s);
-
-        /* Read key */
-        if ((s = apr_strtok(NULL, WHITESPACE, &last)) == NULL) {
-            apr_snprintf(invalid_reason, sizeof(invalid_reason), "missing token key field");
-            goto invalid;
-        }
-        for (user->keylen = 0; user->keylen < sizeof(user->key) && *s != '\0'; user->keylen++) {
-            for (i = 0; i < 2; i++) {
-                if (apr_isdigit(*s))
-                    nibs[i] = *s - '0';
-                else if (apr_isxdigit(*s))
-                    nibs[i] = apr_tolower(*s) - 'a' + 10;
-                else {
-                    apr_snprintf(invalid_reason, sizeof(invalid_reason), "invalid key starting with \"%s\"", s);
-                    goto invalid;
-                }
-                s++;
-            }
-            user->key[user->keylen] = (nibs[0] << 4) | nibs[1];
-        }
-
-        /* Read offset (optional) */
-        if ((s = apr_strtok(NULL, WHITESPACE, &last)) == NULL)
-            goto found;
-        user->offset = atol(s);
-
-        /*
-         * At this point, we will read one of the following remaining field combinations. The reason
-         * for these cases is because of backward compatibility with older versions of the users file.
-         *
-         * 0. No more fields
-         * 1. Fail count
-         * 2. Fail count, Last OTP, Timestamp, IP Address
-         * 3. Last OTP, Timestamp
-         * 4. Last OTP, Timestamp, IP Address
-         *
-         * Note that in each case, a different number of fields is found, so we can use the field count
-         * to determine which case we're in.
-         */
-        for (i = field_count = 0; i < 4; i++) {
-            if ((fields[i] = apr_strtok(NULL, WHITESPACE, &last)) != NULL)
-                field_count++;
-        }
-
-        /* Interpret fields based on cases 0..4 */
-        i = 0;
-        fail_count = (field_count < 2 || field_count == 4) ? fields[i++] : NULL;
-        last_otp = fields[i++];
-        timestamp = fields[i++];
-        last_ip = fields[i++];
-
-        /* Parse OTP failure count (if any) */
-        if (fail_count != NULL)
-            user->num_otp_failures = atoi(fail_count);
-
-        /* Parse last used OTP and parse last successful authentication timestamp (if any) */
-        if (last_otp != NULL && timestamp != NULL) {
-#if HAVE_STRPTIME
-            struct tm tm;
-#else
-            char *eptr;
-            u_long secs;
-#endif
-
-            /* Copy last used OTP */
-            apr_snprintf(user->last_otp, sizeof(user->last_otp), "%s", last_otp);
-
-            /* Parse last successful authentication timestamp */
-#if HAVE_STRPTIME
-            if ((s = strptime(timestamp, TIME_FORMAT, &tm)) == NULL || *s != '\0') {
-                apr_snprintf(invalid_reason, sizeof(invalid_reason), "invalid auth timestamp \"%s\"", timestamp);
-                goto invalid;
-            }
-            tm.tm_isdst = -1;
-            user->last_auth = mktime(&tm);
-#else
-            secs = strtol(timestamp, &eptr, 10);
-            if (secs == LONG_MIN || secs == LONG_MAX || *eptr != '\0') {
-                apr_snprintf(invalid_reason, sizeof(invalid_reason), "invalid auth timestamp \"%s\"", timestamp);
-                goto invalid;
-            }
-            user->last_auth = (time_t)secs;
-#endif
-        }
-
-        /* Copy last used IP address (if any) */
-        if (last_ip != NULL)
-            apr_snprintf(user->last_ip, sizeof(user->last_ip), "%s", last_ip);
-
-found:
-        /* We are not updating; return the user we found */
-        AP_DEBUG_ASSERT(!update);
-        AP_DEBUG_ASSERT(newfile == NULL);
-        AP_DEBUG_ASSERT(lockfile == NULL);
-        AP_DEBUG_ASSERT(!got_mutex);
-        apr_file_close(file);
-        return AUTH_USER_FOUND;
+        /* Return this token's record, but keep counting the user's tokens */
+        token = user->token;
+        memcpy(user, &tokinfo, sizeof(*user));
+        user->token = token;
+        continue;
 
 invalid:
         /* Report invalid entry (but copy it anyway) */
@@ -411,6 +915,17 @@ copy:
     apr_file_close(file);
     file = NULL;
 
+    /* If we're not updating, return the token we found, caching it under the file's state from before we read it */
+    if (!update && found) {
+        user->num_tokens = num_tokens;
+        AP_DEBUG_ASSERT(newfile == NULL);
+        AP_DEBUG_ASSERT(lockfile == NULL);
+        AP_DEBUG_ASSERT(!got_mutex);
+        if (got_finfo)
+            user_cache_store(&finfo, user);
+        return AUTH_USER_FOUND;
+    }
+
     /* If we're not updating and we get here, then the user was not found */
     if (!update) {
         ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "user \"%s\" not found in OTP users file \"%s\"", user->username, usersfile);
@@ -432,6 +947,11 @@ copy:
         goto fail;
     }
 
+    /* Cache the user as just written; we still hold the lock, so the file can't have changed again */
+    if (found && user_cache.slots != NULL
+      && apr_stat(&finfo, usersfile, APR_FINFO_IDENT|APR_FINFO_MTIME|APR_FINFO_SIZE, r->pool) == APR_SUCCESS)
+        user_cache_store(&finfo, user);
+
     /* Close (and implicitly unlock) lock file and release mutex */
     apr_file_close(lockfile);
     lockfile = NULL;
@@ -460,377 +980,2914 @@ fail:
 }
 
 /*
- * Parse a token type string such as "HOTP/T30/6".
- * Returns 0 if successful, else -1 on parse error.
+ * Parse a users file line into "entry". If "username" is not NULL, entries for other users are not parsed.
+ * Returns 0 if successful, 1 if the line is a comment, blank, or for another user, or -1 if it's invalid,
+ * in which case the reason is written to "reason".
  */
 static int
-parse_token_type(const char *type, struct otp_user *tokinfo)
+parse_user_line(char *line, const char *username, struct otp_user *entry, char *reason, size_t reason_len)
 {
-    char tokbuf[MAX_TOKEN];
+    char *fields[4];
+    int field_count;
+    char *fail_count;
+    char *timestamp;
+    char *last_otp;
+    char *last_ip;
+    int nibs[2];
     char *last;
-    char *eptr;
-    char *t;
+    char *s;
+    int i;
 
-    /* Backwards compatibility hack */
-    if (strcmp(type, "E") == 0)
-        type = "HOTP/E";
-    else if (strcmp(type, "T") == 0)
-        type = "HOTP/T30";
+    /* Ignore lines starting with '#' and empty lines */
+    if (*line == '#')
+        return 1;
+    if ((s = apr_strtok(line, WHITESPACE, &last)) == NULL)
+        return 1;
 
-    /* Initialize */
-    memset(tokinfo, 0, sizeof(*tokinfo));
-    apr_snprintf(tokbuf, sizeof(tokbuf), "%s", type);
+    /* Parse token type */
+    if (parse_token_type(s, entry) != 0) {
+        apr_snprintf(reason, reason_len, "invalid token type \"%s\"", s);
+        return -1;
+    }
 
-    /* Parse algorithm */
-    if ((t = apr_strtok(tokbuf, "/", &last)) == NULL)
+    /* Get username */
+    if ((s = apr_strtok(NULL, WHITESPACE, &last)) == NULL) {
+        apr_snprintf(reason, reason_len, "missing username field");
         return -1;
+    }
 
-    /* Apply per-algorithm defaults */
-    if (strcasecmp(t, "HOTP") == 0) {
-        tokinfo->algorithm = OTP_ALGORITHM_HOTP;
-        tokinfo->time_interval = 0;
-        tokinfo->num_digits = DEFAULT_NUM_DIGITS;
-    } else if (strcasecmp(t, "MOTP") == 0) {
-        tokinfo->algorithm = OTP_ALGORITHM_MOTP;
-        tokinfo->time_interval = MOTP_TIME_INTERVAL;
-        tokinfo->num_digits = DEFAULT_NUM_DIGITS;
+    /* Is this the user we're interested in? */
+    if (username != NULL && strcmp(s, username) != 0)
+        return 1;
+    apr_snprintf(entry->username, sizeof(entry->username), "%s", s);
+
+    /* Read PIN and decode special values */
+    if ((s = apr_strtok(NULL, WHITESPACE, &last)) == NULL) {
+        apr_snprintf(reason, reason_len, "missing PIN field");
+        return -1;
+    }
+    if (strcmp(s, PIN_NONE) == 0) {
+        *s = '\0';
+        entry->pincfg = PIN_CONFIG_NONE;
+    } else if (strcmp(s, PIN_EXTERNAL) == 0) {
+        *s = '\0';
+        entry->pincfg = PIN_CONFIG_EXTERNAL;
     } else
+        entry->pincfg = PIN_CONFIG_LITERAL;
+    apr_snprintf(entry->pin, sizeof(entry->pin), "%s", s);
+
+    /* Read key */
+    if ((s = apr_strtok(NULL, WHITESPACE, &last)) == NULL) {
+        apr_snprintf(reason, reason_len, "missing token key field");
         return -1;
+    }
+    for (entry->keylen = 0; entry->keylen < sizeof(entry->key) && *s != '\0'; entry->keylen++) {
+        for (i = 0; i < 2; i++) {
+            if (apr_isdigit(*s))
+                nibs[i] = *s - '0';
+            else if (apr_isxdigit(*s))
+                nibs[i] = apr_tolower(*s) - 'a' + 10;
+            else {
+                apr_snprintf(reason, reason_len, "invalid key starting with \"%s\"", s);
+                return -1;
+            }
+            s++;
+        }
+        entry->key[entry->keylen] = (nibs[0] << 4) | nibs[1];
+    }
 
-    /* Parse token type: event or time-based */
-    if ((t = apr_strtok(NULL, "/", &last)) == NULL)
+    /* Read offset (optional) */
+    if ((s = apr_strtok(NULL, WHITESPACE, &last)) == NULL)
         return 0;
-    if (strcmp(t, "E") == 0)
-        tokinfo->time_interval = 0;
-    else if (*t == 'T') {
-        if (!isdigit(*++t))
-            return -1;
-        tokinfo->time_interval = strtol(t, &eptr, 10);
-        if (tokinfo->time_interval <= 0 || *eptr != '\0')
+    entry->offset = atol(s);
+
+    /*
+     * At this point, we will read one of the following remaining field combinations. The reason
+     * for these cases is because of backward compatibility with older versions of the users file.
+     *
+     * 0. No more fields
+     * 1. Fail count
+     * 2. Fail count, Last OTP, Timestamp, IP Address
+     * 3. Last OTP, Timestamp
+     * 4. Last OTP, Timestamp, IP Address
+     *
+     * Note that in each case, a different number of fields is found, so we can use the field count
+     * to determine which case we're in.
+     */
+    for (i = field_count = 0; i < 4; i++) {
+        if ((fields[i] = apr_strtok(NULL, WHITESPACE, &last)) != NULL)
+            field_count++;
+    }
+
+    /* Interpret fields based on cases 0..4 */
+    i = 0;
+    fail_count = (field_count < 2 || field_count == 4) ? fields[i++] : NULL;
+    last_otp = fields[i++];
+    timestamp = fields[i++];
+    last_ip = fields[i++];
+
+    /* Parse OTP failure count (if any) */
+    if (fail_count != NULL)
+        entry->num_otp_failures = atoi(fail_count);
+
+    /* Parse last used OTP and parse last successful authentication timestamp (if any) */
+    if (last_otp != NULL && timestamp != NULL) {
+        /* Copy last used OTP */
+        apr_snprintf(entry->last_otp, sizeof(entry->last_otp), "%s", last_otp);
+
+        /* Parse last successful authentication timestamp */
+        if (parse_timestamp(timestamp, &entry->last_auth) != 0) {
+            apr_snprintf(reason, reason_len, "invalid auth timestamp \"%s\"", timestamp);
             return -1;
-    } else
-        return -1;
+        }
+    }
 
-    /* Parse #digits */
-    if ((t = apr_strtok(NULL, "/", &last)) == NULL)
-        return 0;
-    if (!isdigit(*t))
-        return -1;
-    tokinfo->num_digits = strtol(t, &eptr, 10);
-    if (tokinfo->num_digits <= 0 || *eptr != '\0' || tokinfo->num_digits > sizeof(powers10) / sizeof(*powers10))
-        return -1;
+    /* Copy last used IP address (if any) */
+    if (last_ip != NULL)
+        apr_snprintf(entry->last_ip, sizeof(entry->last_ip), "%s", last_ip);
 
     /* Done */
     return 0;
 }
 
-static apr_status_t
-print_user(apr_file_t *file, const struct otp_user *user)
+/*
+ * Create a per-process cache of "num_slots" zeroed entries of "slot_size" bytes. If that fails, the cache's slots
+ * are left NULL, and its users work without it.
+ */
+static void
+otp_cache_create(struct otp_cache *cache, int num_slots, size_t slot_size, const char *what, apr_pool_t *p, server_rec *s)
 {
-    const char *pinstr = NULL;
-    const char *alg;
-    char cbuf[64];
-    char nbuf[64];
-    char tbuf[MAX_TOKEN];
-    int i;
+    apr_status_t status;
+    char errbuf[64];
 
-    /* Format token type sub-fields */
-    switch (user->algorithm) {
-    case OTP_ALGORITHM_HOTP:
-        alg = "HOTP";
-        break;
-    case OTP_ALGORITHM_MOTP:
-        alg = "MOTP";
-        break;
-    default:
-        abort();
+    if (cache->slots != NULL)
+        return;
+    if ((status = apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT, p)) != 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "can't create OTP %s mutex: %s",
+          what, apr_strerror(status, errbuf, sizeof(errbuf)));
+        return;
     }
-    if (user->time_interval == 0)
-        apr_snprintf(cbuf, sizeof(cbuf), "/E");
-    else
-        apr_snprintf(cbuf, sizeof(cbuf), "/T%d", user->time_interval);
-    apr_snprintf(nbuf, sizeof(nbuf), "/%d", user->num_digits);
+    cache->slot_size = slot_size;
+    cache->num_slots = num_slots;
+    cache->slots = apr_pcalloc(p, (apr_size_t)num_slots * slot_size);
+}
 
-    /* Abbreviate when default values apply */
-    if (user->num_digits == DEFAULT_NUM_DIGITS) {
-        *nbuf = '\0';
-        if (user->algorithm == OTP_ALGORITHM_HOTP && user->time_interval == 0)
-            *cbuf = '\0';
-        else if (user->algorithm == OTP_ALGORITHM_MOTP && user->time_interval == 10)
-            *cbuf = '\0';
-    }
-    apr_snprintf(tbuf, sizeof(tbuf), "%s%s%s", alg, cbuf, nbuf);
+/*
+ * Get the slot for an item of a per-process cache, hashed from its key, an optional second key, and a token number.
+ * The slot may hold another item; callers compare the keys stored in it while holding the cache's lock.
+ */
+static void *
+otp_cache_slot(const struct otp_cache *cache, const char *key, const char *key2, int token)
+{
+    apr_ssize_t len = APR_HASH_KEY_STRING;
+    apr_ssize_t len2 = APR_HASH_KEY_STRING;
+    u_int hash;
+
+    hash = apr_hashfunc_default(key, &len);
+    if (key2 != NULL)
+        hash ^= apr_hashfunc_default(key2, &len2);
+    return (char *)cache->slots + ((hash + token) % cache->num_slots) * cache->slot_size;
+}
 
-    /* Get PIN representation */
-    switch (user->pincfg) {
-    case PIN_CONFIG_LITERAL:
-        pinstr = user->pin;
-        break;
-    case PIN_CONFIG_NONE:
-        pinstr = PIN_NONE;
-        break;
-    case PIN_CONFIG_EXTERNAL:
-        pinstr = PIN_EXTERNAL;
-        break;
-    default:
-        abort();
-    }
+static void
+otp_cache_lock(struct otp_cache *cache)
+{
+    apr_thread_mutex_lock(cache->mutex);
+}
 
-    /* Print line in users file */
-    apr_file_printf(file, "%-7s %-13s %-7s ", tbuf, user->username, pinstr);
-    for (i = 0; i < user->keylen; i++)
-        apr_file_printf(file, "%02x", user->key[i]);
-    apr_file_printf(file, " %-3ld %-2u", user->offset, user->num_otp_failures);
-    if (*user->last_otp != '\0') {
-#if HAVE_STRPTIME
-        strftime(tbuf, sizeof(tbuf), TIME_FORMAT, localtime(&user->last_auth));
-#else
-        apr_snprintf(tbuf, sizeof(tbuf), "%lu", (u_long)user->last_auth);
-#endif
-        apr_file_printf(file, " %-7s %s %s", user->last_otp, tbuf, user->last_ip);
+static void
+otp_cache_unlock(struct otp_cache *cache)
+{
+    apr_thread_mutex_unlock(cache->mutex);
+}
+
+/*
+ * Look up a user in the per-process users cache. The entry is only used if the users file still has the identity,
+ * modification time, and size recorded when the entry was read; every update replaces the file, so any change
+ * anywhere in the file invalidates all entries. Returns 1 if found, otherwise zero.
+ */
+static int
+user_cache_lookup(const apr_finfo_t *finfo, struct otp_user *user)
+{
+    struct otp_user_entry *const entry = otp_cache_slot(&user_cache, user->username, NULL, user->token);
+    int found = 0;
+
+    otp_cache_lock(&user_cache);
+    if (entry->device == finfo->device && entry->inode == finfo->inode
+      && entry->mtime == finfo->mtime && entry->size == finfo->size
+      && strcmp(entry->user.username, user->username) == 0 && entry->user.token == user->token) {
+        memcpy(user, &entry->user, sizeof(*user));
+        user->cached = 1;
+        found = 1;
     }
-    return apr_file_putc('\n', file);
+    otp_cache_unlock(&user_cache);
+    return found;
 }
 
 /*
- * Generate an OTP using the algorithm specified in RFC 4226,
+ * Store a user in the per-process users cache, as read from or written to the users file in the given state.
  */
 static void
-hotp(const u_char *key, size_t keylen, u_long counter, int ndigits, char *buf10, char *buf16, size_t buflen)
+user_cache_store(const apr_finfo_t *finfo, const struct otp_user *user)
 {
-    const int max10 = sizeof(powers10) / sizeof(*powers10);
-    const int max16 = 8;
-    const EVP_MD *sha1_md = EVP_sha1();
+    struct otp_user_entry *const entry = otp_cache_slot(&user_cache, user->username, NULL, user->token);
+
+    otp_cache_lock(&user_cache);
+    entry->device = finfo->device;
+    entry->inode = finfo->inode;
+    entry->mtime = finfo->mtime;
+    entry->size = finfo->size;
+    memcpy(&entry->user, user, sizeof(entry->user));
+    entry->user.hkey = NULL;
+    entry->user.mkey = NULL;
+    entry->user.num_hashes = 0;
+    entry->user.cached = 0;
+    otp_cache_unlock(&user_cache);
+}
+
+/*
+ * Get the identity, modification time, and size of the users file. Any change to any user's record, including
+ * by an administrator, changes at least one of them. Returns zero on success.
+ */
+static int
+otp_users_file_stat(request_rec *r, const struct otp_config *conf, apr_finfo_t *finfo)
+{
+    return apr_stat(finfo, conf->users_file, APR_FINFO_IDENT|APR_FINFO_MTIME|APR_FINFO_SIZE, r->pool) == APR_SUCCESS ? 0 : -1;
+}
+
+/*
+ * Compute the tag identifying a granted password: HMAC-SHA1, under a key chosen at startup, of everything the
+ * linger reuse check depends on. The client IP is always included, so a cached grant never bypasses the
+ * OTPAuthLogoutOnIPChange check; requests from a new IP address go through the users file. So is the state of
+ * the users file, so a grant doesn't survive any change to it, e.g., a user's removal or a new key; the next
+ * request goes through the users file instead. Returns zero on success.
+ */
+static int
+otp_linger_tag(request_rec *r, const struct otp_config *conf, const apr_finfo_t *finfo,
+    const char *username, const char *password, u_char *tag)
+{
+    char buf[1024];
+    int len;
+
+    /* Encode the fields, separated by NUL bytes since none of them can contain one */
+    len = apr_snprintf(buf, sizeof(buf), "%s%c%s%c%s%c%s%c%d%c%" APR_UINT64_T_FMT "%c%" APR_UINT64_T_FMT
+      "%c%" APR_TIME_T_FMT "%c%" APR_OFF_T_FMT, conf->users_file, '\0', username, '\0', password, '\0',
+      USER_AGENT_IP(r), '\0', conf->max_linger, '\0', (apr_uint64_t)finfo->device, '\0', (apr_uint64_t)finfo->inode,
+      '\0', finfo->mtime, '\0', finfo->size);
+    if (len >= sizeof(buf) - 1)
+        return -1;
+    return otp_hmac(&otp_linger_key, buf, len, tag);
+}
+
+/*
+ * Compute HMAC-SHA1 of some data by resuming from a key's precomputed OpenSSL inner and outer states.
+ * Like hotp_value(), this falls back to a temporary context if the thread has no scratch context.
+ * Returns zero on success.
+ */
+static int
+otp_hmac(const struct hotp_key *hkey, const void *data, size_t len, u_char *mac)
+{
+    EVP_MD_CTX *temp_ctx = NULL;
+    EVP_MD_CTX *ctx;
     u_char hash[EVP_MAX_MD_SIZE];
     u_int hash_len;
-    u_char tosign[8];
-    int offset;
-    int value;
-    int i;
+    int ret = -1;
 
-    /* Encode counter */
-    for (i = sizeof(tosign) - 1; i >= 0; i--) {
-        tosign[i] = counter & 0xff;
-        counter >>= 8;
+    if ((ctx = hotp_thread_ctx()) == NULL && (ctx = temp_ctx = EVP_MD_CTX_create()) == NULL)
+        return -1;
+    if (EVP_MD_CTX_copy_ex(ctx, hkey->ictx) == 1
+      && EVP_DigestUpdate(ctx, data, len) == 1
+      && EVP_DigestFinal_ex(ctx, hash, &hash_len) == 1
+      && EVP_MD_CTX_copy_ex(ctx, hkey->octx) == 1
+      && EVP_DigestUpdate(ctx, hash, hash_len) == 1
+      && EVP_DigestFinal_ex(ctx, hash, &hash_len) == 1) {
+        memcpy(mac, hash, SHA1_DIGEST_LEN);
+        ret = 0;
     }
+    if (temp_ctx != NULL)
+        EVP_MD_CTX_destroy(temp_ctx);
+    return ret;
+}
 
-    /* Compute HMAC */
-    HMAC(sha1_md, key, keylen, tosign, sizeof(tosign), hash, &hash_len);
+/*
+ * Get the shared memory slot for a tag computed by otp_hmac(); its bytes are already uniformly distributed.
+ */
+static int
+otp_tag_slot(const u_char *tag, int num_slots)
+{
+    return (int)((tag[0] | (tag[1] << 8) | (tag[2] << 16)) % num_slots);
+}
 
-    /* Extract selected bytes to get 32 bit integer value */
-    offset = hash[hash_len - 1] & 0x0f;
-    value = ((hash[offset] & 0x7f) << 24) | ((hash[offset + 1] & 0xff) << 16)
-        | ((hash[offset + 2] & 0xff) << 8) | (hash[offset + 3] & 0xff);
+/*
+ * Check whether a password was granted to the same client within the linger time, or rejected recently.
+ * Returns 1 if granted, -1 if rejected, otherwise zero.
+ */
+static int
+otp_linger_lookup(request_rec *r, const struct otp_config *conf, const char *username, const char *password)
+{
+    u_char tag[SHA1_DIGEST_LEN];
+    struct otp_linger *entry;
+    apr_uint32_t revocations;
+    apr_finfo_t finfo;
+    u_int failures = 0;
+    time_t expiry = 0;
+    time_t now;
+    int found = 0;
 
-    /* Sanity check max # digits */
-    if (ndigits < 1)
-        ndigits = 1;
+    /* Check the connection's last grant first */
+    if (otp_lingers == NULL || otp_users_file_stat(r, conf, &finfo) != 0)
+        return 0;
+    if (conf->max_linger > 0 && otp_conn_lookup(r, conf, &finfo, username, password, &failures))
+        found = 1;
+    else {
 
-    /* Generate decimal digits */
-    if (buf10 != NULL) {
-        apr_snprintf(buf10, buflen, "%0*d", ndigits < max10 ? ndigits : max10,
-          ndigits < max10 ? value % powers10[ndigits - 1] : value);
-    }
+        /* Check the shared cache; read the revocation count first, so a revocation that races with us is noticed later */
+        revocations = apr_atomic_read32(otp_revocations(username));
+        if (otp_linger_tag(r, conf, &finfo, username, password, tag) != 0)
+            return 0;
+        entry = &otp_lingers[otp_tag_slot(tag, OTP_LINGER_SLOTS)];
+        now = time(NULL);
+        if (apr_global_mutex_lock(otp_linger_mutex) != APR_SUCCESS)
+            return 0;
+        if (memcmp(entry->tag, tag, sizeof(tag)) == 0 && strcmp(entry->username, username) == 0 && now < entry->expiry) {
+            expiry = entry->expiry;
+            failures = entry->failures;
+            found = entry->rejected ? -1 : conf->max_linger > 0;
+        }
+        apr_global_mutex_unlock(otp_linger_mutex);
 
-    /* Generate hexadecimal digits */
-    if (buf16 != NULL) {
-        apr_snprintf(buf16, buflen, "%0*x", ndigits < max16 ? ndigits : max16,
-          ndigits < max16 ? (value & ((1 << (4 * ndigits)) - 1)) : value);
+        /* Remember the grant for the rest of this connection */
+        if (found == 1)
+            otp_conn_store(r, conf, &finfo, username, password, expiry, failures, revocations);
     }
+
+    /* Don't grant reuse to a user since locked out by wrong OTPs not yet written to the users file */
+    if (found == 1 && conf->max_otp_failures != 0 && failures + otp_failure_pending(conf, username) >= conf->max_otp_failures)
+        found = 0;
+    return found;
 }
 
 /*
- * Generate an OTP using the mOTP algorithm defined by http://motp.sourceforge.net/
+ * Remember that a password was granted to a client, until the given end of its linger time. "failures" is the
+ * user's failure count in the users file, against which wrong OTPs not yet written to it are checked.
  */
 static void
-motp(const u_char *key, size_t keylen, const char *pin, u_long counter, int ndigits, char *buf, size_t buflen)
+otp_linger_store(request_rec *r, const struct otp_config *conf, const char *username, const char *password, time_t expiry,
+    u_int failures)
 {
-    u_char hash[MD5_DIGEST_LENGTH];
-    char hashbuf[256];
-    char keybuf[256];
+    u_char tag[SHA1_DIGEST_LEN];
+    struct otp_linger *entry;
+    apr_finfo_t finfo;
 
-    printhex(keybuf, sizeof(keybuf), key, keylen, keylen * 2);
-    apr_snprintf(hashbuf, sizeof(hashbuf), "%lu%s%s", counter, keybuf, pin);
-    MD5((u_char *)hashbuf, strlen(hashbuf), hash);
-    printhex(buf, buflen, hash, sizeof(hash), ndigits);
+    if (otp_lingers == NULL || conf->max_linger <= 0 || otp_users_file_stat(r, conf, &finfo) != 0)
+        return;
+    otp_conn_store(r, conf, &finfo, username, password, expiry, failures, apr_atomic_read32(otp_revocations(username)));
+    if (otp_linger_tag(r, conf, &finfo, username, password, tag) != 0)
+        return;
+    entry = &otp_lingers[otp_tag_slot(tag, OTP_LINGER_SLOTS)];
+    if (apr_global_mutex_lock(otp_linger_mutex) != APR_SUCCESS)
+        return;
+    memcpy(entry->tag, tag, sizeof(entry->tag));
+    apr_snprintf(entry->username, sizeof(entry->username), "%s", username);
+    entry->expiry = expiry;
+    entry->rejected = 0;
+    entry->failures = failures;
+    apr_global_mutex_unlock(otp_linger_mutex);
 }
 
 /*
- * Print hex digits into a buffer.
+ * Remember that a password was rejected for a client, so that repeating it is rejected without verifying it again
+ * for a little while. Verifying the same password again gives the same result while the users file is unchanged,
+ * except that a time-based token's window moves at each time step, which may bring a wrong OTP into it. So if the
+ * user has time-based tokens, "time_interval" is the shortest of their time intervals, and the rejection ends with
+ * the current time step.
  */
 static void
-printhex(char *buf, size_t buflen, const u_char *data, size_t dlen, int max_digits)
+otp_linger_reject(request_rec *r, const struct otp_config *conf, const char *username, const char *password,
+    int time_interval)
 {
-    const char *hexdig = "0123456789abcdef";
-    int i;
+    u_char tag[SHA1_DIGEST_LEN];
+    struct otp_linger *entry;
+    apr_finfo_t finfo;
+    time_t expiry;
+    time_t now;
 
-    if (buflen > 0)
-        *buf = '\0';
-    for (i = 0; i / 2 < (int)dlen && i < max_digits && i < (int)buflen - 1; i++) {
-        u_int val = data[i / 2];
-        if ((i & 1) == 0)
-            val >>= 4;
-        val &= 0x0f;
-        *buf++ = hexdig[val];
-        *buf = '\0';
-    }
+    if (otp_lingers == NULL || otp_users_file_stat(r, conf, &finfo) != 0
+      || otp_linger_tag(r, conf, &finfo, username, password, tag) != 0)
+        return;
+    now = time(NULL);
+    expiry = now + OTP_REJECT_TIME;
+    if (time_interval > 0 && expiry > (now / time_interval + 1) * time_interval)
+        expiry = (now / time_interval + 1) * time_interval;
+    entry = &otp_lingers[otp_tag_slot(tag, OTP_LINGER_SLOTS)];
+    if (apr_global_mutex_lock(otp_linger_mutex) != APR_SUCCESS)
+        return;
+    memcpy(entry->tag, tag, sizeof(entry->tag));
+    apr_snprintf(entry->username, sizeof(entry->username), "%s", username);
+    entry->expiry = expiry;
+    entry->rejected = 1;
+    entry->failures = 0;
+    apr_global_mutex_unlock(otp_linger_mutex);
 }
 
 /*
- * Verify PIN using an external authn provider configured via "OTPAuthPINAuthProvider".
+ * Forget all passwords granted to a user, e.g., on logout or a wrong OTP. Connections' last grants are
+ * forgotten by bumping the user's shared revocation count; users sharing its slot only lose their grants too.
  */
-static authn_status
-authn_otp_check_pin_external(request_rec *r, struct otp_config *const conf, const char *username, const char *pin)
+static void
+otp_linger_forget(const char *username)
 {
-    authn_provider_list *pentry;
-    authn_status status;
+    int i;
 
-    /* Verify that at least one authn provider is configured */
-    if ((pentry = conf->provlist) == NULL) {
-        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r,
-          "user \"%s\" PIN to be verified externally but no \"OTPAuthPINAuthProvider\" was configured", username);
-        return AUTH_DENIED;
+    if (otp_lingers == NULL || apr_global_mutex_lock(otp_linger_mutex) != APR_SUCCESS)
+        return;
+    for (i = 0; i < OTP_LINGER_SLOTS; i++) {
+        if (strcmp(otp_lingers[i].username, username) == 0)
+            memset(&otp_lingers[i], 0, sizeof(otp_lingers[i]));
     }
+    apr_atomic_inc32(otp_revocations(username));
+    apr_global_mutex_unlock(otp_linger_mutex);
+}
 
-    /* Try each configured authn provider until we find one that recognizes this user */
-    do {
-        apr_table_setn(r->notes, AUTHN_PROVIDER_NAME_NOTE, pentry->provider_name);
-        status = pentry->provider->check_password(r, username, pin);
-        apr_table_unset(r->notes, AUTHN_PROVIDER_NAME_NOTE);
-        if (status != AUTH_USER_NOT_FOUND)
-            break;
-        pentry = pentry->next;
-    } while (pentry != NULL);
+/*
+ * Get the shared memory count of revocations of a user's grants.
+ */
+static volatile apr_uint32_t *
+otp_revocations(const char *username)
+{
+    apr_ssize_t len = APR_HASH_KEY_STRING;
 
-    /* Check result */
-    switch (status) {
-    case AUTH_GRANTED:
-        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "user \"%s\" PIN successfully validated by auth provider \"%s\"",
-          username, pentry->provider_name);
-        break;
-    case AUTH_DENIED:
-        ap_log_rerror(APLOG_MARK, conf->allow_fallthrough ? APLOG_INFO : APLOG_NOTICE, 0, r,
-          "user \"%s\" gave incorrect PIN according to PIN auth provider \"%s\"",
-          username, pentry->provider_name);
-        break;
-    case AUTH_USER_NOT_FOUND:
-        ap_log_rerror(APLOG_MARK, conf->allow_fallthrough ? APLOG_INFO : APLOG_NOTICE, 0, r,
-          "user \"%s\" is not known by any configured PIN auth provider", username);
-        break;
-    case AUTH_GENERAL_ERROR:                        /* assume the auth provider logged something interesting */
-        break;
-    case AUTH_USER_FOUND:
-    default:
-        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r,
-          "PIN auth provider \"%s\" returned unexpected value %d for user \"%s\"; treating as AUTH_DENIED",
-            pentry->provider_name, status, username);
-        status = AUTH_DENIED;
-        break;
-    }
+    return &otp_linger_table->revocations[apr_hashfunc_default(username, &len) % OTP_REVOCATION_SLOTS];
+}
 
-    /* Done */
-    return status;
+/*
+ * Find the shared memory slot for a user's unwritten failure count; it may belong to another user.
+ * The caller must hold the shared memory mutex when accessing it.
+ */
+static struct otp_failure *
+otp_failure_slot(const struct otp_config *conf, const char *username, apr_uint32_t *file_hashp)
+{
+    apr_ssize_t len = APR_HASH_KEY_STRING;
+    apr_ssize_t len2 = APR_HASH_KEY_STRING;
+
+    *file_hashp = apr_hashfunc_default(conf->users_file, &len);
+    return &otp_linger_table->failures[(*file_hashp ^ apr_hashfunc_default(username, &len2)) % OTP_FAILURE_SLOTS];
 }
 
 /*
- * Verify PIN.
+ * Get the number of a user's wrong OTPs not yet added to the failure count in the users file.
  */
-static authn_status
-authn_otp_check_pin(request_rec *r, struct otp_config *const conf, struct otp_user *const user, const char *pin)
+static u_int
+otp_failure_pending(const struct otp_config *conf, const char *username)
 {
-    switch (user->pincfg) {
-    case PIN_CONFIG_NONE:                               /* User has no PIN, so provided PIN must be the empty string */
-        if (*pin != '\0') {
-            ap_log_rerror(APLOG_MARK, conf->allow_fallthrough ? APLOG_INFO : APLOG_NOTICE, 0, r,
-              "user \"%s\" supplied a PIN but none is configured in the users file", user->username);
-            return AUTH_DENIED;
-        }
-        return AUTH_GRANTED;
-    case PIN_CONFIG_EXTERNAL:                           /* User's PIN must be verified externally via an OTPAuthPINAuthProvider */
-        return authn_otp_check_pin_external(r, conf, user->username, pin);
-    case PIN_CONFIG_LITERAL:                            /* User's PIN was given explicitly in the users file */
-        if (strcmp(pin, user->pin) != 0) {
-            ap_log_rerror(APLOG_MARK, conf->allow_fallthrough ? APLOG_INFO : APLOG_NOTICE, 0, r,
-              "user \"%s\" PIN does not match value in users file", user->username);
-            return AUTH_DENIED;
-        }
-        return AUTH_GRANTED;
-    default:                                            /* This should never happen */
-        abort();
-        return AUTH_DENIED;
-    }
+    struct otp_failure *failure;
+    apr_uint32_t file_hash;
+    u_int pending = 0;
+
+    if (otp_linger_table == NULL)
+        return 0;
+    failure = otp_failure_slot(conf, username, &file_hash);
+    if (apr_global_mutex_lock(otp_linger_mutex) != APR_SUCCESS)
+        return 0;
+    if (failure->file_hash == file_hash && strcmp(failure->username, username) == 0)
+        pending = failure->pending;
+    apr_global_mutex_unlock(otp_linger_mutex);
+    return pending;
 }
 
 /*
- * HTTP basic authentication
+ * Count a wrong OTP in shared memory instead of rewriting the users file, if possible; "user" has the failure
+ * count from the users file. The file is written after every OTP_FAILURE_FLUSH failures, once the oldest unwritten
+ * failure is OTP_FAILURE_FLUSH_TIME seconds old, and when the user becomes locked out, so at most a few failures
+ * are lost on a restart. Returns 1 if the failure was counted, otherwise zero, after setting the user's failure
+ * count to include all unwritten failures; the caller must then write it to the users file.
  */
-static authn_status
-authn_otp_check_password(request_rec *r, const char *username, const char *otp_given)
+static int
+otp_failure_defer(const struct otp_config *conf, struct otp_user *user)
 {
-    struct otp_config *const conf = get_config(r);
-    struct otp_user userbuf;
-    struct otp_user *const user = &userbuf;
-    authn_status status;
-    int window_start;
-    int window_stop;
-    char otpbuf10[32];
-    char otpbuf16[32];
-    int counter;
-    int offset;
+    struct otp_failure *failure;
+    apr_uint32_t file_hash;
     time_t now;
+    u_int pending = 0;
+    u_int total;
+    int deferred = 0;
 
-    /* Is the users file defined? */
-    if (conf->users_file == NULL) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "No OTPAuthUsersFile has been configured");
-        return AUTH_GENERAL_ERROR;
+    if (otp_linger_table == NULL) {
+        user->num_otp_failures++;
+        return 0;
     }
-
-    /* Lookup user in the users file */
-    memset(user, 0, sizeof(*user));
-    apr_snprintf(user->username, sizeof(user->username), "%s", username);
-    if ((status = find_update_user(r, conf->users_file, user, 0)) != AUTH_USER_FOUND)
-        return status;
-
-    /* Check for max failures */
-    if (conf->max_otp_failures != 0 && user->num_otp_failures >= conf->max_otp_failures) {
-        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "user \"%s\" has reached the maximum wrong OTP limit of %u",
-          user->username, conf->max_otp_failures);
-        return conf->allow_fallthrough ? AUTH_USER_NOT_FOUND : AUTH_DENIED;
+    failure = otp_failure_slot(conf, user->username, &file_hash);
+    now = time(NULL);
+    if (apr_global_mutex_lock(otp_linger_mutex) != APR_SUCCESS) {
+        user->num_otp_failures++;
+        return 0;
     }
-
-    /* Check for a "logout" via empty password */
-    if (*otp_given == '\0' && *user->last_otp != '\0' && *user->last_ip != '\0' && strcmp(user->last_ip, USER_AGENT_IP(r)) == 0) {
-        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "logout for user \"%s\" via empty password", user->username);
-
-        /* Forget previous OTP */
-        *user->last_otp = '\0';
-        find_update_user(r, conf->users_file, user, 1);
-        return conf->allow_fallthrough ? AUTH_USER_NOT_FOUND : AUTH_DENIED;
+    if (failure->file_hash == file_hash && strcmp(failure->username, user->username) == 0)
+        pending = failure->pending;
+    else if (failure->pending > 0) {                /* slot is taken by another user, so write this failure now */
+        apr_global_mutex_unlock(otp_linger_mutex);
+        user->num_otp_failures++;
+        return 0;
     }
-
-    /* Check PIN prefix (if appropriate) */
-    if (user->algorithm != OTP_ALGORITHM_MOTP) {
-        char pinbuf[MAX_PIN];
-        int pinlen;
-
-        /* Determine the length of the PIN that the user supplied */
-        pinlen = strlen(otp_given) - user->num_digits;
-        if (pinlen < 0) {
-            ap_log_rerror(APLOG_MARK, conf->allow_fallthrough ? APLOG_INFO : APLOG_NOTICE, 0, r, "user \"%s\" provided a too-short OTP", user->username);
-            return conf->allow_fallthrough ? AUTH_USER_NOT_FOUND : AUTH_DENIED;
+    total = user->num_otp_failures + pending < UINT_MAX ? user->num_otp_failures + pending + 1 : UINT_MAX;
+    if ((conf->max_otp_failures == 0 || total < conf->max_otp_failures)
+      && pending + 1 < OTP_FAILURE_FLUSH
+      && (pending == 0 || now < failure->since + OTP_FAILURE_FLUSH_TIME)) {
+        if (pending == 0) {
+            failure->file_hash = file_hash;
+            apr_cpystrn(failure->username, user->username, sizeof(failure->username));
+            failure->since = now;
+            if (otp_linger_table->failures_due == 0 || now + OTP_FAILURE_FLUSH_TIME < otp_linger_table->failures_due)
+                otp_linger_table->failures_due = now + OTP_FAILURE_FLUSH_TIME;
         }
+        failure->pending = pending + 1;
+        deferred = 1;
+    } else {
+        memset(failure, 0, sizeof(*failure));
+        user->num_otp_failures = total;
+    }
+    apr_global_mutex_unlock(otp_linger_mutex);
+    return deferred;
+}
 
-        /* Extract the PIN from the password given */
-        apr_snprintf(pinbuf, sizeof(pinbuf), "%.*s", pinlen, otp_given);
-        otp_given += pinlen;
+/*
+ * Forget a user's unwritten failures, e.g., after a successful OTP resets the count in the users file.
+ */
+static void
+otp_failure_clear(const struct otp_config *conf, const char *username)
+{
+    struct otp_failure *failure;
+    apr_uint32_t file_hash;
 
-        /* Check the PIN */
-        if ((status = authn_otp_check_pin(r, conf, user, pinbuf)) != AUTH_GRANTED) {
-            if (status == AUTH_DENIED && conf->allow_fallthrough)
-                status = AUTH_USER_NOT_FOUND;
-            return status;
-        }
-    }
+    if (otp_linger_table == NULL)
+        return;
+    failure = otp_failure_slot(conf, username, &file_hash);
+    if (apr_global_mutex_lock(otp_linger_mutex) != APR_SUCCESS)
+        return;
+    if (failure->file_hash == file_hash && strcmp(failure->username, username) == 0)
+        memset(failure, 0, sizeof(*failure));
+    apr_global_mutex_unlock(otp_linger_mutex);
+}
+
+/*
+ * Write the unwritten failure counts for this request's users file that are OTP_FAILURE_FLUSH_TIME seconds old,
+ * so the failures of a client that stopped trying aren't left in shared memory only. The shared memory is only
+ * scanned when some count is due, and at most once a second per process. A count is only subtracted from shared
+ * memory once it's in the users file, so meanwhile it's counted twice rather than not at all.
+ */
+static void
+otp_failure_flush(request_rec *r, const struct otp_config *conf)
+{
+    char usernames[OTP_FAILURE_FLUSH_BATCH][MAX_USERNAME];
+    u_int pendings[OTP_FAILURE_FLUSH_BATCH];
+    struct otp_failure *failure;
+    struct otp_user user;
+    apr_uint32_t file_hash;
+    apr_ssize_t len = APR_HASH_KEY_STRING;
+    time_t due = 0;
+    time_t now;
+    int num = 0;
+    int i;
+
+    /* Is anything due? */
+    now = time(NULL);
+    if (otp_linger_table == NULL || otp_failure_scanned == now
+      || otp_linger_table->failures_due == 0 || now < otp_linger_table->failures_due)
+        return;
+    otp_failure_scanned = now;
+
+    /* Find due counts for this users file, and when the next one not taken now is due */
+    file_hash = apr_hashfunc_default(conf->users_file, &len);
+    if (apr_global_mutex_lock(otp_linger_mutex) != APR_SUCCESS)
+        return;
+    for (i = 0; i < OTP_FAILURE_SLOTS; i++) {
+        failure = &otp_linger_table->failures[i];
+        if (failure->pending == 0)
+            continue;
+        if (num < OTP_FAILURE_FLUSH_BATCH && failure->file_hash == file_hash && now >= failure->since + OTP_FAILURE_FLUSH_TIME) {
+            apr_cpystrn(usernames[num], failure->username, sizeof(usernames[num]));
+            pendings[num++] = failure->pending;
+            continue;
+        }
+        if (due == 0 || failure->since + OTP_FAILURE_FLUSH_TIME < due)
+            due = failure->since + OTP_FAILURE_FLUSH_TIME;
+    }
+    otp_linger_table->failures_due = due;
+    apr_global_mutex_unlock(otp_linger_mutex);
+
+    /* Add them to the users file, then take them out of shared memory */
+    for (i = 0; i < num; i++) {
+        memset(&user, 0, sizeof(user));
+        apr_snprintf(user.username, sizeof(user.username), "%s", usernames[i]);
+        if (find_update_user(r, conf, &user, 0) != AUTH_USER_FOUND)
+            continue;
+        user.num_otp_failures = user.num_otp_failures < UINT_MAX - pendings[i] ? user.num_otp_failures + pendings[i] : UINT_MAX;
+        if (find_update_user(r, conf, &user, 1) != AUTH_USER_FOUND)
+            continue;
+        failure = otp_failure_slot(conf, usernames[i], &file_hash);
+        if (apr_global_mutex_lock(otp_linger_mutex) != APR_SUCCESS)
+            continue;
+        if (failure->file_hash == file_hash && strcmp(failure->username, usernames[i]) == 0) {
+            if (failure->pending <= pendings[i])
+                memset(failure, 0, sizeof(*failure));
+            else {
+                failure->pending -= pendings[i];
+                failure->since = now;
+                if (otp_linger_table->failures_due == 0 || now + OTP_FAILURE_FLUSH_TIME < otp_linger_table->failures_due)
+                    otp_linger_table->failures_due = now + OTP_FAILURE_FLUSH_TIME;
+            }
+        }
+        apr_global_mutex_unlock(otp_linger_mutex);
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "wrote %u unwritten wrong OTP(s) for user \"%s\" to the users file",
+          pendings[i], usernames[i]);
+    }
+}
+
+/*
+ * Count a wrong OTP against a user, as authn_otp_verify_password() does, for a request that used the result of
+ * a concurrent verification of the same password instead of verifying it itself.
+ */
+static void
+otp_failure_add(request_rec *r, const struct otp_config *conf, const char *username)
+{
+    struct otp_user user;
+
+    memset(&user, 0, sizeof(user));
+    apr_snprintf(user.username, sizeof(user.username), "%s", username);
+    if (find_update_user(r, conf, &user, 0) != AUTH_USER_FOUND)
+        return;
+    if (user.num_otp_failures < UINT_MAX && !otp_failure_defer(conf, &user))
+        find_update_user(r, conf, &user, 1);
+}
+
+/*
+ * Check whether the client's IP address has used up its allowance of wrong passwords (OTPAuthMaxFailureRate).
+ * Returns 1 if so, otherwise zero.
+ */
+static int
+otp_throttle_check(request_rec *r, const struct otp_config *conf)
+{
+    const char *const ip = USER_AGENT_IP(r);
+    apr_ssize_t len = APR_HASH_KEY_STRING;
+    struct otp_throttle *throttle;
+    int throttled = 0;
+
+    if (otp_linger_table == NULL || conf->max_failure_rate <= 0)
+        return 0;
+    throttle = &otp_linger_table->throttles[apr_hashfunc_default(ip, &len) % OTP_THROTTLE_SLOTS];
+    if (apr_global_mutex_lock(otp_linger_mutex) != APR_SUCCESS)
+        return 0;
+    if (strcmp(throttle->ip, ip) == 0)
+        throttled = otp_throttle_refill(throttle, conf->max_failure_rate, apr_time_now()) < 1.0;
+    apr_global_mutex_unlock(otp_linger_mutex);
+    return throttled;
+}
+
+/*
+ * Take a wrong password out of the client IP address's allowance. An address starts with a full minute's allowance.
+ */
+static void
+otp_throttle_charge(request_rec *r, const struct otp_config *conf)
+{
+    const char *const ip = USER_AGENT_IP(r);
+    apr_ssize_t len = APR_HASH_KEY_STRING;
+    struct otp_throttle *throttle;
+    apr_time_t now;
+    double tokens;
+
+    if (otp_linger_table == NULL || conf->max_failure_rate <= 0 || strlen(ip) >= sizeof(throttle->ip))
+        return;
+    throttle = &otp_linger_table->throttles[apr_hashfunc_default(ip, &len) % OTP_THROTTLE_SLOTS];
+    now = apr_time_now();
+    if (apr_global_mutex_lock(otp_linger_mutex) != APR_SUCCESS)
+        return;
+    if (strcmp(throttle->ip, ip) != 0) {
+        apr_cpystrn(throttle->ip, ip, sizeof(throttle->ip));
+        throttle->tokens = conf->max_failure_rate;
+        throttle->updated = now;
+    }
+    tokens = otp_throttle_refill(throttle, conf->max_failure_rate, now);
+    throttle->tokens = tokens > 1.0 ? tokens - 1.0 : 0.0;
+    apr_global_mutex_unlock(otp_linger_mutex);
+}
+
+/*
+ * Refill a throttle at "rate" per minute, up to one minute's allowance, and return its new allowance.
+ * The caller must hold the shared memory mutex.
+ */
+static double
+otp_throttle_refill(struct otp_throttle *throttle, int rate, apr_time_t now)
+{
+    if (now > throttle->updated) {
+        throttle->tokens += (double)(now - throttle->updated) * rate / apr_time_from_sec(60);
+        throttle->updated = now;
+    }
+    if (throttle->tokens > rate)
+        throttle->tokens = rate;
+    return throttle->tokens;
+}
+
+/*
+ * Check whether all clients together have used up the allowance of wrong passwords given without a username.
+ * Returns 1 if so, or if there's no shared memory to keep count in, otherwise zero.
+ */
+static int
+otp_usernameless_check(void)
+{
+    struct otp_throttle *throttle;
+    int throttled = 0;
+
+    if (otp_linger_table == NULL)
+        return 1;
+    throttle = &otp_linger_table->usernameless;
+    if (apr_global_mutex_lock(otp_linger_mutex) != APR_SUCCESS)
+        return 1;
+    if (throttle->updated != 0)
+        throttled = otp_throttle_refill(throttle, OTP_USERNAMELESS_FAILURE_RATE, apr_time_now()) < 1.0;
+    apr_global_mutex_unlock(otp_linger_mutex);
+    return throttled;
+}
+
+/*
+ * Take a wrong password given without a username out of the allowance of all clients together.
+ */
+static void
+otp_usernameless_charge(void)
+{
+    struct otp_throttle *throttle;
+    apr_time_t now;
+    double tokens;
+
+    if (otp_linger_table == NULL)
+        return;
+    throttle = &otp_linger_table->usernameless;
+    now = apr_time_now();
+    if (apr_global_mutex_lock(otp_linger_mutex) != APR_SUCCESS)
+        return;
+    if (throttle->updated == 0) {
+        throttle->tokens = OTP_USERNAMELESS_FAILURE_RATE;
+        throttle->updated = now;
+    }
+    tokens = otp_throttle_refill(throttle, OTP_USERNAMELESS_FAILURE_RATE, now);
+    throttle->tokens = tokens > 1.0 ? tokens - 1.0 : 0.0;
+    apr_global_mutex_unlock(otp_linger_mutex);
+}
+
+/*
+ * Compute the tag identifying a PIN granted by a PIN auth provider: HMAC-SHA1 under the linger cache key, which is
+ * chosen at startup, so the shared memory holds nothing that helps recover the PIN. Returns zero on success.
+ */
+static int
+otp_pin_tag(const char *provider_name, const char *username, const char *pin, u_char *tag)
+{
+    char buf[1024];
+    int len;
+
+    len = apr_snprintf(buf, sizeof(buf), "%s%c%s%c%s", provider_name, '\0', username, '\0', pin);
+    if (len >= sizeof(buf) - 1)
+        return -1;
+    return otp_hmac(&otp_linger_key, buf, len, tag);
+}
+
+/*
+ * Find a configured PIN auth provider that granted a user's PIN within the PIN cache time.
+ * Returns the provider's list entry, or NULL if none.
+ */
+static authn_provider_list *
+otp_pin_lookup(const struct otp_config *conf, const char *username, const char *pin)
+{
+    authn_provider_list *pentry;
+    u_char tag[SHA1_DIGEST_LEN];
+    struct otp_pin *entry;
+    time_t now;
+    int found;
+
+    if (otp_linger_table == NULL)
+        return NULL;
+    now = time(NULL);
+    for (pentry = conf->provlist; pentry != NULL; pentry = pentry->next) {
+        if (otp_pin_tag(pentry->provider_name, username, pin, tag) != 0)
+            continue;
+        entry = &otp_linger_table->pins[otp_tag_slot(tag, OTP_PIN_SLOTS)];
+        if (apr_global_mutex_lock(otp_linger_mutex) != APR_SUCCESS)
+            return NULL;
+        found = memcmp(entry->tag, tag, sizeof(tag)) == 0 && now < entry->expiry;
+        apr_global_mutex_unlock(otp_linger_mutex);
+        if (found)
+            return pentry;
+    }
+    return NULL;
+}
+
+/*
+ * Remember that a PIN auth provider granted a user's PIN, for the PIN cache time.
+ */
+static void
+otp_pin_store(const struct otp_config *conf, const char *provider_name, const char *username, const char *pin)
+{
+    u_char tag[SHA1_DIGEST_LEN];
+    struct otp_pin *entry;
+
+    if (otp_linger_table == NULL || otp_pin_tag(provider_name, username, pin, tag) != 0)
+        return;
+    entry = &otp_linger_table->pins[otp_tag_slot(tag, OTP_PIN_SLOTS)];
+    if (apr_global_mutex_lock(otp_linger_mutex) != APR_SUCCESS)
+        return;
+    memcpy(entry->tag, tag, sizeof(entry->tag));
+    entry->expiry = time(NULL) + conf->pin_cache_time;
+    apr_global_mutex_unlock(otp_linger_mutex);
+}
+
+/*
+ * Check whether a password is the last one granted on this request's connection, within its linger time, with
+ * the users file unchanged (see otp_users_file_stat()) and no revocations of the user's grants since. The password
+ * itself is kept, so checking it costs no hashing.
+ * Returns 1 if so, with the user's failure count when granted in *failuresp, otherwise zero.
+ */
+static int
+otp_conn_lookup(request_rec *r, const struct otp_config *conf, const apr_finfo_t *finfo,
+    const char *username, const char *password, u_int *failuresp)
+{
+    struct otp_conn *const oc = ap_get_module_config(MASTER_CONN(r->connection)->conn_config, &authn_otp_module);
+    int found = 0;
+
+    if (oc == NULL || otp_conn_mutex == NULL)
+        return 0;
+    apr_thread_mutex_lock(otp_conn_mutex);
+    if (*oc->username != '\0'
+      && time(NULL) < oc->expiry
+      && oc->max_linger == conf->max_linger
+      && strcmp(oc->username, username) == 0
+      && strcmp(oc->password, password) == 0
+      && strcmp(oc->ip, USER_AGENT_IP(r)) == 0
+      && strcmp(oc->users_file, conf->users_file) == 0
+      && oc->device == finfo->device && oc->inode == finfo->inode
+      && oc->mtime == finfo->mtime && oc->size == finfo->size
+      && oc->revocations == apr_atomic_read32(otp_revocations(username))) {
+        *failuresp = oc->failures;
+        found = 1;
+    }
+    apr_thread_mutex_unlock(otp_conn_mutex);
+    return found;
+}
+
+/*
+ * Remember a password granted on this request's connection, until the given end of its linger time.
+ */
+static void
+otp_conn_store(request_rec *r, const struct otp_config *conf, const apr_finfo_t *finfo,
+    const char *username, const char *password, time_t expiry, u_int failures, apr_uint32_t revocations)
+{
+    struct otp_conn *const oc = ap_get_module_config(MASTER_CONN(r->connection)->conn_config, &authn_otp_module);
+
+    if (oc == NULL || otp_conn_mutex == NULL
+      || strlen(username) >= sizeof(oc->username) || strlen(password) >= sizeof(oc->password)
+      || strlen(USER_AGENT_IP(r)) >= sizeof(oc->ip) || strlen(conf->users_file) >= sizeof(oc->users_file))
+        return;
+    apr_thread_mutex_lock(otp_conn_mutex);
+    apr_cpystrn(oc->users_file, conf->users_file, sizeof(oc->users_file));
+    oc->device = finfo->device;
+    oc->inode = finfo->inode;
+    oc->mtime = finfo->mtime;
+    oc->size = finfo->size;
+    apr_cpystrn(oc->username, username, sizeof(oc->username));
+    apr_cpystrn(oc->password, password, sizeof(oc->password));
+    apr_cpystrn(oc->ip, USER_AGENT_IP(r), sizeof(oc->ip));
+    oc->max_linger = conf->max_linger;
+    oc->expiry = expiry;
+    oc->failures = failures;
+    oc->revocations = revocations;
+    apr_thread_mutex_unlock(otp_conn_mutex);
+}
+
+/*
+ * Parse a token type string such as "HOTP/T30/6".
+ * Returns 0 if successful, else -1 on parse error.
+ */
+static int
+parse_token_type(const char *type, struct otp_user *tokinfo)
+{
+    char tokbuf[MAX_TOKEN];
+    char *last;
+    char *eptr;
+    char *t;
+
+    /* Backwards compatibility hack */
+    if (strcmp(type, "E") == 0)
+        type = "HOTP/E";
+    else if (strcmp(type, "T") == 0)
+        type = "HOTP/T30";
+
+    /* Initialize */
+    memset(tokinfo, 0, sizeof(*tokinfo));
+    apr_snprintf(tokbuf, sizeof(tokbuf), "%s", type);
+
+    /* Parse algorithm */
+    if ((t = apr_strtok(tokbuf, "/", &last)) == NULL)
+        return -1;
+
+    /* Apply per-algorithm defaults */
+    if (strcasecmp(t, "HOTP") == 0) {
+        tokinfo->algorithm = OTP_ALGORITHM_HOTP;
+        tokinfo->time_interval = 0;
+        tokinfo->num_digits = DEFAULT_NUM_DIGITS;
+    } else if (strcasecmp(t, "MOTP") == 0) {
+        tokinfo->algorithm = OTP_ALGORITHM_MOTP;
+        tokinfo->time_interval = MOTP_TIME_INTERVAL;
+        tokinfo->num_digits = DEFAULT_NUM_DIGITS;
+    } else
+        return -1;
+
+    /* Parse token type: event or time-based */
+    if ((t = apr_strtok(NULL, "/", &last)) == NULL)
+        return 0;
+    if (strcmp(t, "E") == 0)
+        tokinfo->time_interval = 0;
+    else if (*t == 'T') {
+        if (!isdigit(*++t))
+            return -1;
+        tokinfo->time_interval = strtol(t, &eptr, 10);
+        if (tokinfo->time_interval <= 0 || *eptr != '\0')
+            return -1;
+    } else
+        return -1;
+
+    /* Parse #digits */
+    if ((t = apr_strtok(NULL, "/", &last)) == NULL)
+        return 0;
+    if (!isdigit(*t))
+        return -1;
+    tokinfo->num_digits = strtol(t, &eptr, 10);
+    if (tokinfo->num_digits <= 0 || *eptr != '\0' || tokinfo->num_digits > sizeof(powers10) / sizeof(*powers10))
+        return -1;
+
+    /* Done */
+    return 0;
+}
+
+static apr_status_t
+print_user(apr_file_t *file, const struct otp_user *user, int time_format)
+{
+    const char *pinstr = NULL;
+    const char *alg;
+    char cbuf[64];
+    char nbuf[64];
+    char tbuf[MAX_TOKEN];
+    int i;
+
+    /* Format token type sub-fields */
+    switch (user->algorithm) {
+    case OTP_ALGORITHM_HOTP:
+        alg = "HOTP";
+        break;
+    case OTP_ALGORITHM_MOTP:
+        alg = "MOTP";
+        break;
+    default:
+        abort();
+    }
+    if (user->time_interval == 0)
+        apr_snprintf(cbuf, sizeof(cbuf), "/E");
+    else
+        apr_snprintf(cbuf, sizeof(cbuf), "/T%d", user->time_interval);
+    apr_snprintf(nbuf, sizeof(nbuf), "/%d", user->num_digits);
+
+    /* Abbreviate when default values apply */
+    if (user->num_digits == DEFAULT_NUM_DIGITS) {
+        *nbuf = '\0';
+        if (user->algorithm == OTP_ALGORITHM_HOTP && user->time_interval == 0)
+            *cbuf = '\0';
+        else if (user->algorithm == OTP_ALGORITHM_MOTP && user->time_interval == 10)
+            *cbuf = '\0';
+    }
+    apr_snprintf(tbuf, sizeof(tbuf), "%s%s%s", alg, cbuf, nbuf);
+
+    /* Get PIN representation */
+    switch (user->pincfg) {
+    case PIN_CONFIG_LITERAL:
+        pinstr = user->pin;
+        break;
+    case PIN_CONFIG_NONE:
+        pinstr = PIN_NONE;
+        break;
+    case PIN_CONFIG_EXTERNAL:
+        pinstr = PIN_EXTERNAL;
+        break;
+    default:
+        abort();
+    }
+
+    /* Print line in users file */
+    apr_file_printf(file, "%-7s %-13s %-7s ", tbuf, user->username, pinstr);
+    for (i = 0; i < user->keylen; i++)
+        apr_file_printf(file, "%02x", user->key[i]);
+    apr_file_printf(file, " %-3ld %-2u", user->offset, user->num_otp_failures);
+    if (*user->last_otp != '\0') {
+        format_timestamp(tbuf, user->last_auth, time_format);
+        apr_file_printf(file, " %-7s %s %s", user->last_otp, tbuf, user->last_ip);
+    }
+    return apr_file_putc('\n', file);
+}
+
+/*
+ * Parse a last authentication timestamp. We accept local time (e.g., "2009-06-12T17:52:32L"),
+ * UTC (e.g., "2009-06-12T17:52:32Z"), or seconds since the epoch (e.g., "1244829152").
+ * Returns 0 if successful, else -1 on parse error.
+ */
+static int
+parse_timestamp(const char *s, time_t *tp)
+{
+    const size_t len = strlen(s);
+    struct tm tm;
+    long secs;
+    long days;
+
+    /* Seconds since the epoch? */
+    if (len != TIME_LENGTH || s[4] != '-') {
+        if (*s == '\0')
+            return -1;
+        for (secs = 0; apr_isdigit(*s); s++) {
+            if (secs > (LONG_MAX - 9) / 10)
+                return -1;
+            secs = secs * 10 + (*s - '0');
+        }
+        if (*s != '\0')
+            return -1;
+        *tp = (time_t)secs;
+        return 0;
+    }
+
+    /* Parse fixed-format "YYYY-MM-DDTHH:MM:SS" prefix */
+    if ( s[7] != '-' || s[10] != 'T' || s[13] != ':' || s[16] != ':')
+        return -1;
+    memset(&tm, 0, sizeof(tm));
+    if ((tm.tm_year = parse_digits(s, 4)) == -1
+      || (tm.tm_mon = parse_digits(s + 5, 2)) < 1 || tm.tm_mon > 12
+      || (tm.tm_mday = parse_digits(s + 8, 2)) < 1 || tm.tm_mday > 31
+      || (tm.tm_hour = parse_digits(s + 11, 2)) == -1 || tm.tm_hour > 23
+      || (tm.tm_min = parse_digits(s + 14, 2)) == -1 || tm.tm_min > 59
+      || (tm.tm_sec = parse_digits(s + 17, 2)) == -1 || tm.tm_sec > 60)
+        return -1;
+
+    /* Interpret according to time zone suffix */
+    switch (s[19]) {
+    case 'Z':
+        days = days_from_civil(tm.tm_year, tm.tm_mon, tm.tm_mday);
+        *tp = (time_t)(((days * 24 + tm.tm_hour) * 60 + tm.tm_min) * 60 + tm.tm_sec);
+        return 0;
+    case 'L':
+        tm.tm_year -= 1900;
+        tm.tm_mon--;
+        tm.tm_isdst = -1;
+        if ((*tp = mktime(&tm)) == (time_t)-1)
+            return -1;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Format a last authentication timestamp. The buffer must have room for at least TIME_LENGTH + 1 bytes.
+ */
+static void
+format_timestamp(char *buf, time_t when, int time_format)
+{
+    apr_time_exp_t tm;
+    long days;
+    long secs;
+    long year;
+    int month;
+    int day;
+
+    switch (time_format) {
+    case TIME_FORMAT_EPOCH:
+        apr_snprintf(buf, TIME_LENGTH + 1, "%lu", (u_long)when);
+        return;
+    case TIME_FORMAT_UTC:
+        secs = (long)when % 86400;
+        days = (long)when / 86400;
+        if (secs < 0) {
+            secs += 86400;
+            days--;
+        }
+        civil_from_days(days, &year, &month, &day);
+        break;
+    case TIME_FORMAT_LOCAL:
+    default:
+        apr_time_exp_lt(&tm, apr_time_from_sec(when));
+        year = tm.tm_year + 1900;
+        month = tm.tm_mon + 1;
+        day = tm.tm_mday;
+        secs = (tm.tm_hour * 60 + tm.tm_min) * 60 + tm.tm_sec;
+        break;
+    }
+    format_digits(buf, year, 4);
+    buf[4] = '-';
+    format_digits(buf + 5, month, 2);
+    buf[7] = '-';
+    format_digits(buf + 8, day, 2);
+    buf[10] = 'T';
+    format_digits(buf + 11, secs / 3600, 2);
+    buf[13] = ':';
+    format_digits(buf + 14, (secs / 60) % 60, 2);
+    buf[16] = ':';
+    format_digits(buf + 17, secs % 60, 2);
+    buf[19] = time_format == TIME_FORMAT_UTC ? 'Z' : 'L';
+    buf[20] = '\0';
+}
+
+/*
+ * Parse exactly "len" decimal digits. Returns -1 if any non-digit is found.
+ */
+static int
+parse_digits(const char *s, int len)
+{
+    int value;
+
+    for (value = 0; len-- > 0; s++) {
+        if (!apr_isdigit(*s))
+            return -1;
+        value = value * 10 + (*s - '0');
+    }
+    return value;
+}
+
+/*
+ * Format exactly "len" zero-padded decimal digits (no NUL terminator).
+ */
+static void
+format_digits(char *buf, long value, int len)
+{
+    while (len-- > 0) {
+        buf[len] = '0' + (char)(value % 10);
+        value /= 10;
+    }
+}
+
+/*
+ * Convert a proleptic Gregorian calendar date into days since 1970-01-01.
+ * See http://howardhinnant.github.io/date_algorithms.html
+ */
+static long
+days_from_civil(long year, int month, int day)
+{
+    long era;
+    long yoe;
+    long doy;
+    long doe;
+
+    year -= month <= 2;
+    era = (year >= 0 ? year : year - 399) / 400;
+    yoe = year - era * 400;
+    doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/*
+ * Inverse of days_from_civil().
+ */
+static void
+civil_from_days(long days, long *yearp, int *monthp, int *dayp)
+{
+    long era;
+    long doe;
+    long yoe;
+    long doy;
+    long mp;
+
+    days += 719468;
+    era = (days >= 0 ? days : days - 146096) / 146097;
+    doe = days - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    *dayp = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *monthp = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *yearp = yoe + era * 400 + (*monthp <= 2);
+}
+
+/*
+ * Precompute the HMAC inner and outer hash states for the user's key. Thereafter, each
+ * hotp() invocation costs only two SHA-1 compressions instead of rehashing the key.
+ * The internal SHA-1 is used if it was selected at startup; otherwise the OpenSSL
+ * states are freed when the request pool is cleaned up.
+ */
+static int
+hotp_key_init(request_rec *r, struct otp_user *user)
+{
+    struct hotp_key *hkey;
+
+    /* Use the internal SHA-1 if available */
+    hkey = apr_pcalloc(r->pool, sizeof(*hkey));
+    if (sha1_impl != NULL) {
+        hmac_sha1_key_init(&hkey->state, user->key, user->keylen);
+        user->hkey = hkey;
+        return 0;
+    }
+
+    /* Cleanup is registered first so partial initialization is also freed */
+    apr_pool_cleanup_register(r->pool, hkey, hotp_key_cleanup, apr_pool_cleanup_null);
+    if (hotp_key_absorb(hkey, user->key, user->keylen) != 0) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "can't initialize HMAC state for user \"%s\"", user->username);
+        return -1;
+    }
+
+    /* Done */
+    user->hkey = hkey;
+    return 0;
+}
+
+/*
+ * Precompute the OpenSSL inner and outer HMAC-SHA1 states for a key. Returns zero on success.
+ * On failure, any contexts created are left in "hkey" for hotp_key_cleanup().
+ */
+static int
+hotp_key_absorb(struct hotp_key *hkey, const u_char *key, size_t keylen)
+{
+    const EVP_MD *const md = sha1_md != NULL ? sha1_md : EVP_sha1();
+    u_char keybuf[SHA1_BLOCK_SIZE];
+    u_char pad[SHA1_BLOCK_SIZE];
+    u_int hashlen;
+    int i;
+
+    /* Keys longer than the block size are hashed first (RFC 2104) */
+    memset(keybuf, 0, sizeof(keybuf));
+    if (keylen > sizeof(keybuf)) {
+        if (EVP_Digest(key, keylen, keybuf, &hashlen, md, NULL) != 1)
+            return -1;
+    } else
+        memcpy(keybuf, key, keylen);
+
+    /* Absorb (key ^ ipad) and (key ^ opad) */
+    if ((hkey->ictx = EVP_MD_CTX_create()) == NULL || (hkey->octx = EVP_MD_CTX_create()) == NULL)
+        return -1;
+    for (i = 0; i < sizeof(pad); i++)
+        pad[i] = keybuf[i] ^ HMAC_IPAD;
+    if (EVP_DigestInit_ex(hkey->ictx, md, NULL) != 1 || EVP_DigestUpdate(hkey->ictx, pad, sizeof(pad)) != 1)
+        return -1;
+    for (i = 0; i < sizeof(pad); i++)
+        pad[i] = keybuf[i] ^ HMAC_OPAD;
+    if (EVP_DigestInit_ex(hkey->octx, md, NULL) != 1 || EVP_DigestUpdate(hkey->octx, pad, sizeof(pad)) != 1)
+        return -1;
+    return 0;
+}
+
+static apr_status_t
+hotp_key_cleanup(void *data)
+{
+    struct hotp_key *const hkey = data;
+
+    if (hkey->ictx != NULL)
+        EVP_MD_CTX_destroy(hkey->ictx);
+    if (hkey->octx != NULL)
+        EVP_MD_CTX_destroy(hkey->octx);
+    return APR_SUCCESS;
+}
+
+/*
+ * Get this thread's scratch digest context, creating it on first use.
+ * Returns NULL if thread-local storage is not available.
+ */
+static EVP_MD_CTX *
+hotp_thread_ctx(void)
+{
+    EVP_MD_CTX *ctx;
+    void *data;
+
+    if (hotp_ctx_key == NULL)
+        return NULL;
+    if (apr_threadkey_private_get(&data, hotp_ctx_key) == 0 && data != NULL)
+        return data;
+    if ((ctx = EVP_MD_CTX_create()) == NULL)
+        return NULL;
+    if (apr_threadkey_private_set(ctx, hotp_ctx_key) != 0) {
+        EVP_MD_CTX_destroy(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static void
+hotp_thread_ctx_destroy(void *data)
+{
+    EVP_MD_CTX_destroy(data);
+}
+
+/*
+ * Compute the 31 bit truncated HMAC value for a counter using the algorithm specified in RFC 4226.
+ */
+static int
+hotp_value(const struct hotp_key *hkey, u_long counter)
+{
+    EVP_MD_CTX *temp_ctx = NULL;
+    EVP_MD_CTX *ctx;
+    u_char hash[EVP_MAX_MD_SIZE];
+    u_int hash_len;
+    u_char tosign[8];
+    int i;
+
+    /* Use the internal SHA-1 if the key state was initialized for it */
+    memset(hash, 0, sizeof(hash));
+    hash_len = SHA_DIGEST_LENGTH;
+    if (hkey->ictx == NULL) {
+        hmac_sha1_counter(&hkey->state, counter, hash);
+        goto done;
+    }
+
+    /* Encode counter */
+    for (i = sizeof(tosign) - 1; i >= 0; i--) {
+        tosign[i] = counter & 0xff;
+        counter >>= 8;
+    }
+
+    /* Compute HMAC by resuming from the precomputed inner and outer states */
+    if ((ctx = hotp_thread_ctx()) != NULL || (ctx = temp_ctx = EVP_MD_CTX_create()) != NULL) {
+        if (EVP_MD_CTX_copy_ex(ctx, hkey->ictx) == 1
+          && EVP_DigestUpdate(ctx, tosign, sizeof(tosign)) == 1
+          && EVP_DigestFinal_ex(ctx, hash, &hash_len) == 1
+          && EVP_MD_CTX_copy_ex(ctx, hkey->octx) == 1
+          && EVP_DigestUpdate(ctx, hash, hash_len) == 1)
+            EVP_DigestFinal_ex(ctx, hash, &hash_len);
+        if (temp_ctx != NULL)
+            EVP_MD_CTX_destroy(temp_ctx);
+    }
+
+done:
+    return hotp_truncate(hash);
+}
+
+/*
+ * Extract selected bytes from an HMAC-SHA1 hash to get a 31 bit integer value (RFC 4226, section 5.3).
+ */
+static int
+hotp_truncate(const u_char *hash)
+{
+    const int offset = hash[SHA_DIGEST_LENGTH - 1] & 0x0f;
+
+    return ((hash[offset] & 0x7f) << 24) | ((hash[offset + 1] & 0xff) << 16)
+        | ((hash[offset + 2] & 0xff) << 8) | (hash[offset + 3] & 0xff);
+}
+
+/*
+ * Generate an OTP using the algorithm specified in RFC 4226,
+ */
+static void
+hotp(const struct hotp_key *hkey, u_long counter, int ndigits, char *buf10, char *buf16, size_t buflen)
+{
+    const int max10 = sizeof(powers10) / sizeof(*powers10);
+    const int max16 = 8;
+    const int value = hotp_value(hkey, counter);
+
+    /* Sanity check max # digits */
+    if (ndigits < 1)
+        ndigits = 1;
+
+    /* Generate decimal digits */
+    if (buf10 != NULL) {
+        apr_snprintf(buf10, buflen, "%0*d", ndigits < max10 ? ndigits : max10,
+          ndigits < max10 ? value % powers10[ndigits - 1] : value);
+    }
+
+    /* Generate hexadecimal digits */
+    if (buf16 != NULL) {
+        apr_snprintf(buf16, buflen, "%0*x", ndigits < max16 ? ndigits : max16,
+          ndigits < max16 ? (value & ((1 << (4 * ndigits)) - 1)) : value);
+    }
+}
+
+/*
+ * Parse an OTP given by the user into the decimal and/or hexadecimal values it could represent,
+ * so candidate OTPs can be compared arithmetically instead of being formatted as strings.
+ * Returns 0 if successful, or -1 if the OTP can't match any generated OTP.
+ */
+static int
+parse_otp(const char *otp, int ndigits, struct otp_given *given)
+{
+    const int max10 = sizeof(powers10) / sizeof(*powers10);
+    const int max16 = 8;
+    const char *s;
+    int digit;
+
+    /* Values larger than INT_MAX can't match any 31 bit HOTP value */
+    given->str = otp;
+    given->value10 = ndigits <= max10 ? 0 : -1;
+    given->value16 = ndigits <= max16 ? 0 : -1;
+    for (s = otp; *s != '\0'; s++) {
+        if (given->value10 != -1) {
+            digit = *s - '0';
+            if (apr_isdigit(*s) && given->value10 <= (INT_MAX - digit) / 10)
+                given->value10 = given->value10 * 10 + digit;
+            else
+                given->value10 = -1;
+        }
+        if (given->value16 != -1) {
+            digit = apr_isdigit(*s) ? *s - '0' : apr_isxdigit(*s) ? apr_tolower(*s) - 'a' + 10 : -1;
+            if (digit != -1 && given->value16 <= (INT_MAX >> 4))
+                given->value16 = (given->value16 << 4) | digit;
+            else
+                given->value16 = -1;
+        }
+    }
+    return given->value10 == -1 && given->value16 == -1 ? -1 : 0;
+}
+
+/*
+ * Determine whether the given OTP matches the user's token at the given counter value.
+ */
+static int
+otp_matches(struct otp_user *user, const struct otp_given *given, u_long counter)
+{
+    u_char digest[1][MD5_DIGEST_LEN];
+    uint64_t counter64 = counter;
+
+    user->num_hashes++;
+    /* Mobile-OTP values are hex strings */
+    if (user->algorithm == OTP_ALGORITHM_MOTP) {
+        motp_digests(user->mkey, &counter64, 1, digest);
+        return otp_matches_digest(user, given, digest[0]);
+    }
+
+    /* Compare HOTP value */
+    return otp_matches_value(user, given, hotp_value(user->hkey, counter));
+}
+
+/*
+ * Compare an HOTP value with the given OTP using whichever encodings are possible.
+ */
+static int
+otp_matches_value(const struct otp_user *user, const struct otp_given *given, int value)
+{
+    const int max10 = sizeof(powers10) / sizeof(*powers10);
+    const int max16 = 8;
+    const int ndigits = user->num_digits;
+
+    if (given->value10 != -1 && given->value10 == (ndigits < max10 ? value % powers10[ndigits - 1] : value))
+        return 1;
+    if (given->value16 != -1 && given->value16 == (ndigits < max16 ? (value & ((1 << (4 * ndigits)) - 1)) : value))
+        return 1;
+    return 0;
+}
+
+/*
+ * Compare an mOTP digest with the given OTP, which is a prefix of the digest in hex.
+ */
+static int
+otp_matches_digest(const struct otp_user *user, const struct otp_given *given, const u_char *digest)
+{
+    char otpbuf[OTP_BUF_SIZE];
+    int value;
+    int i;
+
+    /* Compare as integers if the value fits; if the given OTP was not valid hex, it can't match */
+    if (user->num_digits < 8) {
+        if (given->value16 == -1)
+            return 0;
+        for (value = 0, i = 0; i < user->num_digits; i++)
+            value = (value << 4) | ((i & 1) != 0 ? digest[i / 2] & 0x0f : digest[i / 2] >> 4);
+        return value == given->value16;
+    }
+
+    /* Compare as strings */
+    printhex(otpbuf, sizeof(otpbuf), digest, MD5_DIGEST_LEN, user->num_digits);
+    return strcasecmp(given->str, otpbuf) == 0;
+}
+
+/*
+ * Search for a match at offsets "lo" through "hi" (inclusive) relative to "counter", nearest-first around
+ * the offset predicted by the user's "drift" (see otp_drift()). HOTP and mOTP values are computed in batches
+ * if possible. Returns 1 and sets *offsetp if a match was found, otherwise zero.
+ */
+static int
+otp_search(struct otp_user *user, const struct otp_given *given, int counter, int lo, int hi, int drift, int *offsetp)
+{
+    u_char hashes[HMAC_SHA1_MAX_BATCH][SHA1_DIGEST_LEN];
+    u_char digests[MD5_MAX_BATCH][MD5_DIGEST_LEN];
+    uint64_t counters[HMAC_SHA1_MAX_BATCH > MD5_MAX_BATCH ? HMAC_SHA1_MAX_BATCH : MD5_MAX_BATCH];
+    int offsets[HMAC_SHA1_MAX_BATCH > MD5_MAX_BATCH ? HMAC_SHA1_MAX_BATCH : MD5_MAX_BATCH];
+    const int center = otp_search_center(lo, hi, drift);
+    const int dir = drift < 0 ? -1 : 1;
+    const int steps = 2 * (center - lo > hi - center ? center - lo : hi - center);
+    int batch = 1;
+    int offset;
+    int step;
+    int num;
+    int i;
+
+    /* Get batch size */
+    if (user->algorithm == OTP_ALGORITHM_MOTP && md5_impl != NULL)
+        batch = md5_batch_size();
+    else if (user->algorithm == OTP_ALGORITHM_HOTP && user->hkey->ictx == NULL)
+        batch = hmac_sha1_batch_size();
+
+    /* Search window */
+    for (step = 0; step <= steps; ) {
+
+        /* Get the next batch of offsets in search order */
+        for (num = 0; num < batch && step <= steps; step++) {
+            offset = NEAREST_OFFSET(center, dir, step);
+            if (offset >= lo && offset <= hi)
+                offsets[num++] = offset;
+        }
+
+        /* Check them */
+        if (num == 1) {
+            if (otp_matches(user, given, counter + offsets[0]))
+                goto found;
+            continue;
+        }
+        for (i = 0; i < num; i++)
+            counters[i] = (u_long)(counter + offsets[i]);
+        user->num_hashes += num;
+        if (user->algorithm == OTP_ALGORITHM_MOTP) {
+            motp_digests(user->mkey, counters, num, digests);
+            for (i = 0; i < num; i++) {
+                if (otp_matches_digest(user, given, digests[i]))
+                    goto found_batch;
+            }
+            continue;
+        }
+        hmac_sha1_counter_batch(&user->hkey->state, counters, num, hashes);
+        for (i = 0; i < num; i++) {
+            if (otp_matches_value(user, given, hotp_truncate(hashes[i])))
+                goto found_batch;
+        }
+    }
+    return 0;
+
+found_batch:
+    *offsetp = offsets[i];
+    return 1;
+
+found:
+    *offsetp = offsets[0];
+    return 1;
+}
+
+/*
+ * Like otp_search(), but using already computed HOTP values, where values[0] corresponds to offset "lo".
+ */
+static int
+otp_search_values(const struct otp_user *user, const struct otp_given *given, const int *values,
+    int lo, int hi, int drift, int *offsetp)
+{
+    const int center = otp_search_center(lo, hi, drift);
+    const int dir = drift < 0 ? -1 : 1;
+    const int steps = 2 * (center - lo > hi - center ? center - lo : hi - center);
+    int offset;
+    int step;
+
+    for (step = 0; step <= steps; step++) {
+        offset = NEAREST_OFFSET(center, dir, step);
+        if (offset >= lo && offset <= hi && otp_matches_value(user, given, values[offset - lo])) {
+            *offsetp = offset;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Get the offset at which to start searching: the user's average drift, rounded and limited to the window.
+ */
+static int
+otp_search_center(int lo, int hi, int drift)
+{
+    const int center = (drift < 0 ? drift - 8 : drift + 8) / 16;
+
+    return center < lo ? lo : center > hi ? hi : center;
+}
+
+/*
+ * Search for two consecutive OTPs at offsets "lo" through "hi" relative to "counter", i.e., the first OTP at
+ * some offset and the second at the next one. The range is split among the threads of the thread pool, if any.
+ * Returns 1 and sets *offsetp to the offset of the first OTP if a match was found, otherwise zero.
+ */
+static int
+otp_resync(request_rec *r, struct otp_user *user, const struct otp_given *given1, const struct otp_given *given2,
+    int counter, int lo, int hi, int *offsetp)
+{
+    struct otp_resync_job *jobs;
+    struct otp_resync resync;
+    apr_status_t status;
+    int num_jobs;
+    int found = 0;
+    int i;
+
+    /* Initialize search */
+    memset(&resync, 0, sizeof(resync));
+    resync.given1 = given1;
+    resync.given2 = given2;
+    resync.counter = counter;
+
+    /* Search here if the range is small or there's no thread pool */
+    if (otp_resync_pool == NULL || hi - lo + 1 < 2 * OTP_RESYNC_CHUNK
+      || apr_thread_mutex_create(&resync.mutex, APR_THREAD_MUTEX_DEFAULT, r->pool) != 0
+      || apr_thread_cond_create(&resync.cond, r->pool) != 0)
+        return otp_resync_search(user, &resync, lo, hi, offsetp);
+
+    /* Split the range into jobs, each with its own copy of the user's key state */
+    num_jobs = OTP_RESYNC_THREADS;
+    jobs = apr_pcalloc(r->pool, num_jobs * sizeof(*jobs));
+    for (i = 0; i < num_jobs; i++) {
+        struct otp_resync_job *const job = &jobs[i];
+
+        job->resync = &resync;
+        memcpy(&job->user, user, sizeof(*user));
+        job->user.num_hashes = 0;
+        if (user->mkey != NULL) {
+            memcpy(&job->mkey, user->mkey, sizeof(job->mkey));
+            job->user.mkey = &job->mkey;
+        }
+        job->lo = lo + (int)(((long)hi - lo + 1) * i / num_jobs);
+        job->hi = lo + (int)(((long)hi - lo + 1) * (i + 1) / num_jobs) - 1;
+    }
+
+    /* Run jobs, running any the pool won't take in this thread, and wait for them to finish */
+    resync.pending = num_jobs;
+    for (i = 0; i < num_jobs; i++) {
+        if ((status = apr_thread_pool_push(otp_resync_pool, otp_resync_thread, &jobs[i], APR_THREAD_TASK_PRIORITY_NORMAL, NULL)) != 0)
+            otp_resync_thread(NULL, &jobs[i]);
+    }
+    apr_thread_mutex_lock(resync.mutex);
+    while (resync.pending > 0)
+        apr_thread_cond_wait(resync.cond, resync.mutex);
+    apr_thread_mutex_unlock(resync.mutex);
+
+    /* Gather results; if more than one job found a match, take the one nearest the expected counter */
+    for (i = 0; i < num_jobs; i++) {
+        user->num_hashes += jobs[i].user.num_hashes;
+        if (jobs[i].found && (!found || abs(jobs[i].offset) < abs(*offsetp))) {
+            *offsetp = jobs[i].offset;
+            found = 1;
+        }
+    }
+    return found;
+}
+
+/*
+ * Search offsets "lo" through "hi" in order for two consecutive OTPs, in chunks, giving up if another job finds them first.
+ */
+static int
+otp_resync_search(struct otp_user *user, struct otp_resync *resync, int lo, int hi, int *offsetp)
+{
+    int chunk_hi;
+    int offset;
+
+    while (lo <= hi && !resync->stop) {
+        chunk_hi = hi - lo < OTP_RESYNC_CHUNK ? hi : lo + OTP_RESYNC_CHUNK - 1;
+        if (!otp_search(user, resync->given1, resync->counter, lo, chunk_hi, 0, &offset)) {
+            lo = chunk_hi + 1;
+            continue;
+        }
+        if (otp_matches(user, resync->given2, (u_long)(resync->counter + offset + 1))) {
+            *offsetp = offset;
+            return 1;
+        }
+        lo = offset + 1;
+    }
+    return 0;
+}
+
+static void *APR_THREAD_FUNC
+otp_resync_thread(apr_thread_t *thread, void *data)
+{
+    struct otp_resync_job *const job = data;
+    struct otp_resync *const resync = job->resync;
+
+    job->found = otp_resync_search(&job->user, resync, job->lo, job->hi, &job->offset);
+    apr_thread_mutex_lock(resync->mutex);
+    if (job->found)
+        resync->stop = 1;
+    if (--resync->pending == 0)
+        apr_thread_cond_signal(resync->cond);
+    apr_thread_mutex_unlock(resync->mutex);
+    return NULL;
+}
+
+/*
+ * Start an OTP search on the thread pool. Returns zero if started, otherwise -1, in which case nothing was searched.
+ */
+static int
+otp_overlap_start(request_rec *r, struct otp_overlap *overlap)
+{
+    if (otp_resync_pool == NULL
+      || apr_thread_mutex_create(&overlap->mutex, APR_THREAD_MUTEX_DEFAULT, r->pool) != 0
+      || apr_thread_cond_create(&overlap->cond, r->pool) != 0
+      || apr_thread_pool_push(otp_resync_pool, otp_overlap_thread, overlap, APR_THREAD_TASK_PRIORITY_HIGHEST, NULL) != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * Wait for an OTP search started by otp_overlap_start() to finish.
+ * Returns 1 and sets *offsetp to the offset of the match if found, otherwise zero.
+ */
+static int
+otp_overlap_finish(struct otp_overlap *overlap, int *offsetp)
+{
+    apr_thread_mutex_lock(overlap->mutex);
+    while (!overlap->done)
+        apr_thread_cond_wait(overlap->cond, overlap->mutex);
+    apr_thread_mutex_unlock(overlap->mutex);
+    if (overlap->found)
+        *offsetp = overlap->offset;
+    return overlap->found;
+}
+
+static void *APR_THREAD_FUNC
+otp_overlap_thread(apr_thread_t *thread, void *data)
+{
+    struct otp_overlap *const overlap = data;
+    int found;
+    int offset;
+
+    found = otp_search(overlap->user, overlap->given, overlap->counter, overlap->lo, overlap->hi, overlap->drift,
+      &offset);
+    apr_thread_mutex_lock(overlap->mutex);
+    overlap->found = found;
+    overlap->offset = offset;
+    overlap->done = 1;
+    apr_thread_cond_signal(overlap->cond);
+    apr_thread_mutex_unlock(overlap->mutex);
+    return NULL;
+}
+
+/*
+ * Get the user's observed drift, i.e., the average offset adjustment of the user's recent successful
+ * time-based logins, in sixteenths of a time step. A token running fast or slow shows a consistently
+ * positive or negative drift. Returns zero if unknown.
+ */
+static int
+otp_drift(const struct otp_user *user)
+{
+    struct otp_window *slot;
+    int drift = 0;
+
+    if (otp_window_cache.slots == NULL || user->time_interval == 0)
+        return 0;
+    slot = otp_cache_slot(&otp_window_cache, user->username, NULL, user->token);
+    otp_cache_lock(&otp_window_cache);
+    if (strcmp(slot->username, user->username) == 0
+      && slot->keylen == user->keylen && memcmp(slot->key, user->key, user->keylen) == 0)
+        drift = slot->drift;
+    otp_cache_unlock(&otp_window_cache);
+    return drift;
+}
+
+/*
+ * Record the offset adjustment of a successful time-based login in the user's observed drift.
+ */
+static void
+otp_drift_update(const struct otp_user *user, int offset)
+{
+    struct otp_window *slot;
+
+    if (otp_window_cache.slots == NULL || user->time_interval == 0)
+        return;
+    slot = otp_cache_slot(&otp_window_cache, user->username, NULL, user->token);
+    otp_cache_lock(&otp_window_cache);
+    if (strcmp(slot->username, user->username) != 0
+      || slot->keylen != user->keylen || memcmp(slot->key, user->key, user->keylen) != 0) {
+        memset(slot, 0, sizeof(*slot));
+        apr_snprintf(slot->username, sizeof(slot->username), "%s", user->username);
+        memcpy(slot->key, user->key, user->keylen);
+        slot->keylen = user->keylen;
+    }
+    if (offset > OTP_WINDOW_SIZE)
+        offset = OTP_WINDOW_SIZE;
+    else if (offset < -OTP_WINDOW_SIZE)
+        offset = -OTP_WINDOW_SIZE;
+    slot->drift += (offset * 16 - slot->drift) / 4;
+    slot->version++;
+    otp_cache_unlock(&otp_window_cache);
+}
+
+/*
+ * Get the truncated HOTP values for offsets "lo" through "hi" relative to "counter" into values[0] ... values[hi - lo].
+ *
+ * Successive requests for the same user mostly check the same counters: the window advances past
+ * each accepted event counter, or by one step per time interval. So the values are kept in a small
+ * per-process ring for each user, and only counters not already in the ring are computed.
+ *
+ * Returns 1 if successful, 0 if the window is not cacheable, or -1 on error.
+ */
+static int
+otp_window_values(request_rec *r, struct otp_user *user, int counter, int lo, int hi, time_t now, int *values)
+{
+    struct otp_window window;
+    int cached;
+
+    if ((cached = otp_window_begin(r, user, counter, lo, hi, &window, NULL)) == 1)
+        otp_window_end(user, counter, lo, hi, now, &window, values);
+    return cached;
+}
+
+/*
+ * Copy out a user's cached window and extend it to offsets "lo" through "hi" relative to "counter". If "queue"
+ * is not NULL, the missing values may instead be added to it, in which case they are only valid once the queue
+ * has been flushed with otp_hash_flush(). Returns 1 if successful, 0 if the window is not cacheable, or -1 on error.
+ */
+static int
+otp_window_begin(request_rec *r, struct otp_user *user, int counter, int lo, int hi, struct otp_window *window,
+    struct otp_hash_queue *queue)
+{
+    struct otp_window *slot;
+
+    /* Is the window cacheable? */
+    if (otp_window_cache.slots == NULL || hi - lo + 1 > OTP_WINDOW_SIZE)
+        return 0;
+    slot = otp_cache_slot(&otp_window_cache, user->username, NULL, user->token);
+
+    /* Copy out the cached values so they can be updated without holding the lock */
+    otp_cache_lock(&otp_window_cache);
+    memcpy(window, slot, sizeof(*window));
+    otp_cache_unlock(&otp_window_cache);
+
+    /* If the slot belongs to another user or key, start over */
+    if (strcmp(window->username, user->username) != 0
+      || window->keylen != user->keylen || memcmp(window->key, user->key, user->keylen) != 0) {
+        apr_snprintf(window->username, sizeof(window->username), "%s", user->username);
+        memcpy(window->key, user->key, user->keylen);
+        window->keylen = user->keylen;
+        window->count = 0;
+        window->drift = 0;
+        window->precomputed = 0;
+    }
+
+    /* Compute any values we don't already have */
+    if (window->count == 0 || (long)counter + lo < window->first || (long)counter + hi >= window->first + window->count) {
+        if (user->hkey == NULL && hotp_key_init(r, user) != 0)
+            return -1;
+        user->num_hashes += otp_window_extend(window, user->hkey, (long)counter + lo, (long)counter + hi, queue);
+        if (otp_precompute_tid != NULL && user->time_interval != 0)
+            apr_atomic_inc32(&otp_precompute_misses);
+    } else if (window->precomputed)
+        apr_atomic_inc32(&otp_precompute_hits);
+    window->precomputed = 0;
+    return 1;
+}
+
+/*
+ * Get the values for offsets "lo" through "hi" relative to "counter" from a window returned by otp_window_begin(),
+ * and store the window back in the user's slot.
+ */
+static void
+otp_window_end(const struct otp_user *user, int counter, int lo, int hi, time_t now, struct otp_window *window,
+    int *values)
+{
+    struct otp_window *const slot = otp_cache_slot(&otp_window_cache, user->username, NULL, user->token);
+    long c;
+
+    /* Remember how this user's window is positioned, for background precomputation */
+    window->last_used = now;
+    window->time_interval = user->time_interval;
+    window->offset = user->offset;
+    window->window_lo = lo;
+    window->window_hi = hi;
+
+    /* Return values and store the updated window */
+    for (c = (long)counter + lo; c <= (long)counter + hi; c++)
+        values[c - ((long)counter + lo)] = window->values[(u_long)c & (OTP_WINDOW_SIZE - 1)];
+    otp_cache_lock(&otp_window_cache);
+    window->version = slot->version + 1;
+    memcpy(slot, window, sizeof(*window));
+    otp_cache_unlock(&otp_window_cache);
+}
+
+/*
+ * Compute the HOTP values queued by otp_window_begin(), several keys at a time, and store each where it belongs.
+ */
+static void
+otp_hash_flush(struct otp_hash_queue *queue)
+{
+    u_char hashes[HMAC_SHA1_MAX_BATCH][SHA1_DIGEST_LEN];
+    int num;
+    int i;
+    int j;
+
+    for (i = 0; i < queue->count; i += num) {
+        num = queue->count - i < HMAC_SHA1_MAX_BATCH ? queue->count - i : HMAC_SHA1_MAX_BATCH;
+        hmac_sha1_multi_batch(queue->keys + i, queue->counters + i, num, hashes);
+        for (j = 0; j < num; j++)
+            *queue->values[i + j] = hotp_truncate(hashes[j]);
+    }
+    queue->count = 0;
+}
+
+/*
+ * Extend a window to include counters "lo" through "hi", computing (or, if "queue" is not NULL, queueing)
+ * only the values not already cached. Values already cached outside that range are kept as long as they fit
+ * in the ring, preferring higher counters. Returns the number of values computed.
+ */
+static int
+otp_window_extend(struct otp_window *window, const struct hotp_key *hkey, long lo, long hi, struct otp_hash_queue *queue)
+{
+    long first = window->first;
+    long last = window->first + window->count - 1;
+    long new_first;
+    long new_last;
+    int computed;
+
+    /* If the cached range doesn't overlap or adjoin the new one, start over */
+    if (window->count == 0 || lo > last + 1 || hi < first - 1) {
+        first = lo;
+        last = lo - 1;
+    }
+
+    /* Get the union of the ranges, trimmed to fit in the ring */
+    new_last = last > hi ? last : hi;
+    if (new_last > lo + OTP_WINDOW_SIZE - 1)
+        new_last = lo + OTP_WINDOW_SIZE - 1;
+    new_first = first < lo ? first : lo;
+    if (new_first < new_last - OTP_WINDOW_SIZE + 1)
+        new_first = new_last - OTP_WINDOW_SIZE + 1;
+
+    /* Compute the missing values below and above the cached range */
+    if (first > last) {
+        computed = new_last - new_first + 1;
+        hotp_range(hkey, new_first, computed, window->values, queue);
+    } else {
+        computed = 0;
+        if (new_first < first) {
+            hotp_range(hkey, new_first, first - new_first, window->values, queue);
+            computed += first - new_first;
+        }
+        if (new_last > last) {
+            hotp_range(hkey, last + 1, new_last - last, window->values, queue);
+            computed += new_last - last;
+        }
+    }
+    window->first = new_first;
+    window->count = new_last - new_first + 1;
+    return computed;
+}
+
+/*
+ * Extend the windows of recently active time-based users to cover the time step at "when",
+ * so requests arriving just after the step boundary find their values already computed.
+ */
+static void
+otp_precompute(time_t when)
+{
+    struct otp_window *const windows = otp_window_cache.slots;
+    struct otp_window window;
+    struct hotp_key hkey;
+    long counter;
+    int i;
+
+    memset(&hkey, 0, sizeof(hkey));
+    for (i = 0; i < otp_window_cache.num_slots; i++) {
+
+        /* Copy out slot and see whether the step at "when" is already covered */
+        otp_cache_lock(&otp_window_cache);
+        memcpy(&window, &windows[i], sizeof(window));
+        otp_cache_unlock(&otp_window_cache);
+        if (window.count == 0 || window.time_interval == 0 || when - window.last_used > OTP_PRECOMPUTE_IDLE)
+            continue;
+        counter = (int)when / window.time_interval + window.offset;
+        if (counter + window.window_lo >= window.first && counter + window.window_hi < window.first + window.count)
+            continue;
+
+        /* Extend window; the slot is only updated if no request changed it in the meantime */
+        hmac_sha1_key_init(&hkey.state, window.key, window.keylen);
+        otp_window_extend(&window, &hkey, counter + window.window_lo, counter + window.window_hi, NULL);
+        window.precomputed = 1;
+        otp_cache_lock(&otp_window_cache);
+        if (windows[i].version == window.version) {
+            window.version++;
+            memcpy(&windows[i], &window, sizeof(window));
+        }
+        otp_cache_unlock(&otp_window_cache);
+    }
+    memset(&hkey, 0, sizeof(hkey));
+}
+
+/*
+ * Background thread that precomputes time-based windows once a second until told to stop.
+ */
+static void *APR_THREAD_FUNC
+otp_precompute_thread(apr_thread_t *thread, void *data)
+{
+    otp_cache_lock(&otp_window_cache);
+    while (!otp_precompute_stop) {
+        apr_thread_cond_timedwait(otp_precompute_cond, otp_window_cache.mutex, apr_time_from_sec(1));
+        if (otp_precompute_stop)
+            break;
+        otp_cache_unlock(&otp_window_cache);
+        otp_precompute(time(NULL) + OTP_PRECOMPUTE_LEAD);
+        otp_cache_lock(&otp_window_cache);
+    }
+    otp_cache_unlock(&otp_window_cache);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t
+otp_precompute_cleanup(void *data)
+{
+    apr_status_t status;
+
+    otp_cache_lock(&otp_window_cache);
+    otp_precompute_stop = 1;
+    apr_thread_cond_signal(otp_precompute_cond);
+    otp_cache_unlock(&otp_window_cache);
+    apr_thread_join(&status, otp_precompute_tid);
+    otp_precompute_tid = NULL;
+    return APR_SUCCESS;
+}
+
+/*
+ * Compute the truncated HOTP values for "count" consecutive counters starting at "first",
+ * storing each in the ring "values" at its counter modulo OTP_WINDOW_SIZE. With the internal
+ * SHA-1, the values are added to "queue" instead, if it is not NULL.
+ */
+static void
+hotp_range(const struct hotp_key *hkey, long first, int count, int *values, struct otp_hash_queue *queue)
+{
+    u_char hashes[HMAC_SHA1_MAX_BATCH][SHA1_DIGEST_LEN];
+    uint64_t counters[HMAC_SHA1_MAX_BATCH];
+    int num;
+    int i;
+
+    /* Queue the counters to be computed along with other keys' */
+    if (queue != NULL && hkey->ictx == NULL) {
+        for (; count > 0; first++, count--) {
+            queue->keys[queue->count] = &hkey->state;
+            queue->counters[queue->count] = (u_long)first;
+            queue->values[queue->count++] = &values[(u_long)first & (OTP_WINDOW_SIZE - 1)];
+        }
+        return;
+    }
+
+    /* Compute them now */
+    for (; count > 0; first += num, count -= num) {
+        if (hkey->ictx != NULL) {
+            num = 1;
+            values[(u_long)first & (OTP_WINDOW_SIZE - 1)] = hotp_value(hkey, (u_long)first);
+            continue;
+        }
+        num = count < HMAC_SHA1_MAX_BATCH ? count : HMAC_SHA1_MAX_BATCH;
+        for (i = 0; i < num; i++)
+            counters[i] = (u_long)(first + i);
+        hmac_sha1_counter_batch(&hkey->state, counters, num, hashes);
+        for (i = 0; i < num; i++)
+            values[(u_long)(first + i) & (OTP_WINDOW_SIZE - 1)] = hotp_truncate(hashes[i]);
+    }
+}
+
+/*
+ * Precompute the part of the mOTP message that follows the counter (the hex key and PIN)
+ * in each batch lane, so that only the counter digits need to be formatted per candidate.
+ */
+static void
+motp_key_init(request_rec *r, struct otp_user *user)
+{
+    struct motp_key *mkey;
+    char keybuf[MOTP_MAX_MESSAGE + 1];
+    char *suffix;
+    int i;
+
+    mkey = apr_palloc(r->pool, sizeof(*mkey));
+    suffix = mkey->msgs[0] + MOTP_MAX_COUNTER;
+    printhex(keybuf, sizeof(keybuf), user->key, user->keylen, user->keylen * 2);
+    mkey->suffix_len = apr_snprintf(suffix, MOTP_MAX_MESSAGE + 1, "%s%s", keybuf, user->pin);
+    if (mkey->suffix_len > MOTP_MAX_MESSAGE)
+        mkey->suffix_len = MOTP_MAX_MESSAGE;
+    for (i = 1; i < MD5_MAX_BATCH; i++)
+        memcpy(mkey->msgs[i] + MOTP_MAX_COUNTER, suffix, mkey->suffix_len);
+    user->mkey = mkey;
+}
+
+/*
+ * Generate an OTP using the mOTP algorithm defined by http://motp.sourceforge.net/
+ */
+static void
+motp(struct motp_key *mkey, u_long counter, int ndigits, char *buf, size_t buflen)
+{
+    u_char digest[1][MD5_DIGEST_LEN];
+    uint64_t counter64 = counter;
+
+    motp_digests(mkey, &counter64, 1, digest);
+    printhex(buf, buflen, digest[0], MD5_DIGEST_LEN, ndigits);
+}
+
+/*
+ * Compute the mOTP MD5 digests for several counters, in batches if possible.
+ */
+static void
+motp_digests(struct motp_key *mkey, const uint64_t *counters, int count, u_char (*digests)[MD5_DIGEST_LEN])
+{
+    const u_char *msgs[MD5_MAX_BATCH];
+    size_t lens[MD5_MAX_BATCH];
+    uint64_t value;
+    char *msg;
+    int num;
+    int i;
+
+    for (; count > 0; counters += num, digests += num, count -= num) {
+        num = count < MD5_MAX_BATCH ? count : MD5_MAX_BATCH;
+
+        /* Format each counter in decimal just before the suffix; the message is truncated as with snprintf() */
+        for (i = 0; i < num; i++) {
+            msg = mkey->msgs[i] + MOTP_MAX_COUNTER;
+            value = counters[i];
+            do {
+                *--msg = '0' + (char)(value % 10);
+                value /= 10;
+            } while (value != 0);
+            msgs[i] = (const u_char *)msg;
+            lens[i] = (mkey->msgs[i] + MOTP_MAX_COUNTER - msg) + mkey->suffix_len;
+            if (lens[i] > MOTP_MAX_MESSAGE)
+                lens[i] = MOTP_MAX_MESSAGE;
+        }
+
+        /* Compute digests */
+        if (md5_impl != NULL)
+            md5_batch(msgs, lens, num, digests);
+        else {
+            for (i = 0; i < num; i++)
+                MD5(msgs[i], lens[i], digests[i]);
+        }
+    }
+}
+
+/*
+ * Print hex digits into a buffer.
+ */
+static void
+printhex(char *buf, size_t buflen, const u_char *data, size_t dlen, int max_digits)
+{
+    const char *hexdig = "0123456789abcdef";
+    int i;
+
+    if (buflen > 0)
+        *buf = '\0';
+    for (i = 0; i / 2 < (int)dlen && i < max_digits && i < (int)buflen - 1; i++) {
+        u_int val = data[i / 2];
+        if ((i & 1) == 0)
+            val >>= 4;
+        val &= 0x0f;
+        *buf++ = hexdig[val];
+        *buf = '\0';
+    }
+}
+
+/*
+ * Verify PIN using an external authn provider configured via "OTPAuthPINAuthProvider".
+ */
+static authn_status
+authn_otp_check_pin_external(request_rec *r, struct otp_config *const conf, const char *username, const char *pin)
+{
+    authn_provider_list *pentry;
+    authn_provider_list *first;
+    authn_status status;
+    int position;
+
+    /* Verify that at least one authn provider is configured */
+    if ((pentry = conf->provlist) == NULL) {
+        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r,
+          "user \"%s\" PIN to be verified externally but no \"OTPAuthPINAuthProvider\" was configured", username);
+        return AUTH_DENIED;
+    }
+
+    /* Accept a PIN recently granted by one of the providers without asking it again, since that can be slow */
+    if (conf->pin_cache_time > 0 && (pentry = otp_pin_lookup(conf, username, pin)) != NULL) {
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r,
+          "user \"%s\" PIN validated by auth provider \"%s\" within %d sec. PIN cache time",
+          username, pentry->provider_name, conf->pin_cache_time);
+        return AUTH_GRANTED;
+    }
+
+    /* Try the provider that last recognized this user first, saving the calls to the providers before it */
+    status = AUTH_USER_NOT_FOUND;
+    if ((first = otp_affinity_lookup(conf, username, &position)) != NULL
+      && (status = otp_pin_provider_check(r, first, username, pin)) != AUTH_USER_NOT_FOUND) {
+        apr_atomic_add32(&otp_pin_calls_saved, position);
+        pentry = first;
+    }
+
+    /*
+     * Otherwise try each configured authn provider until we find one that recognizes this user. Only a provider
+     * that granted or denied the PIN is remembered; an error or unexpected result says nothing about the user.
+     */
+    if (status == AUTH_USER_NOT_FOUND) {
+        for (pentry = conf->provlist; pentry != NULL; pentry = pentry->next) {
+            if (pentry != first && (status = otp_pin_provider_check(r, pentry, username, pin)) != AUTH_USER_NOT_FOUND)
+                break;
+        }
+        if (pentry != NULL && conf->provlist->next != NULL && (status == AUTH_GRANTED || status == AUTH_DENIED))
+            otp_affinity_store(username, pentry->provider_name);
+    }
+
+    /* Check result */
+    switch (status) {
+    case AUTH_GRANTED:
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "user \"%s\" PIN successfully validated by auth provider \"%s\"",
+          username, pentry->provider_name);
+        if (conf->pin_cache_time > 0)
+            otp_pin_store(conf, pentry->provider_name, username, pin);
+        break;
+    case AUTH_DENIED:
+        ap_log_rerror(APLOG_MARK, conf->allow_fallthrough ? APLOG_INFO : APLOG_NOTICE, 0, r,
+          "user \"%s\" gave incorrect PIN according to PIN auth provider \"%s\"",
+          username, pentry->provider_name);
+        break;
+    case AUTH_USER_NOT_FOUND:
+        ap_log_rerror(APLOG_MARK, conf->allow_fallthrough ? APLOG_INFO : APLOG_NOTICE, 0, r,
+          "user \"%s\" is not known by any configured PIN auth provider", username);
+        break;
+    case AUTH_GENERAL_ERROR:                        /* assume the auth provider logged something interesting */
+        break;
+    case AUTH_USER_FOUND:
+    default:
+        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r,
+          "PIN auth provider \"%s\" returned unexpected value %d for user \"%s\"; treating as AUTH_DENIED",
+            pentry->provider_name, status, username);
+        status = AUTH_DENIED;
+        break;
+    }
+
+    /* Done */
+    return status;
+}
+
+/*
+ * Verify a PIN using one authn provider.
+ */
+static authn_status
+otp_pin_provider_check(request_rec *r, authn_provider_list *pentry, const char *username, const char *pin)
+{
+    authn_status status;
+
+    apr_table_setn(r->notes, AUTHN_PROVIDER_NAME_NOTE, pentry->provider_name);
+    status = pentry->provider->check_password(r, username, pin);
+    apr_table_unset(r->notes, AUTHN_PROVIDER_NAME_NOTE);
+    apr_atomic_inc32(&otp_pin_calls);
+    return status;
+}
+
+/*
+ * Find the configured PIN auth provider that last recognized a user, and its position in the chain.
+ * Returns NULL if not known, or if it's the first provider anyway.
+ */
+static authn_provider_list *
+otp_affinity_lookup(const struct otp_config *conf, const char *username, int *positionp)
+{
+    char provider_name[MAX_PROVIDER_NAME];
+    struct otp_affinity *entry;
+    authn_provider_list *pentry;
+    int position;
+
+    if (otp_affinity_cache.slots == NULL || conf->provlist->next == NULL)
+        return NULL;
+    entry = otp_cache_slot(&otp_affinity_cache, username, NULL, 0);
+    otp_cache_lock(&otp_affinity_cache);
+    if (strcmp(entry->username, username) == 0)
+        apr_cpystrn(provider_name, entry->provider_name, sizeof(provider_name));
+    else
+        *provider_name = '\0';
+    otp_cache_unlock(&otp_affinity_cache);
+    if (*provider_name == '\0')
+        return NULL;
+    for (position = 0, pentry = conf->provlist; pentry != NULL; position++, pentry = pentry->next) {
+        if (strcmp(pentry->provider_name, provider_name) == 0) {
+            *positionp = position;
+            return position > 0 ? pentry : NULL;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Remember the PIN auth provider that recognized a user.
+ */
+static void
+otp_affinity_store(const char *username, const char *provider_name)
+{
+    struct otp_affinity *entry;
+
+    if (otp_affinity_cache.slots == NULL || strlen(username) >= sizeof(entry->username)
+      || strlen(provider_name) >= sizeof(entry->provider_name))
+        return;
+    entry = otp_cache_slot(&otp_affinity_cache, username, NULL, 0);
+    otp_cache_lock(&otp_affinity_cache);
+    apr_cpystrn(entry->username, username, sizeof(entry->username));
+    apr_cpystrn(entry->provider_name, provider_name, sizeof(entry->provider_name));
+    otp_cache_unlock(&otp_affinity_cache);
+}
+
+/*
+ * Find a cached digest authentication HA1 hash for a user's current key and PIN in a realm, and either the
+ * given OTP, or if "otp" is NULL, the OTP at the given counter. Returns 1 and copies the OTP and hash if found.
+ */
+static int
+otp_ha1_lookup(const struct otp_user *user, const char *realm, const char *otp, int counter, char *otpbuf, char *ha1)
+{
+    struct otp_ha1 *entry;
+    int found = 0;
+
+    if (otp_ha1_cache.slots == NULL)
+        return 0;
+    entry = otp_cache_slot(&otp_ha1_cache, user->username, realm, 0);
+    otp_cache_lock(&otp_ha1_cache);
+    if (strcmp(entry->username, user->username) == 0
+      && strcmp(entry->realm, realm) == 0
+      && entry->algorithm == user->algorithm
+      && entry->num_digits == user->num_digits
+      && entry->keylen == user->keylen
+      && memcmp(entry->key, user->key, user->keylen) == 0
+      && strcmp(entry->pin, user->pin) == 0
+      && (otp != NULL ? strcmp(entry->otp, otp) == 0 : entry->counter_valid && entry->counter == counter)) {
+        apr_cpystrn(otpbuf, entry->otp, sizeof(entry->otp));
+        apr_cpystrn(ha1, entry->ha1, sizeof(entry->ha1));
+        found = 1;
+    }
+    otp_cache_unlock(&otp_ha1_cache);
+    return found;
+}
+
+/*
+ * Cache a digest authentication HA1 hash for a user's current key and PIN in a realm, and the OTP it was computed from.
+ */
+static void
+otp_ha1_store(const struct otp_user *user, const char *realm, int counter_valid, int counter, const char *otp,
+    const char *ha1)
+{
+    struct otp_ha1 *entry;
+
+    if (otp_ha1_cache.slots == NULL || strlen(realm) >= sizeof(entry->realm) || strlen(otp) >= sizeof(entry->otp)
+      || strlen(ha1) >= sizeof(entry->ha1))
+        return;
+    entry = otp_cache_slot(&otp_ha1_cache, user->username, realm, 0);
+    otp_cache_lock(&otp_ha1_cache);
+    apr_cpystrn(entry->username, user->username, sizeof(entry->username));
+    apr_cpystrn(entry->realm, realm, sizeof(entry->realm));
+    entry->algorithm = user->algorithm;
+    entry->num_digits = user->num_digits;
+    memcpy(entry->key, user->key, user->keylen);
+    entry->keylen = user->keylen;
+    apr_cpystrn(entry->pin, user->pin, sizeof(entry->pin));
+    entry->counter_valid = counter_valid;
+    entry->counter = counter;
+    apr_cpystrn(entry->otp, otp, sizeof(entry->otp));
+    apr_cpystrn(entry->ha1, ha1, sizeof(entry->ha1));
+    otp_cache_unlock(&otp_ha1_cache);
+}
+
+/*
+ * Verify PIN.
+ */
+static authn_status
+authn_otp_check_pin(request_rec *r, struct otp_config *const conf, struct otp_user *const user, const char *pin)
+{
+    switch (user->pincfg) {
+    case PIN_CONFIG_NONE:                               /* User has no PIN, so provided PIN must be the empty string */
+        if (*pin != '\0') {
+            ap_log_rerror(APLOG_MARK, conf->allow_fallthrough ? APLOG_INFO : APLOG_NOTICE, 0, r,
+              "user \"%s\" supplied a PIN but none is configured in the users file", user->username);
+            return AUTH_DENIED;
+        }
+        return AUTH_GRANTED;
+    case PIN_CONFIG_EXTERNAL:                           /* User's PIN must be verified externally via an OTPAuthPINAuthProvider */
+        return authn_otp_check_pin_external(r, conf, user->username, pin);
+    case PIN_CONFIG_LITERAL:                            /* User's PIN was given explicitly in the users file */
+        if (strcmp(pin, user->pin) != 0) {
+            ap_log_rerror(APLOG_MARK, conf->allow_fallthrough ? APLOG_INFO : APLOG_NOTICE, 0, r,
+              "user \"%s\" PIN does not match value in users file", user->username);
+            return AUTH_DENIED;
+        }
+        return AUTH_GRANTED;
+    default:                                            /* This should never happen */
+        abort();
+        return AUTH_DENIED;
+    }
+}
+
+/*
+ * Compute the signature of a session cookie: HMAC-SHA1, under the configured session key, of the realm, users file,
+ * username, expiry, (if bound) client IP address, and the last OTP and login time of each of the user's tokens.
+ * Logging in with a new OTP, or logging out, changes the latter and so revokes the cookies issued before.
+ * Fails if the user is no longer in the users file, or is locked out. Returns zero on success.
+ */
+static int
+otp_session_mac(request_rec *r, const struct otp_config *conf, const char *username, long expiry, u_char *mac)
+{
+    const char *const realm = ap_auth_name(r);
+    struct otp_user user;
+    char buf[2048];
+    int num_tokens = 1;
+    int len;
+    int i;
+
+    len = apr_snprintf(buf, sizeof(buf), "%s%c%s%c%s%c%ld%c%s", realm != NULL ? realm : "", '\0', conf->users_file, '\0',
+      username, '\0', expiry, '\0', conf->session_bind_ip ? USER_AGENT_IP(r) : "");
+    for (i = 0; i < num_tokens && len < sizeof(buf) - 1; i++) {
+        memset(&user, 0, sizeof(user));
+        apr_snprintf(user.username, sizeof(user.username), "%s", username);
+        user.token = i;
+        if (find_update_user(r, conf, &user, 0) != AUTH_USER_FOUND)
+            return -1;
+        if (i == 0) {
+            if (conf->max_otp_failures != 0
+              && user.num_otp_failures + otp_failure_pending(conf, username) >= conf->max_otp_failures)
+                return -1;
+            num_tokens = user.num_tokens < OTP_MAX_TOKENS ? user.num_tokens : OTP_MAX_TOKENS;
+        }
+        len += apr_snprintf(buf + len, sizeof(buf) - len, "%c%s%c%ld", '\0', user.last_otp, '\0', (long)user.last_auth);
+    }
+    if (len >= sizeof(buf) - 1)
+        return -1;
+    return otp_hmac(conf->session_key, buf, len, mac);
+}
+
+/*
+ * Get the path session cookies apply to: OTPAuthSessionPath if set, otherwise the directory of the request URI.
+ */
+static const char *
+otp_session_path(request_rec *r, const struct otp_config *conf)
+{
+    const char *slash;
+
+    if (conf->session_path != NULL)
+        return conf->session_path;
+    if (r->uri == NULL || *r->uri != '/' || strpbrk(r->uri, ";, \t\"") != NULL || (slash = strrchr(r->uri, '/')) == NULL)
+        return "/";
+    return apr_pstrndup(r->pool, r->uri, slash - r->uri + 1);
+}
+
+/*
+ * Issue a session cookie for a user who was just granted access. The cookie value is the hex-encoded username,
+ * the expiry time, and the hex-encoded signature, separated by periods.
+ */
+static void
+otp_session_issue(request_rec *r, const struct otp_config *conf, const char *username)
+{
+    char userhex[MAX_USERNAME * 2 + 1];
+    char machex[SHA1_DIGEST_LEN * 2 + 1];
+    u_char mac[SHA1_DIGEST_LEN];
+    long expiry;
+
+    if (strlen(username) >= MAX_USERNAME)
+        return;
+    expiry = (long)time(NULL) + conf->session_lifetime;
+    if (otp_session_mac(r, conf, username, expiry, mac) != 0) {
+        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "can't compute session cookie signature for \"%s\"", username);
+        return;
+    }
+    printhex(userhex, sizeof(userhex), (const u_char *)username, strlen(username), sizeof(userhex) - 1);
+    printhex(machex, sizeof(machex), mac, sizeof(mac), sizeof(machex) - 1);
+    apr_table_addn(r->err_headers_out, "Set-Cookie", apr_psprintf(r->pool, "%s=%s.%ld.%s; Max-Age=%d; Path=%s; HttpOnly%s",
+      SESSION_COOKIE_NAME, userhex, expiry, machex, conf->session_lifetime, otp_session_path(r, conf),
+      strcmp(ap_http_scheme(r), "https") == 0 ? "; Secure" : ""));
+}
+
+/*
+ * Expire the client's session cookie, e.g., on logout.
+ */
+static void
+otp_session_clear(request_rec *r, const struct otp_config *conf)
+{
+    if (conf->session_lifetime <= 0 || conf->session_key == NULL)
+        return;
+    apr_table_addn(r->err_headers_out, "Set-Cookie",
+      apr_psprintf(r->pool, "%s=; Max-Age=0; Path=%s; HttpOnly", SESSION_COOKIE_NAME, otp_session_path(r, conf)));
+}
+
+/*
+ * Authenticate a request via a valid session cookie, verifying its signature against the user's record from the
+ * (per-process cached) users file, so a cookie stops working once the user logs out, logs in again elsewhere, is
+ * locked out, or is removed. Requests whose Basic credentials name another user, or have an empty password
+ * (a logout), are left to the authn providers.
+ */
+static int
+authn_otp_check_session(request_rec *r)
+{
+    struct otp_config confbuf;
+    struct otp_config *const conf = get_config(r, &confbuf);
+    char username[MAX_USERNAME];
+    char authbuf[MAX_USERNAME + MAX_PIN + MAX_OTP + 2];
+    u_char mac[SHA1_DIGEST_LEN];
+    u_char given[SHA1_DIGEST_LEN];
+    const char *cookie;
+    const char *auth;
+    const char *s;
+    const char *t;
+    char *end;
+    long expiry;
+    int diff;
+    int i;
+
+    /* Is this directory using session cookies with Basic authentication? */
+    if (conf->session_lifetime <= 0 || conf->session_key == NULL || conf->users_file == NULL
+      || ap_auth_type(r) == NULL || strcasecmp(ap_auth_type(r), "Basic") != 0)
+        return DECLINED;
+
+    /* Find our cookie */
+    if ((cookie = apr_table_get(r->headers_in, "Cookie")) == NULL)
+        return DECLINED;
+    for (s = cookie; (s = strstr(s, SESSION_COOKIE_NAME "=")) != NULL; s += sizeof(SESSION_COOKIE_NAME)) {
+        if (s == cookie || s[-1] == ' ' || s[-1] == ';')
+            break;
+    }
+    if (s == NULL)
+        return DECLINED;
+    s += sizeof(SESSION_COOKIE_NAME);
+
+    /* Parse hex-encoded username */
+    for (i = 0; i < sizeof(username) - 1 && apr_isxdigit(s[0]) && apr_isxdigit(s[1]); i++, s += 2)
+        username[i] = (char)((apr_isdigit(s[0]) ? s[0] - '0' : apr_tolower(s[0]) - 'a' + 10) << 4
+          | (apr_isdigit(s[1]) ? s[1] - '0' : apr_tolower(s[1]) - 'a' + 10));
+    username[i] = '\0';
+    if (i == 0 || *s++ != '.' || strlen(username) != i)
+        return DECLINED;
+
+    /* Parse expiry */
+    expiry = strtol(s, &end, 10);
+    if (end == s || *end != '.' || expiry <= (long)time(NULL))
+        return DECLINED;
+    s = end + 1;
+
+    /* Parse signature */
+    for (i = 0; i < sizeof(given); i++, s += 2) {
+        if (!apr_isxdigit(s[0]) || !apr_isxdigit(s[1]))
+            return DECLINED;
+        given[i] = (u_char)((apr_isdigit(s[0]) ? s[0] - '0' : apr_tolower(s[0]) - 'a' + 10) << 4
+          | (apr_isdigit(s[1]) ? s[1] - '0' : apr_tolower(s[1]) - 'a' + 10));
+    }
+    if (*s != '\0' && *s != ';' && *s != ' ')
+        return DECLINED;
+
+    /* Leave requests with credentials for another user, or an empty password, to the authn providers */
+    if ((auth = apr_table_get(r->headers_in, r->proxyreq == PROXYREQ_PROXY ? "Proxy-Authorization" : "Authorization")) != NULL
+      && strncasecmp(auth, "Basic ", 6) == 0) {
+        for (auth += 6; *auth == ' '; auth++);
+        if (apr_base64_decode_len(auth) > sizeof(authbuf))
+            return DECLINED;
+        authbuf[apr_base64_decode(authbuf, auth)] = '\0';
+        if ((t = strchr(authbuf, ':')) == NULL || t - authbuf != strlen(username)
+          || strncmp(authbuf, username, t - authbuf) != 0 || t[1] == '\0')
+            return DECLINED;
+    }
+
+    /* Verify signature */
+    if (otp_session_mac(r, conf, username, expiry, mac) != 0)
+        return DECLINED;
+    for (diff = i = 0; i < sizeof(mac); i++)
+        diff |= mac[i] ^ given[i];
+    if (diff != 0) {
+        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "invalid session cookie for user \"%s\"", username);
+        return DECLINED;
+    }
+
+    /* Accept */
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "accepting session cookie for \"%s\"", username);
+    r->user = apr_pstrdup(r->pool, username);
+    r->ap_auth_type = apr_pstrdup(r->pool, "Basic");
+    return OK;
+}
+
+/*
+ * Join a verification of the same credentials from the same client IP address, under an equivalent configuration,
+ * already in flight in this process, or else start one. Returns zero if we waited for another request's verification,
+ * with its result in "*statusp" and the stage that decided it in "*stagep". Otherwise returns 1, and the caller must
+ * verify and then pass "*flightp" to otp_flight_end() unless it is NULL (which happens if the table is full, in which
+ * case others can't wait for us, or if the verification we waited for took longer than OTP_FLIGHT_WAIT seconds).
+ * A granted result is only shared when OTPAuthMaxLinger allows reusing the OTP; otherwise 1 is returned once it is
+ * known, so the caller verifies the OTP again and finds it already used, as if it had come after the other request.
+ */
+static int
+otp_flight_begin(request_rec *r, const struct otp_config *conf, const char *username, const char *password,
+    struct otp_flight **flightp, authn_status *statusp, int *stagep)
+{
+    const char *const ip = USER_AGENT_IP(r);
+    const apr_time_t deadline = apr_time_now() + apr_time_from_sec(OTP_FLIGHT_WAIT);
+    struct otp_flight *flight;
+    struct otp_flight *free_flight = NULL;
+    apr_time_t now;
+    int done;
+    int i;
+
+    *flightp = NULL;
+    if (otp_flight_mutex == NULL)
+        return 1;
+    apr_thread_mutex_lock(otp_flight_mutex);
+    for (i = 0; i < OTP_FLIGHT_SLOTS; i++) {
+        flight = &otp_flights[i];
+        if (!flight->in_use) {
+            if (free_flight == NULL)
+                free_flight = flight;
+            continue;
+        }
+        if (flight->done
+          || strcmp(flight->username, username) != 0
+          || strcmp(flight->password, password) != 0
+          || strcmp(flight->ip, ip) != 0
+          || !otp_config_equivalent(flight->conf, conf))
+            continue;
+
+        /* Wait for the leader's result, but not forever; the last one out frees the slot */
+        flight->waiters++;
+        while (!flight->done && (now = apr_time_now()) < deadline)
+            apr_thread_cond_timedwait(otp_flight_cond, otp_flight_mutex, deadline - now);
+        *statusp = flight->status;
+        *stagep = flight->stage;
+        done = flight->done;
+        if (--flight->waiters == 0 && done)
+            flight->in_use = 0;
+        apr_thread_mutex_unlock(otp_flight_mutex);
+        return !done || (*statusp == AUTH_GRANTED && conf->max_linger <= 0);
+    }
+
+    /* Become the leader */
+    if ((flight = free_flight) != NULL) {
+        memset(flight, 0, sizeof(*flight));
+        flight->in_use = 1;
+        flight->conf = conf;
+        flight->username = username;
+        flight->password = password;
+        flight->ip = ip;
+        *flightp = flight;
+    }
+    apr_thread_mutex_unlock(otp_flight_mutex);
+    return 1;
+}
+
+/*
+ * Publish the result of a verification, and the stage that decided it, to the requests waiting for it.
+ */
+static void
+otp_flight_end(struct otp_flight *flight, authn_status status, int stage)
+{
+    apr_thread_mutex_lock(otp_flight_mutex);
+    flight->status = status;
+    flight->stage = stage;
+    flight->done = 1;
+    flight->conf = NULL;
+    flight->username = NULL;
+    flight->password = NULL;
+    flight->ip = NULL;
+    if (flight->waiters == 0)
+        flight->in_use = 0;
+    else
+        apr_thread_cond_broadcast(otp_flight_cond);
+    apr_thread_mutex_unlock(otp_flight_mutex);
+}
+
+/*
+ * Check whether two configurations give the same result for the same password from the same client.
+ */
+static int
+otp_config_equivalent(const struct otp_config *conf1, const struct otp_config *conf2)
+{
+    return strcmp(conf1->users_file, conf2->users_file) == 0
+      && conf1->max_offset == conf2->max_offset
+      && conf1->max_linger == conf2->max_linger
+      && conf1->max_otp_failures == conf2->max_otp_failures
+      && conf1->logout_ip_change == conf2->logout_ip_change
+      && conf1->allow_fallthrough == conf2->allow_fallthrough
+      && conf1->resync_window == conf2->resync_window
+      && conf1->max_failure_rate == conf2->max_failure_rate
+      && conf1->pin_cache_time == conf2->pin_cache_time
+      && conf1->provlist == conf2->provlist;
+}
+
+/*
+ * HTTP basic authentication
+ */
+static authn_status
+authn_otp_check_password(request_rec *r, const char *username, const char *password)
+{
+    struct otp_config confbuf;
+    struct otp_config *const conf = get_config(r, &confbuf);
+    const size_t len = strlen(password);
+    struct otp_flight *flight;
+    authn_status status;
+    int stage;
+    int leader_stage;
+    int interval;
+    int lingered;
+
+    /* Is the users file defined? */
+    if (conf->users_file == NULL) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "No OTPAuthUsersFile has been configured");
+        return AUTH_GENERAL_ERROR;
+    }
+
+    /* Without a username, find the user from the OTP if configured (OTPAuthUsernameless) */
+    if (*username == '\0' && conf->usernameless)
+        return authn_otp_check_usernameless(r, conf, password);
+
+    /*
+     * The stages below go from cheapest to most expensive, so a request is decided as early as possible: syntax,
+     * negative cache, lockout state, linger cache, and then (in authn_otp_verify_password()) the users file, the OTP,
+     * and last a PIN auth provider. First, a password too long for any PIN and OTP(s) can't be right for anyone;
+     * nor can one whose last character isn't a hex digit, since every password ends with an OTP (the second one,
+     * if resynchronizing), and OTPs are given in decimal or hex.
+     */
+    stage = OTP_STAGE_SYNTAX;
+    if (len > MAX_PIN + 2 * MAX_OTP || (len > 0 && !apr_isxdigit(password[len - 1]))) {
+        ap_log_rerror(APLOG_MARK, conf->allow_fallthrough ? APLOG_INFO : APLOG_NOTICE, 0, r,
+          "user \"%s\" provided a malformed OTP", username);
+        status = conf->allow_fallthrough ? AUTH_USER_NOT_FOUND : AUTH_DENIED;
+        goto done;
+    }
+
+    /* Deny a recently rejected password; the same lookup finds a recently granted one, which is granted below */
+    stage = OTP_STAGE_NEGATIVE;
+    lingered = len > 0 ? otp_linger_lookup(r, conf, username, password) : 0;
+    if (lingered == -1) {
+        ap_log_rerror(APLOG_MARK, conf->allow_fallthrough ? APLOG_INFO : APLOG_NOTICE, 0, r,
+          "user \"%s\" repeated a recently rejected OTP", username);
+        status = conf->allow_fallthrough ? AUTH_USER_NOT_FOUND : AUTH_DENIED;
+        goto done;
+    }
+
+    /* Deny any password from an IP address that has sent too many wrong ones lately, before hashing anything */
+    stage = OTP_STAGE_THROTTLE;
+    if (otp_throttle_check(r, conf)) {
+        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "denying user \"%s\" because %s exceeded %d wrong passwords per minute",
+          username, USER_AGENT_IP(r), conf->max_failure_rate);
+        status = conf->allow_fallthrough ? AUTH_USER_NOT_FOUND : AUTH_DENIED;
+        goto done;
+    }
+
+    /* Grant reuse of a recently accepted password without reading the users file, unless the user is locked out */
+    if (lingered == 1) {
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "accepting reuse of OTP for \"%s\" within %d sec. linger time",
+          username, conf->max_linger);
+        stage = OTP_STAGE_LINGER;
+        status = AUTH_GRANTED;
+        goto done;
+    }
+
+    /*
+     * If the same credentials are already being verified, wait for that result instead; it counts as ours, unless it
+     * granted an OTP that may not be reused (OTPAuthMaxLinger zero), in which case we verify it, finding it used.
+     */
+    if (!otp_flight_begin(r, conf, username, password, &flight, &status, &leader_stage)) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "using result of concurrent verification for \"%s\"", username);
+        stage = OTP_STAGE_COALESCED;
+        if ((leader_stage == OTP_STAGE_PIN || leader_stage == OTP_STAGE_OTP)
+          && (status == AUTH_DENIED || status == AUTH_USER_NOT_FOUND))
+            otp_throttle_charge(r, conf);
+        if (leader_stage == OTP_STAGE_OTP && status == AUTH_DENIED)
+            otp_failure_add(r, conf, username);
+        goto done;
+    }
+
+    /* Verify, and pass the result on to any requests that waited for it */
+    status = authn_otp_verify_password(r, conf, username, password, 0, &stage, &interval);
+    if (flight != NULL)
+        otp_flight_end(flight, status, stage);
+
+    /*
+     * Count a wrong PIN or OTP against the client's IP address. Remember a wrong OTP, so repeating it costs nothing;
+     * a PIN rejected by a PIN auth provider isn't remembered, since the provider's answer may change at any time.
+     */
+    if ((stage == OTP_STAGE_PIN || stage == OTP_STAGE_OTP) && (status == AUTH_DENIED || status == AUTH_USER_NOT_FOUND)) {
+        if (stage == OTP_STAGE_OTP)
+            otp_linger_reject(r, conf, username, password, interval);
+        otp_throttle_charge(r, conf);
+    }
+
+done:
+    apr_atomic_inc32(&otp_stage_counts[stage]);
+
+    /* Issue a session cookie, if configured, so the following requests skip verification */
+    if (status == AUTH_GRANTED && conf->session_lifetime > 0 && conf->session_key != NULL)
+        otp_session_issue(r, conf, username);
+    return status;
+}
+
+/*
+ * Verify a user's password against the users file. The stage that decided the result is returned in "*stagep".
+ * Checks go from cheapest to most expensive: user state, OTP syntax, a PIN in the users file, the OTP itself,
+ * and last, a PIN that must be checked by another authn provider.
+ *
+ * If "probe" is set, the password may well be for another user, so a wrong password changes nothing: it isn't
+ * counted against the user, and an empty password doesn't log the user out. A right one is granted as usual.
+ *
+ * The shortest time interval of the user's time-based tokens, or zero if none (or the user wasn't found), is
+ * returned in "*intervalp".
+ */
+static authn_status
+authn_otp_verify_password(request_rec *r, struct otp_config *const conf, const char *username, const char *otp_given,
+    int probe, int *stagep, int *intervalp)
+{
+    struct otp_user tokens[OTP_MAX_TOKENS];
+    struct otp_user *user = &tokens[0];
+    authn_status status;
+    char pinbuf[MAX_PIN];
+    struct otp_given given;
+    struct otp_given given2;
+    struct otp_overlap overlap;
+    authn_status pin_status = AUTH_GENERAL_ERROR;
+    const char *otp_given2 = NULL;
+    const char *password;
+    int values[OTP_WINDOW_SIZE];
+    int pin_checked = 0;
+    int num_tokens;
+    int searched = 0;
+    int logout = 0;
+    int reuse = 0;
+    int window_lo;
+    int window_hi;
+    int cached = 0;
+    int counter;
+    int offset;
+    int drift;
+    int found;
+    int i;
+    u_int failures;
+    time_t now;
+#if APR_POOL_DEBUG
+    const apr_size_t pool_bytes = apr_pool_num_bytes(r->pool, 0);
+#endif
+
+    /* Lookup user in the users file */
+    *stagep = OTP_STAGE_USER;
+    *intervalp = 0;
+    memset(user, 0, sizeof(*user));
+    apr_snprintf(user->username, sizeof(user->username), "%s", username);
+    if ((status = find_update_user(r, conf, user, 0)) != AUTH_USER_FOUND)
+        return status;
+
+    /* Check for max failures, including those not yet written to the users file */
+    failures = user->num_otp_failures + otp_failure_pending(conf, user->username);
+    if (conf->max_otp_failures != 0 && failures >= conf->max_otp_failures) {
+        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "user \"%s\" has reached the maximum wrong OTP limit of %u",
+          user->username, conf->max_otp_failures);
+        return conf->allow_fallthrough ? AUTH_USER_NOT_FOUND : AUTH_DENIED;
+    }
+
+    /* Get the user's other tokens, if any */
+    num_tokens = user->num_tokens < OTP_MAX_TOKENS ? user->num_tokens : OTP_MAX_TOKENS;
+    for (i = 1; i < num_tokens; i++) {
+        memset(&tokens[i], 0, sizeof(tokens[i]));
+        apr_snprintf(tokens[i].username, sizeof(tokens[i].username), "%s", username);
+        tokens[i].token = i;
+        if ((status = find_update_user(r, conf, &tokens[i], 0)) != AUTH_USER_FOUND)
+            return status;
+    }
+    for (i = 0; i < num_tokens; i++) {
+        if (tokens[i].time_interval != 0 && (*intervalp == 0 || tokens[i].time_interval < *intervalp))
+            *intervalp = tokens[i].time_interval;
+    }
+
+    /* Check for a "logout" via empty password, which forgets the previous OTP of every token last used from here */
+    if (*otp_given == '\0' && !probe) {
+        for (i = 0; i < num_tokens; i++) {
+            if (*tokens[i].last_otp != '\0' && *tokens[i].last_ip != '\0' && strcmp(tokens[i].last_ip, USER_AGENT_IP(r)) == 0) {
+                *tokens[i].last_otp = '\0';
+                find_update_user(r, conf, &tokens[i], 1);
+                logout = 1;
+            }
+        }
+        if (logout) {
+            ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "logout for user \"%s\" via empty password", user->username);
+            otp_linger_forget(user->username);
+            otp_session_clear(r, conf);
+            return conf->allow_fallthrough ? AUTH_USER_NOT_FOUND : AUTH_DENIED;
+        }
+    }
+
+    /* With several tokens, find the one the password is for; its OTP may already have been searched for */
+    now = time(NULL);
+    if (num_tokens > 1) {
+        if ((i = otp_token_select(r, conf, tokens, num_tokens, otp_given, now, &searched, &offset, &pin_checked)) == -1)
+            return AUTH_GENERAL_ERROR;
+        if (pin_checked)
+            pin_status = AUTH_GRANTED;
+        user = &tokens[i];
+    }
+
+    /* Check for a resynchronization request, i.e., two consecutive OTPs separated by a space */
+    *stagep = OTP_STAGE_SYNTAX;
+    password = otp_given;
+    if (conf->resync_window > 0 && strlen(otp_given) > 2 * user->num_digits
+      && otp_given[strlen(otp_given) - user->num_digits - 1] == ' ') {
+        otp_given2 = otp_given + strlen(otp_given) - user->num_digits;
+        otp_given = apr_pstrndup(r->pool, otp_given, strlen(otp_given) - user->num_digits - 1);
+    }
+
+    /* Split off the PIN prefix (if appropriate) */
+    *pinbuf = '\0';
+    if (user->algorithm != OTP_ALGORITHM_MOTP) {
+        int pinlen;
+
+        /* Determine the length of the PIN that the user supplied */
+        pinlen = strlen(otp_given) - user->num_digits;
+        if (pinlen < 0) {
+            ap_log_rerror(APLOG_MARK, conf->allow_fallthrough ? APLOG_INFO : APLOG_NOTICE, 0, r, "user \"%s\" provided a too-short OTP", user->username);
+            return conf->allow_fallthrough ? AUTH_USER_NOT_FOUND : AUTH_DENIED;
+        }
+
+        /* Extract the PIN from the password given */
+        apr_snprintf(pinbuf, sizeof(pinbuf), "%.*s", pinlen, otp_given);
+        otp_given += pinlen;
+    }
 
     /* Check OTP length */
     if (strlen(otp_given) != user->num_digits) {
@@ -839,9 +3896,18 @@ authn_otp_check_password(request_rec *r, const char *username, const char *otp_g
         return conf->allow_fallthrough ? AUTH_USER_NOT_FOUND : AUTH_DENIED;
     }
 
+    /* Check a PIN from the users file now, since that's cheap; a PIN checked by another provider is checked last */
+    *stagep = OTP_STAGE_PIN;
+    if (user->algorithm != OTP_ALGORITHM_MOTP && user->pincfg != PIN_CONFIG_EXTERNAL
+      && (status = authn_otp_check_pin(r, conf, user, pinbuf)) != AUTH_GRANTED) {
+        if (status == AUTH_DENIED && conf->allow_fallthrough)
+            status = AUTH_USER_NOT_FOUND;
+        return status;
+    }
+
     /* Check for reuse of previous OTP */
-    now = time(NULL);
-    if (strcmp(otp_given, user->last_otp) == 0) {
+    *stagep = OTP_STAGE_OTP;
+    if (otp_given2 == NULL && strcmp(otp_given, user->last_otp) == 0) {
 
         /* Did user's IP address change? */
         if (conf->logout_ip_change && *user->last_ip != '\0' && strcmp(user->last_ip, USER_AGENT_IP(r)) != 0) {
@@ -850,92 +3916,751 @@ authn_otp_check_password(request_rec *r, const char *username, const char *otp_g
             goto fail;
         }
 
-        /* Is it within the configured linger time? */
-        if (now >= user->last_auth && now < user->last_auth + conf->max_linger) {
-            ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "accepting reuse of OTP for \"%s\" within %d sec. linger time",
-              user->username, conf->max_linger);
-            return AUTH_GRANTED;
-        }
+        /* Is it within the configured linger time? */
+        if (now >= user->last_auth && now < user->last_auth + conf->max_linger) {
+            ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "accepting reuse of OTP for \"%s\" within %d sec. linger time",
+              user->username, conf->max_linger);
+            reuse = 1;
+            goto check_pin;
+        }
+
+        /* Report failure to the log */
+        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "user \"%s\" provided the previous OTP"
+          " but it has expired (max linger is %d sec.)", user->username, conf->max_linger);
+        goto fail;
+    }
+
+    /* Parse the given OTP; if it's neither valid decimal nor valid hex, it can't match any HOTP value */
+    if (parse_otp(otp_given, user->num_digits, &given) != 0 && user->algorithm == OTP_ALGORITHM_HOTP)
+        goto wrong_otp;
+    if (otp_given2 != NULL && parse_otp(otp_given2, user->num_digits, &given2) != 0 && user->algorithm == OTP_ALGORITHM_HOTP)
+        goto wrong_otp;
+
+    /* Get expected counter value and offset window */
+    counter = otp_expected_counter(conf, user, now, &window_lo, &window_hi);
+
+    /* Get HOTP values from the user's cached window, or else precompute HMAC state or mOTP message for the user's key */
+    if (searched != 0)
+        ;
+    else if (user->algorithm == OTP_ALGORITHM_MOTP)
+        motp_key_init(r, user);
+    else if (otp_given2 != NULL) {
+        if (hotp_key_init(r, user) != 0)
+            return AUTH_GENERAL_ERROR;
+    } else if ((cached = otp_window_values(r, user, counter, window_lo, window_hi, now, values)) == -1
+      || (cached == 0 && hotp_key_init(r, user) != 0))
+        return AUTH_GENERAL_ERROR;
+
+    /* Resynchronize by searching the larger window for both OTPs; the new offset is that of the second OTP */
+    if (otp_given2 != NULL) {
+
+        /* Resynchronizing moves the counter, so first make sure the PIN is right, even if another provider checks it */
+        if (searched == 0 && user->algorithm != OTP_ALGORITHM_MOTP && user->pincfg == PIN_CONFIG_EXTERNAL) {
+            *stagep = OTP_STAGE_PIN;
+            if ((pin_status = authn_otp_check_pin(r, conf, user, pinbuf)) != AUTH_GRANTED)
+                return pin_status == AUTH_DENIED && conf->allow_fallthrough ? AUTH_USER_NOT_FOUND : pin_status;
+            pin_checked = 1;
+            *stagep = OTP_STAGE_OTP;
+        }
+        window_lo = user->time_interval == 0 ? 0 : -conf->resync_window;
+        window_hi = conf->resync_window;
+        found = searched != 0 ? searched > 0 : otp_resync(r, user, &given, &given2, counter, window_lo, window_hi, &offset);
+        apr_atomic_inc32(&otp_num_verifies);
+        apr_atomic_add32(&otp_num_hashes, user->num_hashes);
+        if (!found) {
+            ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "user \"%s\" resynchronization OTPs not found within %d counters",
+              user->username, conf->resync_window);
+            goto wrong_otp;
+        }
+        offset++;
+        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "resynchronized user \"%s\" at counter %d (offset adjust %d)",
+          user->username, counter + offset, offset);
+        otp_given = otp_given2;
+        goto check_pin;
+    }
+
+    /* Try the OTP counter values within the maximum allowed offset, nearest first around the user's observed drift */
+    drift = otp_drift(user);
+    if (searched != 0)
+        found = searched > 0;
+    else if (cached)
+        found = otp_search_values(user, &given, values, window_lo, window_hi, drift, &offset);
+    else if (conf->parallel_pin && user->pincfg == PIN_CONFIG_EXTERNAL) {
+
+        /* Search on the thread pool while checking the PIN here, so it takes as long as the slower of the two */
+        memset(&overlap, 0, sizeof(overlap));
+        overlap.user = user;
+        overlap.given = &given;
+        overlap.counter = counter;
+        overlap.lo = window_lo;
+        overlap.hi = window_hi;
+        overlap.drift = drift;
+        if (otp_overlap_start(r, &overlap) == 0) {
+            pin_status = authn_otp_check_pin(r, conf, user, pinbuf);
+            pin_checked = 1;
+            found = otp_overlap_finish(&overlap, &offset);
+        } else
+            found = otp_search(user, &given, counter, window_lo, window_hi, drift, &offset);
+    } else
+        found = otp_search(user, &given, counter, window_lo, window_hi, drift, &offset);
+    apr_atomic_inc32(&otp_num_verifies);
+    apr_atomic_add32(&otp_num_hashes, user->num_hashes);
+    if (found) {
+        if (offset == 0)
+            ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "accepting OTP for \"%s\" at counter %d", user->username, counter);
+        else {
+            ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "accepting OTP for \"%s\" at counter %d (offset adjust %d)",
+              user->username, counter + offset, offset);
+        }
+        if (user->time_interval != 0) {
+            apr_atomic_inc32(&otp_drift_accepts);
+            if (offset == otp_search_center(window_lo, window_hi, drift))
+                apr_atomic_inc32(&otp_drift_predicted);
+        }
+        otp_drift_update(user, offset);
+        goto check_pin;
+    }
+
+wrong_otp:
+    /* Report failure to the log */
+    if (conf->max_otp_failures != 0) {
+        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "user \"%s\" provided the wrong OTP (%d/%d consecutive)",
+          user->username, failures + 1, conf->max_otp_failures);
+    } else {
+        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "user \"%s\" provided the wrong OTP (%d consecutive)",
+          user->username, failures + 1);
+    }
+    goto fail;
+
+check_pin:
+    /* The OTP is right; now check a PIN that must be verified by another provider, unless that was done meanwhile */
+    if (user->algorithm != OTP_ALGORITHM_MOTP && user->pincfg == PIN_CONFIG_EXTERNAL) {
+        *stagep = OTP_STAGE_PIN;
+        if ((status = pin_checked ? pin_status : authn_otp_check_pin(r, conf, user, pinbuf)) != AUTH_GRANTED) {
+            if (status == AUTH_DENIED && conf->allow_fallthrough)
+                status = AUTH_USER_NOT_FOUND;
+            return status;
+        }
+    }
+
+    /* Reuse of the previous OTP doesn't change the user's record */
+    if (reuse) {
+        otp_linger_store(r, conf, user->username, password, user->last_auth + conf->max_linger, tokens[0].num_otp_failures);
+        /* A cached user with a locally checked PIN should have been verified without allocating anything */
+        if (user->cached && user->pincfg != PIN_CONFIG_EXTERNAL) {
+            apr_atomic_inc32(&otp_reuse_verifies);
+#if APR_POOL_DEBUG
+            apr_atomic_add32(&otp_reuse_bytes, (apr_uint32_t)(apr_pool_num_bytes(r->pool, 0) - pool_bytes));
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "verified reuse of OTP for \"%s\" with %lu bytes allocated",
+              user->username, (u_long)(apr_pool_num_bytes(r->pool, 0) - pool_bytes));
+            AP_DEBUG_ASSERT(apr_pool_num_bytes(r->pool, 0) == pool_bytes);
+#endif
+        }
+        return AUTH_GRANTED;
+    }
+
+    /* Update user's last auth information and next expected offset */
+    user->offset = user->time_interval == 0 ? counter + offset + 1 : user->offset + offset;
+    user->num_otp_failures = 0;
+    apr_snprintf(user->last_otp, sizeof(user->last_otp), "%s", otp_given);
+    user->last_auth = now;
+    apr_snprintf(user->last_ip, sizeof(user->last_ip), "%s", USER_AGENT_IP(r));
+
+    /* Update user's record; failures are counted on the first token, so reset them there too */
+    find_update_user(r, conf, user, 1);
+    if (user != &tokens[0] && tokens[0].num_otp_failures != 0) {
+        tokens[0].num_otp_failures = 0;
+        find_update_user(r, conf, &tokens[0], 1);
+    }
+    otp_failure_clear(conf, user->username);
+
+    /* Remember the password for reuse within the linger time; a resynchronization password is not reused */
+    if (otp_given2 == NULL)
+        otp_linger_store(r, conf, user->username, password, now + conf->max_linger, 0);
+
+    /* Done */
+    return AUTH_GRANTED;
+
+fail:
+    if (probe)
+        return AUTH_DENIED;
+
+    /* Forget any password granted for reuse, so it's subject to the failure count and IP checks again */
+    otp_linger_forget(user->username);
+
+    /* Update user's failure count, in shared memory if possible so a brute-force attack doesn't rewrite the users file */
+    user = &tokens[0];
+    if (user->num_otp_failures < UINT_MAX && !otp_failure_defer(conf, user))
+        find_update_user(r, conf, user, 1);
+    return AUTH_DENIED;
+}
+
+/*
+ * Get a user's expected counter value at time "now", and the offsets "*lop" through "*hip" relative to it
+ * within which the OTP is searched for.
+ */
+static int
+otp_expected_counter(const struct otp_config *conf, const struct otp_user *user, time_t now, int *lop, int *hip)
+{
+    int window_start;
+    int window_stop;
+    int counter;
+
+    if (user->time_interval == 0) {
+        counter = user->offset;
+        window_start = 1;
+        window_stop = conf->max_offset;
+    } else {
+        counter = (int)now / user->time_interval + user->offset;
+        window_start = -conf->max_offset;
+        window_stop = conf->max_offset;
+
+        /* Expand upper bound of window to ensure an absolute offset of zero is included in the search (issue #14) */
+        if (window_stop < -user->offset)
+            window_stop = -user->offset;
+    }
+    *lop = window_start < 0 ? window_start : 0;
+    *hip = window_stop > 0 ? window_stop : 0;
+    return counter;
+}
+
+/*
+ * Find which of a user's tokens a password is for. The missing HOTP values of all of the tokens' windows are
+ * computed together, in multi-buffer batches that mix the tokens' keys, so checking several tokens costs about
+ * as much as checking one. Tokens whose PIN or OTP length can't match are skipped; a token for which the password
+ * repeats the previous OTP is chosen without searching, leaving the linger check to the caller.
+ *
+ * Returns the index of the token, or -1 on error. If its OTP was searched for, *searchedp is set to 1 and *offsetp
+ * to the offset found (of the first OTP, if resynchronizing), or if no token matched, the first token is returned
+ * and *searchedp is set to -1 if that token was searched. Otherwise *searchedp is left zero. A token is only
+ * resynchronized once its PIN is known to be right; if that took a PIN auth provider call, *pin_checkedp is set to 1.
+ */
+static int
+otp_token_select(request_rec *r, struct otp_config *conf, struct otp_user *tokens, int num_tokens,
+    const char *password, time_t now, int *searchedp, int *offsetp, int *pin_checkedp)
+{
+    struct otp_window windows[OTP_MAX_TOKENS];
+    struct otp_given givens[OTP_MAX_TOKENS];
+    struct otp_given given2;
+    struct otp_hash_queue queue;
+    char otps[OTP_MAX_TOKENS][OTP_BUF_SIZE];
+    char otp2[OTP_BUF_SIZE];
+    int methods[OTP_MAX_TOKENS];
+    int counters[OTP_MAX_TOKENS];
+    int los[OTP_MAX_TOKENS];
+    int his[OTP_MAX_TOKENS];
+    int values[OTP_WINDOW_SIZE];
+    const int len = strlen(password);
+    struct otp_user *token;
+    int choice = -1;
+    int offset = 0;
+    int otplen;
+    int pinlen;
+    int i;
+
+    /* Split the password for each token and queue the values missing from its window */
+    queue.count = 0;
+    for (i = 0; i < num_tokens; i++) {
+        token = &tokens[i];
+        methods[i] = OTP_SELECT_SKIP;
+
+        /* Split off a resynchronization OTP and the PIN prefix as the main path would for this token */
+        otplen = len;
+        if (conf->resync_window > 0 && len > 2 * token->num_digits && password[len - token->num_digits - 1] == ' ')
+            otplen = len - token->num_digits - 1;
+        pinlen = otplen - token->num_digits;
+        if (pinlen < 0 || (token->algorithm == OTP_ALGORITHM_MOTP && pinlen != 0))
+            continue;
+        if (token->pincfg == PIN_CONFIG_NONE && pinlen != 0)
+            continue;
+        if (token->pincfg == PIN_CONFIG_LITERAL && (strncmp(password, token->pin, pinlen) != 0 || token->pin[pinlen] != '\0'))
+            continue;
+        apr_snprintf(otps[i], sizeof(otps[i]), "%.*s", token->num_digits, password + pinlen);
+
+        /* The previous OTP is checked by the caller */
+        if (otplen == len && strcmp(otps[i], token->last_otp) == 0) {
+            choice = i;
+            goto done;
+        }
+
+        /* Parse the OTP; if it's neither valid decimal nor valid hex, it can't match any HOTP value */
+        if (parse_otp(otps[i], token->num_digits, &givens[i]) != 0 && token->algorithm == OTP_ALGORITHM_HOTP)
+            continue;
+        counters[i] = otp_expected_counter(conf, token, now, &los[i], &his[i]);
+        if (otplen != len) {
+            methods[i] = OTP_SELECT_RESYNC;
+            continue;
+        }
+        methods[i] = OTP_SELECT_SEARCH;
+        if (token->algorithm == OTP_ALGORITHM_HOTP) {
+            switch (otp_window_begin(r, token, counters[i], los[i], his[i], &windows[i], &queue)) {
+            case -1:
+                return -1;
+            case 1:
+                methods[i] = OTP_SELECT_WINDOW;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    /* Compute all of the queued values at once, then search and store each token's window */
+    otp_hash_flush(&queue);
+    for (i = 0; i < num_tokens; i++) {
+        if (methods[i] != OTP_SELECT_WINDOW)
+            continue;
+        token = &tokens[i];
+        otp_window_end(token, counters[i], los[i], his[i], now, &windows[i], values);
+        if (choice == -1 && otp_search_values(token, &givens[i], values, los[i], his[i], otp_drift(token), &offset))
+            choice = i;
+    }
+
+    /* Search uncacheable windows, then try resynchronizing */
+    for (i = 0; i < num_tokens && choice == -1; i++) {
+        token = &tokens[i];
+        if (methods[i] != OTP_SELECT_SEARCH && methods[i] != OTP_SELECT_RESYNC)
+            continue;
+        if (token->algorithm == OTP_ALGORITHM_MOTP)
+            motp_key_init(r, token);
+        else if (token->hkey == NULL && hotp_key_init(r, token) != 0)
+            return -1;
+        if (methods[i] == OTP_SELECT_SEARCH) {
+            if (otp_search(token, &givens[i], counters[i], los[i], his[i], otp_drift(token), &offset))
+                choice = i;
+            continue;
+        }
+        apr_snprintf(otp2, sizeof(otp2), "%s", password + len - token->num_digits);
+        if (parse_otp(otp2, token->num_digits, &given2) != 0 && token->algorithm == OTP_ALGORITHM_HOTP)
+            continue;
+        if (token->pincfg == PIN_CONFIG_EXTERNAL && authn_otp_check_pin(r, conf, token,
+          apr_pstrndup(r->pool, password, len - 2 * token->num_digits - 1)) != AUTH_GRANTED)
+            continue;
+        if (otp_resync(r, token, &givens[i], &given2, counters[i], token->time_interval == 0 ? 0 : -conf->resync_window,
+          conf->resync_window, &offset)) {
+            *pin_checkedp = token->pincfg == PIN_CONFIG_EXTERNAL;
+            choice = i;
+        }
+    }
+
+    /* Report the result for the chosen token, or else the first */
+    if (choice != -1) {
+        *searchedp = 1;
+        *offsetp = offset;
+    } else {
+        choice = 0;
+        if (methods[0] != OTP_SELECT_SKIP)
+            *searchedp = -1;
+    }
+
+done:
+    /* The values computed for every token count, whichever token is chosen */
+    for (i = 0; i < num_tokens; i++) {
+        apr_atomic_add32(&otp_num_hashes, tokens[i].num_hashes);
+        tokens[i].num_hashes = 0;
+    }
+    return choice;
+}
+
+/*
+ * Password given without a username (OTPAuthUsernameless): find the users whose time-based tokens currently show
+ * its OTP in the reverse index, and verify the password for each of them until one is granted. That user becomes
+ * the request's user. Since the password isn't claimed to be any candidate's, a wrong one isn't counted against
+ * the candidates or remembered as rejected for them. Instead it is charged once to the client's IP address, which
+ * is always throttled (see get_config()), and to the allowance of all clients together, so guesses spread across
+ * the users can't go on without limit.
+ */
+static authn_status
+authn_otp_check_usernameless(request_rec *r, struct otp_config *const conf, const char *password)
+{
+    char *candidates[OTP_INDEX_MAX_CANDIDATES];
+    authn_status status;
+    int stage = OTP_STAGE_THROTTLE;
+    int interval;
+    int num;
+    int i;
+
+    /* Deny any password from an IP address that has sent too many wrong ones lately, before looking it up */
+    if (otp_throttle_check(r, conf)) {
+        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "denying OTP without username because %s exceeded %d wrong"
+          " passwords per minute", USER_AGENT_IP(r), conf->max_failure_rate);
+        status = conf->allow_fallthrough ? AUTH_USER_NOT_FOUND : AUTH_DENIED;
+        goto done;
+    }
+    if (otp_usernameless_check()) {
+        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "denying OTP without username because wrong ones from all clients"
+          " are limited to %d per minute", OTP_USERNAMELESS_FAILURE_RATE);
+        status = conf->allow_fallthrough ? AUTH_USER_NOT_FOUND : AUTH_DENIED;
+        goto done;
+    }
+
+    /* Find the candidates */
+    if ((num = otp_index_lookup(r, conf, password, candidates)) == -1)
+        return AUTH_GENERAL_ERROR;
+
+    /* Verify the password for each of them */
+    for (i = 0; i < num; i++) {
+        switch ((status = authn_otp_verify_password(r, conf, candidates[i], password, 1, &stage, &interval))) {
+        case AUTH_GRANTED:
+            ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "OTP given without username is for user \"%s\"", candidates[i]);
+            r->user = candidates[i];
+            if (conf->session_lifetime > 0 && conf->session_key != NULL)
+                otp_session_issue(r, conf, candidates[i]);
+            goto done;
+        case AUTH_GENERAL_ERROR:
+            return status;
+        default:
+            break;
+        }
+    }
+
+    /* No candidate accepted it */
+    ap_log_rerror(APLOG_MARK, conf->allow_fallthrough ? APLOG_INFO : APLOG_NOTICE, 0, r,
+      "no time-based token currently accepts the PIN and OTP given without username (%d candidates)", num);
+    stage = OTP_STAGE_OTP;
+    status = conf->allow_fallthrough ? AUTH_USER_NOT_FOUND : AUTH_DENIED;
+    otp_throttle_charge(r, conf);
+    otp_usernameless_charge();
+
+done:
+    apr_atomic_inc32(&otp_stage_counts[stage]);
+    return status;
+}
+
+/*
+ * Find the users whose time-based tokens currently show the OTP at the end of "password" and accept the PIN before
+ * it, bringing the reverse index up to date with the users file and the current time step first. Tokens with an
+ * external PIN are candidates for any PIN. Up to OTP_INDEX_MAX_CANDIDATES usernames are copied into the request pool.
+ *
+ * Returns the number of candidates, or -1 on error.
+ */
+static int
+otp_index_lookup(request_rec *r, const struct otp_config *conf, const char *password, char **candidates)
+{
+    struct otp_index *const index = &otp_index;
+    const int max10 = sizeof(powers10) / sizeof(*powers10);
+    const int len = strlen(password);
+    const struct otp_index_token *token;
+    const struct otp_index_node *node;
+    struct otp_index_group *group;
+    apr_uint32_t pin_hash;
+    apr_ssize_t pinlen;
+    apr_finfo_t finfo;
+    apr_status_t status;
+    char errbuf[64];
+    time_t now;
+    long value;
+    int digits;
+    int num = 0;
+    int n;
+    int i;
+
+    if (otp_index_mutex == NULL || sha1_impl == NULL) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "OTP reverse index for OTPAuthUsernameless is not available");
+        return -1;
+    }
+    now = time(NULL);
+    apr_thread_mutex_lock(otp_index_mutex);
+
+    /* Reload the index if it's for another users file or window, or the users file has changed since it was loaded */
+    if (*index->users_file == '\0' || strcmp(index->users_file, conf->users_file) != 0
+      || index->max_offset != conf->max_offset || now >= index->checked + OTP_INDEX_RELOAD_TIME) {
+        if ((status = apr_stat(&finfo, conf->users_file, APR_FINFO_IDENT|APR_FINFO_MTIME|APR_FINFO_SIZE, r->pool)) != 0) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "can't stat OTP users file \"%s\": %s",
+              conf->users_file, apr_strerror(status, errbuf, sizeof(errbuf)));
+            goto fail;
+        }
+        if (*index->users_file != '\0' && strcmp(index->users_file, conf->users_file) == 0
+          && index->max_offset == conf->max_offset && index->device == finfo.device && index->inode == finfo.inode
+          && index->mtime == finfo.mtime && index->size == finfo.size)
+            index->checked = now;
+        else if (otp_index_load(r, conf, &finfo, now) != 0)
+            goto fail;
+    }
+
+    /* Move each group of tokens to the current time step */
+    for (i = 0; i < index->num_groups; i++) {
+        group = &index->groups[i];
+        if (group->step != (long)now / group->time_interval)
+            otp_index_advance(index, group, (long)now / group->time_interval);
+    }
+
+    /* Look up the OTP as each number of digits in use */
+    for (digits = 1; digits <= max10 && num < OTP_INDEX_MAX_CANDIDATES; digits++) {
+        if ((index->digit_mask & (1 << digits)) == 0 || digits > len)
+            continue;
+        for (value = 0, i = len - digits; i < len && apr_isdigit(password[i]); i++)
+            value = value * 10 + (password[i] - '0');
+        if (i < len || value > INT_MAX)
+            continue;
+        pinlen = len - digits;
+        pin_hash = apr_hashfunc_default(password, &pinlen);
+        for (n = index->buckets[otp_index_bucket(index, (int)value, digits)]; n != -1 && num < OTP_INDEX_MAX_CANDIDATES;
+          n = node->next) {
+            node = &index->nodes[n];
+            token = &index->tokens[node->token];
+            if (node->value != value || token->num_digits != digits)
+                continue;
+            if (token->pincfg == PIN_CONFIG_LITERAL && (token->pin_len != len - digits || token->pin_hash != pin_hash))
+                continue;
+            for (i = 0; i < num && strcmp(candidates[i], token->username) != 0; i++)
+                ;
+            if (i == num)
+                candidates[num++] = apr_pstrdup(r->pool, token->username);
+        }
+    }
+    apr_thread_mutex_unlock(otp_index_mutex);
+    return num;
+
+fail:
+    apr_thread_mutex_unlock(otp_index_mutex);
+    return -1;
+}
+
+/*
+ * Load the time-based HOTP tokens with a PIN in the users file into the reverse index. Their OTPs are indexed on the next
+ * otp_index_advance(). Each token gets one node for each counter in its window, and there are at least as many
+ * hash buckets as nodes.
+ */
+static int
+otp_index_load(request_rec *r, const struct otp_config *conf, const apr_finfo_t *finfo, time_t now)
+{
+    struct otp_index *const index = &otp_index;
+    apr_pool_t *const pool = index->pool;
+    const struct otp_index_token *entries;
+    struct otp_index_token *token;
+    struct otp_index_group *group;
+    apr_array_header_t *array;
+    struct otp_user entry;
+    apr_file_t *file;
+    apr_status_t status;
+    char linebuf[1024];
+    char reason[128];
+    char errbuf[64];
+    apr_ssize_t pinlen;
+    int num_nodes;
+    int lo;
+    int hi;
+    int g;
+    int i;
+
+    /* Start over */
+    apr_pool_clear(pool);
+    memset(index, 0, sizeof(*index));
+    index->pool = pool;
 
-        /* Report failure to the log */
-        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "user \"%s\" provided the previous OTP"
-          " but it has expired (max linger is %d sec.)", user->username, conf->max_linger);
-        goto fail;
+    /* Read the users file */
+    if ((status = apr_file_open(&file, conf->users_file, APR_READ, 0, r->pool)) != 0) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "can't open OTP users file \"%s\": %s",
+          conf->users_file, apr_strerror(status, errbuf, sizeof(errbuf)));
+        return -1;
     }
+    array = apr_array_make(r->pool, 256, sizeof(struct otp_index_token));
+    while (apr_file_gets(linebuf, sizeof(linebuf), file) == 0) {
 
-    /* Get expected counter value and offset window */
-    if (user->time_interval == 0) {
-        counter = user->offset;
-        window_start = 1;
-        window_stop = conf->max_offset;
-    } else {
-        counter = (int)now / user->time_interval + user->offset;
-        window_start = -conf->max_offset;
-        window_stop = conf->max_offset;
+        /*
+         * Only time-based HOTP tokens show an OTP that depends on nothing but the time. Tokens without a PIN are left
+         * out: with no username either, their OTP alone would be the whole credential.
+         */
+        memset(&entry, 0, sizeof(entry));
+        if (parse_user_line(linebuf, NULL, &entry, reason, sizeof(reason)) != 0
+          || entry.algorithm != OTP_ALGORITHM_HOTP || entry.time_interval <= 0 || entry.pincfg == PIN_CONFIG_NONE)
+            continue;
+        otp_expected_counter(conf, &entry, now, &lo, &hi);
+        if (hi - lo + 1 > OTP_WINDOW_SIZE)
+            continue;
 
-        /* Expand upper bound of window to ensure an absolute offset of zero is included in the search (issue #14) */
-        if (window_stop < -user->offset)
-            window_stop = -user->offset;
+        /* Find the token's group */
+        for (g = 0; g < index->num_groups && index->groups[g].time_interval != entry.time_interval; g++)
+            ;
+        if (g == index->num_groups) {
+            if (g == OTP_INDEX_MAX_GROUPS) {
+                ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "not indexing token of user \"%s\": more than %d"
+                  " different time intervals", entry.username, OTP_INDEX_MAX_GROUPS);
+                continue;
+            }
+            index->groups[g].time_interval = entry.time_interval;
+            index->groups[g].step = -1;
+            index->num_groups++;
+        }
+        index->groups[g].count++;
+
+        /* Add it */
+        token = apr_array_push(array);
+        token->username = apr_pstrdup(pool, entry.username);
+        hmac_sha1_key_init(&token->state, entry.key, entry.keylen);
+        token->num_digits = entry.num_digits;
+        token->offset = entry.offset;
+        token->pincfg = entry.pincfg;
+        pinlen = strlen(entry.pin);
+        token->pin_len = (int)pinlen;
+        token->pin_hash = apr_hashfunc_default(entry.pin, &pinlen);
+        token->lo = lo;
+        token->width = hi - lo + 1;
+        token->first = OTP_INDEX_EMPTY;
+        token->nodes = g;                               /* until the tokens are arranged by group */
+        index->digit_mask |= 1 << entry.num_digits;
     }
+    apr_file_close(file);
+    memset(&entry, 0, sizeof(entry));
 
-    /* Test OTP using expected counter first */
-    *otpbuf10 = '\0';
-    if (user->algorithm == OTP_ALGORITHM_MOTP)
-        motp(user->key, user->keylen, user->pin, counter, user->num_digits, otpbuf16, OTP_BUF_SIZE);
-    else
-        hotp(user->key, user->keylen, counter, user->num_digits, otpbuf10, otpbuf16, OTP_BUF_SIZE);
-    if (strcmp(otp_given, otpbuf10) == 0 || strcasecmp(otp_given, otpbuf16) == 0) {
-        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "accepting OTP for \"%s\" at counter %d", user->username, counter);
-        offset = 0;
-        goto success;
+    /* Arrange the tokens by group, and give each one its nodes */
+    for (i = g = 0; g < index->num_groups; g++) {
+        index->groups[g].first = i;
+        i += index->groups[g].count;
+        index->groups[g].count = 0;
+    }
+    index->num_tokens = array->nelts;
+    index->tokens = apr_pcalloc(pool, (index->num_tokens + 1) * sizeof(*index->tokens));
+    entries = (const struct otp_index_token *)array->elts;
+    for (i = 0; i < index->num_tokens; i++) {
+        group = &index->groups[entries[i].nodes];
+        index->tokens[group->first + group->count++] = entries[i];
     }
+    for (num_nodes = i = 0; i < index->num_tokens; i++) {
+        index->tokens[i].nodes = num_nodes;
+        num_nodes += index->tokens[i].width;
+    }
+    index->nodes = apr_pcalloc(pool, (num_nodes + 1) * sizeof(*index->nodes));
+
+    /* Create empty hash buckets */
+    for (index->bucket_mask = 1; index->bucket_mask < (u_int)num_nodes; index->bucket_mask <<= 1)
+        ;
+    index->buckets = apr_palloc(pool, index->bucket_mask * sizeof(*index->buckets));
+    memset(index->buckets, 0xff, index->bucket_mask * sizeof(*index->buckets));
+    index->bucket_mask--;
+
+    /* Remember which users file state this is */
+    apr_snprintf(index->users_file, sizeof(index->users_file), "%s", conf->users_file);
+    index->max_offset = conf->max_offset;
+    index->device = finfo->device;
+    index->inode = finfo->inode;
+    index->mtime = finfo->mtime;
+    index->size = finfo->size;
+    index->checked = now;
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "indexed %d time-based OTP tokens (%d OTPs) from \"%s\"",
+      index->num_tokens, num_nodes, conf->users_file);
+    return 0;
+}
 
-    /* Try other OTP counter values within the maximum allowed offset */
-    for (offset = window_start; offset <= window_stop; offset++) {
-        if (offset == 0)    /* already tried it */
+/*
+ * Move a group of tokens to time step "step". A token moving by less than its window width keeps the OTPs of the
+ * counters still in its window; the nodes of the counters that left are reused for the counters that entered.
+ * The new values are computed in multi-buffer batches that mix the tokens' keys.
+ */
+static void
+otp_index_advance(struct otp_index *index, struct otp_index_group *group, long step)
+{
+    const struct hmac_sha1_key *keys[HMAC_SHA1_MAX_BATCH];
+    uint64_t counters[HMAC_SHA1_MAX_BATCH];
+    int nodes[HMAC_SHA1_MAX_BATCH];
+    struct otp_index_token *token;
+    long first;
+    long lo;
+    long hi;
+    long c;
+    int count = 0;
+    int n;
+    int t;
+
+    for (t = group->first; t < group->first + group->count; t++) {
+        token = &index->tokens[t];
+        first = step + token->offset + token->lo;
+        if (first == token->first)
             continue;
-        if (user->algorithm == OTP_ALGORITHM_MOTP)
-            motp(user->key, user->keylen, user->pin, counter + offset, user->num_digits, otpbuf16, OTP_BUF_SIZE);
-        else
-            hotp(user->key, user->keylen, counter + offset, user->num_digits, otpbuf10, otpbuf16, OTP_BUF_SIZE);
-        if (strcmp(otp_given, otpbuf10) == 0 || strcasecmp(otp_given, otpbuf16) == 0) {
-            ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "accepting OTP for \"%s\" at counter %d (offset adjust %d)",
-              user->username, counter + offset, offset);
-            goto success;
+
+        /* Find the counters entering the window */
+        lo = first;
+        hi = first + token->width - 1;
+        if (token->first != OTP_INDEX_EMPTY && first > token->first && first < token->first + token->width)
+            lo = token->first + token->width;
+        else if (token->first != OTP_INDEX_EMPTY && first < token->first && hi >= token->first)
+            hi = token->first - 1;
+
+        /* Queue them, unindexing the counters whose nodes they take over */
+        for (c = lo; c <= hi; c++) {
+            n = token->nodes + (int)(((c % token->width) + token->width) % token->width);
+            if (token->first != OTP_INDEX_EMPTY)
+                otp_index_unlink(index, n);
+            index->nodes[n].token = t;
+            keys[count] = &token->state;
+            counters[count] = (uint64_t)c;
+            nodes[count++] = n;
+            if (count == HMAC_SHA1_MAX_BATCH) {
+                otp_index_compute(index, keys, counters, nodes, count);
+                count = 0;
+            }
         }
+        token->first = first;
     }
+    if (count > 0)
+        otp_index_compute(index, keys, counters, nodes, count);
+    group->step = step;
+}
 
-    /* Report failure to the log */
-    if (conf->max_otp_failures != 0) {
-        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "user \"%s\" provided the wrong OTP (%d/%d consecutive)",
-          user->username, user->num_otp_failures + 1, conf->max_otp_failures);
-    } else {
-        ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "user \"%s\" provided the wrong OTP (%d consecutive)",
-          user->username, user->num_otp_failures + 1);
+/*
+ * Compute the OTPs of a batch of nodes, as decimal values, and index them.
+ */
+static void
+otp_index_compute(struct otp_index *index, const struct hmac_sha1_key *const *keys, const uint64_t *counters,
+    const int *nodes, int count)
+{
+    const int max10 = sizeof(powers10) / sizeof(*powers10);
+    u_char hashes[HMAC_SHA1_MAX_BATCH][SHA1_DIGEST_LEN];
+    struct otp_index_node *node;
+    int digits;
+    int i;
+
+    hmac_sha1_multi_batch(keys, counters, count, hashes);
+    for (i = 0; i < count; i++) {
+        node = &index->nodes[nodes[i]];
+        digits = index->tokens[node->token].num_digits;
+        node->value = hotp_truncate(hashes[i]);
+        if (digits < max10)
+            node->value %= powers10[digits - 1];
+        otp_index_link(index, nodes[i]);
     }
-    goto fail;
+}
 
-success:
-    /* Update user's last auth information and next expected offset */
-    user->offset = user->time_interval == 0 ? counter + offset + 1 : user->offset + offset;
-    user->num_otp_failures = 0;
-    apr_snprintf(user->last_otp, sizeof(user->last_otp), "%s", otp_given);
-    user->last_auth = now;
-    apr_snprintf(user->last_ip, sizeof(user->last_ip), "%s", USER_AGENT_IP(r));
+/*
+ * Get the hash bucket for an OTP value with "digits" digits.
+ */
+static u_int
+otp_index_bucket(const struct otp_index *index, int value, int digits)
+{
+    u_int hash;
 
-    /* Update user's record */
-    find_update_user(r, conf->users_file, user, 1);
+    hash = ((u_int)value ^ ((u_int)digits << 27)) * 2654435761U;
+    return (hash ^ (hash >> 15)) & index->bucket_mask;
+}
 
-    /* Done */
-    return AUTH_GRANTED;
+/*
+ * Add a node to, or remove it from, the chain of its value's hash bucket.
+ */
+static void
+otp_index_link(struct otp_index *index, int n)
+{
+    struct otp_index_node *const node = &index->nodes[n];
+    int *const bucket = &index->buckets[otp_index_bucket(index, node->value, index->tokens[node->token].num_digits)];
+
+    node->prev = -1;
+    node->next = *bucket;
+    if (*bucket != -1)
+        index->nodes[*bucket].prev = n;
+    *bucket = n;
+}
 
-fail:
-    /* Update user's failure count */
-    if (user->num_otp_failures < UINT_MAX) {
-        user->num_otp_failures++;
-        find_update_user(r, conf->users_file, user, 1);
-    }
-    return AUTH_DENIED;
+static void
+otp_index_unlink(struct otp_index *index, int n)
+{
+    struct otp_index_node *const node = &index->nodes[n];
+
+    if (node->prev != -1)
+        index->nodes[node->prev].next = node->next;
+    else
+        index->buckets[otp_index_bucket(index, node->value, index->tokens[node->token].num_digits)] = node->next;
+    if (node->next != -1)
+        index->nodes[node->next].prev = node->prev;
 }
 
 /*
@@ -946,13 +4671,17 @@ fail:
 static authn_status
 authn_otp_get_realm_hash(request_rec *r, const char *username, const char *realm, char **rethash)
 {
-    struct otp_config *const conf = get_config(r);
+    struct otp_config confbuf;
+    struct otp_config *const conf = get_config(r, &confbuf);
     struct otp_user userbuf;
     struct otp_user *const user = &userbuf;
+    struct otp_digest_commit *commit;
     authn_status status;
     char hashbuf[256];
     char otpbuf[32];
+    char ha1[33];
     int counter = 0;
+    int counter_valid;
     int linger;
     time_t now;
 
@@ -965,11 +4694,12 @@ authn_otp_get_realm_hash(request_rec *r, const char *username, const char *realm
     /* Lookup the user in the users file */
     memset(user, 0, sizeof(*user));
     apr_snprintf(user->username, sizeof(user->username), "%s", username);
-    if ((status = find_update_user(r, conf->users_file, user, 0)) != AUTH_USER_FOUND)
+    if ((status = find_update_user(r, conf, user, 0)) != AUTH_USER_FOUND)
         return status;
 
-    /* Check for max failures */
-    if (conf->max_otp_failures != 0 && user->num_otp_failures >= conf->max_otp_failures) {
+    /* Check for max failures, including those not yet written to the users file */
+    if (conf->max_otp_failures != 0
+      && user->num_otp_failures + otp_failure_pending(conf, user->username) >= conf->max_otp_failures) {
         ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "user \"%s\" has reached the maximum wrong OTP limit of %u",
           user->username, conf->max_otp_failures);
         return conf->allow_fallthrough ? AUTH_USER_NOT_FOUND : AUTH_DENIED;
@@ -996,6 +4726,7 @@ authn_otp_get_realm_hash(request_rec *r, const char *username, const char *realm
           user->username, conf->max_linger);
         apr_snprintf(otpbuf, sizeof(otpbuf), "%s", user->last_otp);
         linger = 1;
+        counter_valid = 0;
     } else {
 
         /* Log note if previous OTP has expired */
@@ -1006,34 +4737,54 @@ authn_otp_get_realm_hash(request_rec *r, const char *username, const char *realm
 
         /* Get expected counter value */
         counter = user->time_interval == 0 ? user->offset : (int)now / user->time_interval + user->offset;
-
-        /* Generate OTP using expected counter */
         ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "generating digest hash for \"%s\" assuming OTP counter %d",
           user->username, counter);
-        if (user->algorithm == OTP_ALGORITHM_MOTP)
-            motp(user->key, user->keylen, user->pin, counter, user->num_digits, otpbuf, OTP_BUF_SIZE);
-        else
-            hotp(user->key, user->keylen, counter, user->num_digits, otpbuf, NULL, OTP_BUF_SIZE);   /* assume decimal! */
         linger = 0;
+        counter_valid = 1;
+    }
+
+    /* Use the hash cached for the same OTP, or counter, if any; it only changes when the counter or linger state does */
+    if (otp_ha1_lookup(user, realm, linger ? otpbuf : NULL, counter, otpbuf, ha1)) {
+        *rethash = apr_pstrdup(r->pool, ha1);
+        goto done;
+    }
+
+    /* Generate OTP using expected counter */
+    if (!linger) {
+        if (user->algorithm == OTP_ALGORITHM_MOTP) {
+            motp_key_init(r, user);
+            motp(user->mkey, counter, user->num_digits, otpbuf, OTP_BUF_SIZE);
+        } else if (hotp_key_init(r, user) != 0)
+            return AUTH_GENERAL_ERROR;
+        else
+            hotp(user->hkey, counter, user->num_digits, otpbuf, NULL, OTP_BUF_SIZE);   /* assume decimal! */
     }
 
     /* Generate digest hash */
     apr_snprintf(hashbuf, sizeof(hashbuf), "%s:%s:%s%s", user->username, realm,
       user->algorithm == OTP_ALGORITHM_MOTP ? "" : user->pin, otpbuf);
     *rethash = ap_md5(r->pool, (void *)hashbuf);
+    otp_ha1_store(user, realm, counter_valid, counter, otpbuf, *rethash);
 
+done:
 #if 0
     ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "OTP=\"%s\" counter=%d user=\"%s\" realm=\"%s\" pin=\"%s\" digest=\"%s\"",
       otpbuf10, counter, user->username, realm, user->pin, *rethash);
 #endif
 
-    /* If we are past the previous linger time, assume counter advance and update user's info */
+    /*
+     * If we are past the previous linger time, assume counter advance. mod_auth_digest hasn't compared the hashes
+     * yet, so update the user's info only once the request turns out to be authenticated (see log_transaction).
+     */
     if (!linger) {
         if (user->time_interval == 0)
             user->offset = counter + 1;
         apr_snprintf(user->last_otp, sizeof(user->last_otp), "%s", otpbuf);
         user->last_auth = now;
-        find_update_user(r, conf->users_file, user, 1);
+        commit = apr_palloc(r->pool, sizeof(*commit));
+        memcpy(&commit->conf, conf, sizeof(commit->conf));
+        memcpy(&commit->user, user, sizeof(commit->user));
+        ap_set_module_config(r->request_config, &authn_otp_module, commit);
     }
 
     /* Done */
@@ -1041,13 +4792,13 @@ authn_otp_get_realm_hash(request_rec *r, const char *username, const char *realm
 }
 
 /*
- * Get configuration
+ * Get configuration, with defaults applied for any unset values, into the caller's buffer.
+ * This does not allocate; strings and the provider list are shared with the per-directory config.
  */
 static struct otp_config *
-get_config(request_rec *r)
+get_config(request_rec *r, struct otp_config *conf)
 {
     struct otp_config *dir_conf;
-    struct otp_config *conf;
 
     /* I don't understand this bug: sometimes r->per_dir_config == NULL. Some weird linking problem. */
     if (r->per_dir_config == NULL) {
@@ -1057,15 +4808,7 @@ get_config(request_rec *r)
         dir_conf = ap_get_module_config(r->per_dir_config, &authn_otp_module);
 
     /* Make a copy of the current per-directory config */
-    conf = apr_pcalloc(r->pool, sizeof(*conf));
-    if (dir_conf->users_file != NULL)
-        conf->users_file = apr_pstrdup(r->pool, dir_conf->users_file);
-    conf->max_offset = dir_conf->max_offset;
-    conf->max_linger = dir_conf->max_linger;
-    conf->max_otp_failures = dir_conf->max_otp_failures;
-    conf->logout_ip_change = dir_conf->logout_ip_change;
-    conf->allow_fallthrough = dir_conf->allow_fallthrough;
-    copy_provider_list(r->pool, &conf->provlist, dir_conf->provlist);
+    memcpy(conf, dir_conf, sizeof(*conf));
 
     /* Apply defaults for any unset values */
     if (conf->max_offset == -1)
@@ -1076,6 +4819,26 @@ get_config(request_rec *r)
         conf->logout_ip_change = DEFAULT_LOGOUT_IP_CHANGE;
     if (conf->allow_fallthrough == -1)
         conf->allow_fallthrough = DEFAULT_ALLOW_FALLTHROUGH;
+    if (conf->time_format == -1)
+        conf->time_format = DEFAULT_TIME_FORMAT;
+    if (conf->resync_window == -1)
+        conf->resync_window = DEFAULT_RESYNC_WINDOW;
+    if (conf->session_lifetime == -1)
+        conf->session_lifetime = DEFAULT_SESSION_LIFETIME;
+    if (conf->session_bind_ip == -1)
+        conf->session_bind_ip = DEFAULT_SESSION_BIND_IP;
+    if (conf->max_failure_rate == -1)
+        conf->max_failure_rate = DEFAULT_MAX_FAILURE_RATE;
+    if (conf->pin_cache_time == -1)
+        conf->pin_cache_time = DEFAULT_PIN_CACHE_TIME;
+    if (conf->parallel_pin == -1)
+        conf->parallel_pin = DEFAULT_PARALLEL_PIN;
+    if (conf->usernameless == -1)
+        conf->usernameless = DEFAULT_USERNAMELESS;
+
+    /* Passwords without a username may match any user, so never let one IP address guess them without limit */
+    if (conf->usernameless && conf->max_failure_rate <= 0)
+        conf->max_failure_rate = DEFAULT_USERNAMELESS_FAILURE_RATE;
 
     /* Done */
     return conf;
@@ -1095,6 +4858,16 @@ create_authn_otp_dir_config(apr_pool_t *p, char *d)
     conf->max_otp_failures = 0;
     conf->logout_ip_change = -1;
     conf->allow_fallthrough = -1;
+    conf->time_format = -1;
+    conf->resync_window = -1;
+    conf->session_lifetime = -1;
+    conf->session_bind_ip = -1;
+    conf->session_key = NULL;
+    conf->session_path = NULL;
+    conf->max_failure_rate = -1;
+    conf->pin_cache_time = -1;
+    conf->parallel_pin = -1;
+    conf->usernameless = -1;
     conf->provlist = NULL;
     return conf;
 }
@@ -1115,6 +4888,19 @@ merge_authn_otp_dir_config(apr_pool_t *p, void *base_conf, void *new_conf)
     conf->max_otp_failures = conf2->max_otp_failures != 0 ? conf2->max_otp_failures : conf1->max_otp_failures;
     conf->logout_ip_change = conf2->logout_ip_change != -1 ? conf2->logout_ip_change : conf1->logout_ip_change;
     conf->allow_fallthrough = conf2->allow_fallthrough != -1 ? conf2->allow_fallthrough : conf1->allow_fallthrough;
+    conf->time_format = conf2->time_format != -1 ? conf2->time_format : conf1->time_format;
+    conf->resync_window = conf2->resync_window != -1 ? conf2->resync_window : conf1->resync_window;
+    conf->session_lifetime = conf2->session_lifetime != -1 ? conf2->session_lifetime : conf1->session_lifetime;
+    conf->session_bind_ip = conf2->session_bind_ip != -1 ? conf2->session_bind_ip : conf1->session_bind_ip;
+    conf->session_key = conf2->session_key != NULL ? conf2->session_key : conf1->session_key;
+    if (conf2->session_path != NULL)
+        conf->session_path = apr_pstrdup(p, conf2->session_path);
+    else if (conf1->session_path != NULL)
+        conf->session_path = apr_pstrdup(p, conf1->session_path);
+    conf->max_failure_rate = conf2->max_failure_rate != -1 ? conf2->max_failure_rate : conf1->max_failure_rate;
+    conf->pin_cache_time = conf2->pin_cache_time != -1 ? conf2->pin_cache_time : conf1->pin_cache_time;
+    conf->parallel_pin = conf2->parallel_pin != -1 ? conf2->parallel_pin : conf1->parallel_pin;
+    conf->usernameless = conf2->usernameless != -1 ? conf2->usernameless : conf1->usernameless;
     copy_provider_list(p, &conf->provlist, conf2->provlist != NULL ? conf2->provlist : conf1->provlist);
     return conf;
 }
@@ -1161,6 +4947,80 @@ add_authn_provider(cmd_parms *cmd, void *config, const char *provider_name)
     return NULL;
 }
 
+static const char *
+set_time_format(cmd_parms *cmd, void *config, const char *arg)
+{
+    struct otp_config *const conf = (struct otp_config *)config;
+
+    if (strcasecmp(arg, "local") == 0)
+        conf->time_format = TIME_FORMAT_LOCAL;
+    else if (strcasecmp(arg, "utc") == 0)
+        conf->time_format = TIME_FORMAT_UTC;
+    else if (strcasecmp(arg, "epoch") == 0)
+        conf->time_format = TIME_FORMAT_EPOCH;
+    else
+        return apr_psprintf(cmd->pool, "Invalid timestamp format \"%s\": must be one of local, utc, or epoch", arg);
+    return NULL;
+}
+
+static const char *
+set_precompute(cmd_parms *cmd, void *config, int flag)
+{
+    struct otp_server_config *const sconf = ap_get_module_config(cmd->server->module_config, &authn_otp_module);
+
+    sconf->precompute = flag;
+    return NULL;
+}
+
+static const char *
+set_resync_window(cmd_parms *cmd, void *config, const char *arg)
+{
+    struct otp_config *const conf = (struct otp_config *)config;
+    char *end;
+    long window;
+
+    window = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || window < 0 || window > MAX_RESYNC_WINDOW) {
+        return apr_psprintf(cmd->pool, "Invalid resynchronization window \"%s\": must be zero (disabled) or 1 to %d",
+          arg, MAX_RESYNC_WINDOW);
+    }
+    conf->resync_window = (int)window;
+    return NULL;
+}
+
+static const char *
+set_session_key_file(cmd_parms *cmd, void *config, const char *arg)
+{
+    struct otp_config *const conf = (struct otp_config *)config;
+    const char *path = ap_server_root_relative(cmd->pool, arg);
+    u_char keybuf[MAX_KEY];
+    apr_file_t *file;
+    apr_size_t keylen;
+    apr_status_t status;
+    char errbuf[64];
+
+    /* Read key */
+    if (path == NULL)
+        return apr_psprintf(cmd->pool, "Invalid session key file path \"%s\"", arg);
+    if ((status = apr_file_open(&file, path, APR_READ|APR_BINARY, 0, cmd->pool)) != APR_SUCCESS)
+        return apr_psprintf(cmd->pool, "Can't open session key file \"%s\": %s", path, apr_strerror(status, errbuf, sizeof(errbuf)));
+    status = apr_file_read_full(file, keybuf, sizeof(keybuf), &keylen);
+    apr_file_close(file);
+    if (status != APR_SUCCESS && status != APR_EOF)
+        return apr_psprintf(cmd->pool, "Can't read session key file \"%s\": %s", path, apr_strerror(status, errbuf, sizeof(errbuf)));
+    if (keylen < SESSION_MIN_KEY)
+        return apr_psprintf(cmd->pool, "Session key file \"%s\" must contain at least %d bytes", path, SESSION_MIN_KEY);
+
+    /* Precompute HMAC state */
+    conf->session_key = apr_pcalloc(cmd->pool, sizeof(*conf->session_key));
+    apr_pool_cleanup_register(cmd->pool, conf->session_key, hotp_key_cleanup, apr_pool_cleanup_null);
+    status = hotp_key_absorb(conf->session_key, keybuf, keylen);
+    memset(keybuf, 0, sizeof(keybuf));
+    if (status != 0)
+        return apr_psprintf(cmd->pool, "Can't initialize HMAC state for session key file \"%s\"", path);
+    return NULL;
+}
+
 static void
 copy_provider_list(apr_pool_t *p, authn_provider_list **dstp, authn_provider_list *src)
 {
@@ -1173,6 +5033,29 @@ copy_provider_list(apr_pool_t *p, authn_provider_list **dstp, authn_provider_lis
     }
 }
 
+/*
+ * Per-server configuration
+ */
+static void *
+create_authn_otp_server_config(apr_pool_t *p, server_rec *s)
+{
+    struct otp_server_config *sconf = apr_pcalloc(p, sizeof(struct otp_server_config));
+
+    sconf->precompute = -1;
+    return sconf;
+}
+
+static void *
+merge_authn_otp_server_config(apr_pool_t *p, void *base_conf, void *new_conf)
+{
+    struct otp_server_config *const sconf1 = base_conf;
+    struct otp_server_config *const sconf2 = new_conf;
+    struct otp_server_config *sconf = apr_pcalloc(p, sizeof(struct otp_server_config));
+
+    sconf->precompute = sconf2->precompute != -1 ? sconf2->precompute : sconf1->precompute;
+    return sconf;
+}
+
 /* Authorization provider information */
 static const authn_provider authn_otp_provider =
 {
@@ -1180,10 +5063,274 @@ static const authn_provider authn_otp_provider =
     &authn_otp_get_realm_hash
 };
 
+/*
+ * Report this process's OTP verification statistics on the server status page
+ */
+static int
+authn_otp_status(request_rec *r, int flags)
+{
+    const apr_uint32_t num_verifies = apr_atomic_read32(&otp_num_verifies);
+    const apr_uint32_t num_hashes = apr_atomic_read32(&otp_num_hashes);
+    const double average = num_verifies != 0 ? (double)num_hashes / num_verifies : 0.0;
+    int i;
+
+    if ((flags & AP_STATUS_SHORT) != 0) {
+        ap_rprintf(r, "OTPVerifications: %u\n", num_verifies);
+        ap_rprintf(r, "OTPHashesPerVerification: %.2f\n", average);
+        ap_rprintf(r, "OTPPINProviderCalls: %u\n", apr_atomic_read32(&otp_pin_calls));
+        ap_rprintf(r, "OTPPINProviderCallsSaved: %u\n", apr_atomic_read32(&otp_pin_calls_saved));
+        ap_rprintf(r, "OTPPrecomputeHits: %u\n", apr_atomic_read32(&otp_precompute_hits));
+        ap_rprintf(r, "OTPPrecomputeMisses: %u\n", apr_atomic_read32(&otp_precompute_misses));
+        ap_rprintf(r, "OTPCachedReuses: %u\n", apr_atomic_read32(&otp_reuse_verifies));
+#if APR_POOL_DEBUG
+        ap_rprintf(r, "OTPCachedReuseBytesAllocated: %u\n", apr_atomic_read32(&otp_reuse_bytes));
+#endif
+        ap_rprintf(r, "OTPTimeBasedAccepted: %u\n", apr_atomic_read32(&otp_drift_accepts));
+        ap_rprintf(r, "OTPTimeBasedAtPredictedOffset: %u\n", apr_atomic_read32(&otp_drift_predicted));
+        for (i = 0; i < OTP_STAGE_MAX; i++)
+            ap_rprintf(r, "OTPStage%s: %u\n", otp_stage_names[i], apr_atomic_read32(&otp_stage_counts[i]));
+        return OK;
+    }
+    ap_rputs("<hr />\n<h2>OTP authentication (this process)</h2>\n<dl>\n", r);
+    ap_rprintf(r, "<dt>Verifications: %u</dt>\n", num_verifies);
+    ap_rprintf(r, "<dt>OTP values computed: %u (%.2f per verification)</dt>\n", num_hashes, average);
+    ap_rprintf(r, "<dt>PIN auth provider calls: %u (%u saved by trying each user's last provider first)</dt>\n",
+      apr_atomic_read32(&otp_pin_calls), apr_atomic_read32(&otp_pin_calls_saved));
+    ap_rprintf(r, "<dt>Time-based requests precomputed in the background: %u (%u had to compute values)</dt>\n",
+      apr_atomic_read32(&otp_precompute_hits), apr_atomic_read32(&otp_precompute_misses));
+#if APR_POOL_DEBUG
+    ap_rprintf(r, "<dt>Reuses of a cached user's OTP verified: %u (%u bytes allocated)</dt>\n",
+      apr_atomic_read32(&otp_reuse_verifies), apr_atomic_read32(&otp_reuse_bytes));
+#else
+    ap_rprintf(r, "<dt>Reuses of a cached user's OTP verified: %u</dt>\n", apr_atomic_read32(&otp_reuse_verifies));
+#endif
+    ap_rprintf(r, "<dt>Time-based OTPs accepted: %u (%u at the offset predicted by the user's drift)</dt>\n",
+      apr_atomic_read32(&otp_drift_accepts), apr_atomic_read32(&otp_drift_predicted));
+    for (i = 0; i < OTP_STAGE_MAX; i++)
+        ap_rprintf(r, "<dt>Requests decided at stage %s: %u</dt>\n", otp_stage_names[i], apr_atomic_read32(&otp_stage_counts[i]));
+    ap_rputs("</dl>\n", r);
+    return OK;
+}
+
+/*
+ * Allocate the connection's cache of its last granted credential. HTTP/2 streams use their master connection's.
+ */
+static int
+authn_otp_pre_connection(conn_rec *c, void *csd)
+{
+    if (otp_lingers != NULL && MASTER_CONN(c) == c)
+        ap_set_module_config(c->conn_config, &authn_otp_module, apr_pcalloc(c->pool, sizeof(struct otp_conn)));
+    return OK;
+}
+
+/*
+ * Make the users file updates of digest authentications, now that we know whether they succeeded. A request that
+ * failed authentication has status 401, even if it was internally redirected to an ErrorDocument. Also write any
+ * wrong OTP counts that have been waiting in shared memory too long.
+ */
+static int
+authn_otp_log_transaction(request_rec *r)
+{
+    struct otp_config confbuf;
+    struct otp_config *const conf = get_config(r, &confbuf);
+    struct otp_digest_commit *commit;
+
+    /* Write any unwritten failure counts that are due */
+    if (conf->users_file != NULL)
+        otp_failure_flush(r, conf);
+
+    /* Commit counters advanced by digest authentication, once the request turned out to be authenticated */
+    for (; r != NULL; r = r->prev) {
+        if ((commit = ap_get_module_config(r->request_config, &authn_otp_module)) == NULL)
+            continue;
+        ap_set_module_config(r->request_config, &authn_otp_module, NULL);
+        if (r->status == HTTP_UNAUTHORIZED || r->user == NULL || strcmp(r->user, commit->user.username) != 0) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+              "not updating user \"%s\" after failed digest authentication", commit->user.username);
+            continue;
+        }
+        find_update_user(r, &commit->conf, &commit->user, 1);
+    }
+    return DECLINED;
+}
+
+/*
+ * Create the shared memory cache of granted credentials, before the children are forked
+ */
+static int
+authn_otp_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
+{
+    apr_status_t status;
+    char errbuf[64];
+
+    /* Choose a new tag key */
+    if ((status = apr_generate_random_bytes(otp_linger_secret, sizeof(otp_linger_secret))) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s, "can't generate OTP linger cache key: %s",
+          apr_strerror(status, errbuf, sizeof(errbuf)));
+        goto fail;
+    }
+
+    /* Create the cache and its mutex; they are destroyed along with the configuration pool */
+    if ((status = apr_shm_create(&otp_linger_shm, sizeof(*otp_linger_table), NULL, pconf)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s, "can't create OTP linger cache: %s",
+          apr_strerror(status, errbuf, sizeof(errbuf)));
+        goto fail;
+    }
+    if ((status = apr_global_mutex_create(&otp_linger_mutex, NULL, APR_LOCK_DEFAULT, pconf)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s, "can't create OTP linger cache mutex: %s",
+          apr_strerror(status, errbuf, sizeof(errbuf)));
+        goto fail;
+    }
+#ifdef AP_NEED_SET_MUTEX_PERMS
+    if ((status = ap_unixd_set_global_mutex_perms(otp_linger_mutex)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s, "can't set OTP linger cache mutex permissions: %s",
+          apr_strerror(status, errbuf, sizeof(errbuf)));
+        goto fail;
+    }
+#endif
+    otp_linger_table = apr_shm_baseaddr_get(otp_linger_shm);
+    memset(otp_linger_table, 0, sizeof(*otp_linger_table));
+    otp_lingers = otp_linger_table->entries;
+    return OK;
+
+fail:
+    /* Reuse within the linger time still works, via the users file */
+    otp_lingers = NULL;
+    otp_linger_mutex = NULL;
+    return OK;
+}
+
+static void
+authn_otp_child_init(apr_pool_t *p, server_rec *s)
+{
+    struct otp_server_config *sconf;
+    apr_status_t status;
+    server_rec *vs;
+    int precompute = 0;
+    char errbuf[64];
+
+    /* Fetch the SHA-1 implementation once, instead of implicitly on every digest initialization */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    if (sha1_md == NULL)
+        sha1_md = EVP_MD_fetch(NULL, "SHA1", NULL);
+#endif
+    if (sha1_md == NULL)
+        sha1_md = EVP_sha1();
+
+    /* Select the internal SHA-1 and MD5 implementations; this also runs their self-checks */
+    if (sha1_impl == NULL) {
+        if ((sha1_impl = hmac_sha1_select()) != NULL)
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "using %s SHA-1 for HOTP", sha1_impl);
+        else
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "internal SHA-1 failed self-check; using OpenSSL for HOTP");
+    }
+    if (md5_impl == NULL) {
+        if ((md5_impl = md5_select()) != NULL)
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "using %s MD5 for mOTP", md5_impl);
+        else
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "internal MD5 failed self-check; using OpenSSL for mOTP");
+    }
+
+    /* Reattach to the mutex of the shared linger cache */
+    if (otp_linger_mutex != NULL
+      && (status = apr_global_mutex_child_init(&otp_linger_mutex, apr_global_mutex_lockfile(otp_linger_mutex), p)) != 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "can't attach to OTP linger cache mutex: %s",
+          apr_strerror(status, errbuf, sizeof(errbuf)));
+        otp_lingers = NULL;
+    }
+
+    /* Precompute the HMAC state for the linger cache's tag key */
+    if (otp_lingers != NULL && otp_linger_key.ictx == NULL) {
+        apr_pool_cleanup_register(p, &otp_linger_key, hotp_key_cleanup, apr_pool_cleanup_null);
+        if (hotp_key_absorb(&otp_linger_key, otp_linger_secret, sizeof(otp_linger_secret)) != 0) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "can't initialize OTP linger cache HMAC state");
+            otp_lingers = NULL;
+        }
+    }
+
+    /* Create the mutex for per-connection caches */
+    if (otp_lingers != NULL && otp_conn_mutex == NULL
+      && (status = apr_thread_mutex_create(&otp_conn_mutex, APR_THREAD_MUTEX_DEFAULT, p)) != 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "can't create OTP connection cache mutex: %s",
+          apr_strerror(status, errbuf, sizeof(errbuf)));
+        otp_conn_mutex = NULL;
+    }
+
+    /* Create the mutex and condition variable for coalescing concurrent verifications */
+    if (otp_flight_mutex == NULL) {
+        if ((status = apr_thread_mutex_create(&otp_flight_mutex, APR_THREAD_MUTEX_DEFAULT, p)) != 0
+          || (status = apr_thread_cond_create(&otp_flight_cond, p)) != 0) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "can't create OTP verification coalescing mutex: %s",
+              apr_strerror(status, errbuf, sizeof(errbuf)));
+            otp_flight_mutex = NULL;
+        }
+    }
+
+    /* Create the per-process users cache; without it, the users file is read on every request */
+    otp_cache_create(&user_cache, OTP_USER_CACHE_SLOTS, sizeof(struct otp_user_entry), "users cache", p, s);
+
+    /* Create the per-process memo of PIN auth providers; without it, each user's PIN goes through the whole chain */
+    otp_cache_create(&otp_affinity_cache, OTP_AFFINITY_SLOTS, sizeof(struct otp_affinity), "PIN provider memo", p, s);
+
+    /* Create the per-process cache of digest authentication hashes; without it, they're computed on every request */
+    otp_cache_create(&otp_ha1_cache, OTP_HA1_SLOTS, sizeof(struct otp_ha1), "digest hash cache", p, s);
+
+    /* Create the per-process reverse index of OTPs; without it, logins without a username are denied */
+    if (otp_index_mutex == NULL) {
+        if ((status = apr_thread_mutex_create(&otp_index_mutex, APR_THREAD_MUTEX_DEFAULT, p)) != 0
+          || (status = apr_pool_create(&otp_index.pool, p)) != 0) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "can't create OTP reverse index: %s",
+              apr_strerror(status, errbuf, sizeof(errbuf)));
+            otp_index_mutex = NULL;
+        }
+    }
+
+    /* Create the per-process cache of HOTP values; without it, values are computed on every request */
+    otp_cache_create(&otp_window_cache, OTP_WINDOW_SLOTS, sizeof(struct otp_window), "HOTP value cache", p, s);
+
+    /* Start the background precomputation thread if any server wants it; it needs the internal SHA-1 */
+    for (vs = s; vs != NULL && !precompute; vs = vs->next) {
+        sconf = ap_get_module_config(vs->module_config, &authn_otp_module);
+        precompute = sconf->precompute != -1 ? sconf->precompute : DEFAULT_PRECOMPUTE;
+    }
+    if (precompute && otp_window_cache.slots != NULL && sha1_impl != NULL && otp_precompute_tid == NULL) {
+        otp_precompute_stop = 0;
+        if ((status = apr_thread_cond_create(&otp_precompute_cond, p)) != 0
+          || (status = apr_thread_create(&otp_precompute_tid, NULL, otp_precompute_thread, NULL, p)) != 0) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "can't start OTP precompute thread: %s",
+              apr_strerror(status, errbuf, sizeof(errbuf)));
+            otp_precompute_tid = NULL;
+        } else
+            apr_pool_cleanup_register(p, NULL, otp_precompute_cleanup, apr_pool_cleanup_null);
+    }
+
+    /* Create the thread pool for resynchronization searches; threads are only started when needed */
+    if (otp_resync_pool == NULL
+      && (status = apr_thread_pool_create(&otp_resync_pool, 0, OTP_RESYNC_THREADS, p)) != 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "can't create OTP resynchronization thread pool: %s",
+          apr_strerror(status, errbuf, sizeof(errbuf)));
+        otp_resync_pool = NULL;
+    }
+
+    /* Create thread-local storage for scratch digest contexts */
+    if (hotp_ctx_key == NULL
+      && (status = apr_threadkey_private_create(&hotp_ctx_key, hotp_thread_ctx_destroy, p)) != 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "can't create OTP thread-local storage: %s",
+          apr_strerror(status, errbuf, sizeof(errbuf)));
+        hotp_ctx_key = NULL;
+    }
+}
+
 static void
 register_hooks(apr_pool_t *p)
 {
     ap_register_provider(p, AUTHN_PROVIDER_GROUP, OTP_AUTHN_PROVIDER_NAME, AUTHN_PROVIDER_VERSION, &authn_otp_provider);
+    ap_hook_post_config(authn_otp_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_check_user_id(authn_otp_check_session, NULL, NULL, APR_HOOK_FIRST);
+    ap_hook_pre_connection(authn_otp_pre_connection, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(authn_otp_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_log_transaction(authn_otp_log_transaction, NULL, NULL, APR_HOOK_MIDDLE);
+    APR_OPTIONAL_HOOK(ap, status_hook, authn_otp_status, NULL, NULL, APR_HOOK_MIDDLE);
     apr_status_t status;
     char errbuf[64];
 
@@ -1232,6 +5379,62 @@ static const command_rec authn_otp_cmds[] =
         (void *)APR_OFFSETOF(struct otp_config, allow_fallthrough),
         OR_AUTHCFG,
         "allow failed auth attempts to fall through to the next auth provider (if any)"),
+    AP_INIT_TAKE1("OTPAuthTimestampFormat",
+        set_time_format,
+        NULL,
+        OR_AUTHCFG,
+        "format for timestamps written to the users file: local (default), utc, or epoch"),
+    AP_INIT_TAKE1("OTPAuthResyncWindow",
+        set_resync_window,
+        NULL,
+        OR_AUTHCFG,
+        "maximum counter offset searched when a user resynchronizes by giving two consecutive OTPs (default zero, disabled)"),
+    AP_INIT_TAKE1("OTPAuthSessionLifetime",
+        ap_set_int_slot,
+        (void *)APR_OFFSETOF(struct otp_config, session_lifetime),
+        OR_AUTHCFG,
+        "lifetime (in seconds) of signed session cookies issued after a successful OTP (default zero, disabled)"),
+    AP_INIT_TAKE1("OTPAuthSessionKeyFile",
+        set_session_key_file,
+        NULL,
+        OR_AUTHCFG,
+        "pathname of the file containing the secret key used to sign session cookies"),
+    AP_INIT_FLAG("OTPAuthSessionBindIP",
+        ap_set_flag_slot,
+        (void *)APR_OFFSETOF(struct otp_config, session_bind_ip),
+        OR_AUTHCFG,
+        "only accept session cookies from the IP address they were issued to (default on)"),
+    AP_INIT_TAKE1("OTPAuthSessionPath",
+        ap_set_string_slot,
+        (void *)APR_OFFSETOF(struct otp_config, session_path),
+        OR_AUTHCFG,
+        "URL path session cookies apply to, normally that of the protected location (default the request's directory)"),
+    AP_INIT_TAKE1("OTPAuthMaxFailureRate",
+        ap_set_int_slot,
+        (void *)APR_OFFSETOF(struct otp_config, max_failure_rate),
+        OR_AUTHCFG,
+        "maximum number of wrong passwords per minute from one IP address (default zero, no limit; 10 with OTPAuthUsernameless)"),
+    AP_INIT_TAKE1("OTPAuthPINCacheTime",
+        ap_set_int_slot,
+        (void *)APR_OFFSETOF(struct otp_config, pin_cache_time),
+        OR_AUTHCFG,
+        "time (in seconds) for which a PIN auth provider's grant of a PIN is reused (default zero, disabled)"),
+    AP_INIT_FLAG("OTPAuthParallelPIN",
+        ap_set_flag_slot,
+        (void *)APR_OFFSETOF(struct otp_config, parallel_pin),
+        OR_AUTHCFG,
+        "check PINs with PIN auth providers while searching for the OTP, even if the OTP is wrong (default off)"),
+    AP_INIT_FLAG("OTPAuthUsernameless",
+        ap_set_flag_slot,
+        (void *)APR_OFFSETOF(struct otp_config, usernameless),
+        OR_AUTHCFG,
+        "accept a PIN and OTP without a username from the user whose time-based token shows that OTP (default off);"
+        " requires OTPAuthMaxFailureRate (10 if not set), and limits wrong ones from all clients to 100 per minute"),
+    AP_INIT_FLAG("OTPAuthPrecompute",
+        set_precompute,
+        NULL,
+        RSRC_CONF,
+        "precompute time-based OTPs of recently active users in the background just before each time step"),
     { NULL }
 };
 
@@ -1240,8 +5443,8 @@ module AP_MODULE_DECLARE_DATA authn_otp_module = {
     STANDARD20_MODULE_STUFF,
     create_authn_otp_dir_config,        /* create per-dir config */
     merge_authn_otp_dir_config,         /* merge per-dir config */
-    NULL,                               /* create per-server config */
-    NULL,                               /* merge per-server config */
+    create_authn_otp_server_config,     /* create per-server config */
+    merge_authn_otp_server_config,      /* merge per-server config */
     authn_otp_cmds,                     /* command apr_table_t */
     register_hooks                      /* register hooks */
 };
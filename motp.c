@@ -24,19 +24,59 @@
 /* Definitions */
 #define MOTP_NUM_BYTES      3
 
+/* Internal MD5 implementation, or NULL to use OpenSSL */
+static const char   *md5_impl;
+static int          md5_selected;
+
 /*
- * Generate an OTP using the mOTP algorithm defined by http://motp.sourceforge.net/
+ * Precompute the part of the mOTP message that follows the counter (the hex key and PIN),
+ * so that only the counter digits need to be formatted for each OTP.
  */
 void
-motp(const u_char *key, size_t keylen, const char *pin, u_long counter, int ndigits, char *buf, size_t buflen)
+motp_key_init(struct motp_key *mkey, const u_char *key, size_t keylen, const char *pin)
 {
-    u_char hash[MD5_DIGEST_LENGTH];
-    char hashbuf[256];
-    char keybuf[256];
+    char keybuf[MOTP_MAX_MESSAGE + 1];
+    int len;
+
+    /* Select the internal MD5 implementation once; this also runs the RFC 1321 self-check */
+    if (!md5_selected) {
+        md5_impl = md5_select();
+        md5_selected = 1;
+    }
 
+    /* Build suffix, truncated as the whole message would be */
     printhex(keybuf, sizeof(keybuf), key, keylen, keylen * 2);
-    snprintf(hashbuf, sizeof(hashbuf), "%lu%s%s", counter, keybuf, pin);
-    MD5((u_char *)hashbuf, strlen(hashbuf), hash);
-    printhex(buf, buflen, hash, sizeof(hash), ndigits);
+    len = snprintf(mkey->msg + MOTP_MAX_COUNTER, MOTP_MAX_MESSAGE + 1, "%s%s", keybuf, pin);
+    mkey->suffix_len = len < MOTP_MAX_MESSAGE ? len : MOTP_MAX_MESSAGE;
+}
+
+/*
+ * Generate an OTP using the mOTP algorithm defined by http://motp.sourceforge.net/
+ */
+void
+motp(struct motp_key *mkey, u_long counter, int ndigits, char *buf, size_t buflen)
+{
+    u_char hash[1][MD5_DIGEST_LENGTH];
+    char *const suffix = mkey->msg + MOTP_MAX_COUNTER;
+    const u_char *msg;
+    char *s = suffix;
+    size_t len;
+
+    /* Format counter in decimal just before the suffix */
+    do {
+        *--s = '0' + (char)(counter % 10);
+        counter /= 10;
+    } while (counter != 0);
+    msg = (const u_char *)s;
+    len = (suffix - s) + mkey->suffix_len;
+    if (len > MOTP_MAX_MESSAGE)
+        len = MOTP_MAX_MESSAGE;
+
+    /* Compute digest */
+    if (md5_impl != NULL)
+        md5_batch(&msg, &len, 1, hash);
+    else
+        MD5(msg, len, hash[0]);
+    printhex(buf, buflen, hash[0], sizeof(hash[0]), ndigits);
 }
 
@@ -0,0 +1,590 @@
+/*
+ * mod_authn_otp - Apache module for one-time password authentication
+ *
+ * Copyright 2009 Archie L. Cobbs <archie@dellroad.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * $Id$
+ */
+
+/*
+ * Micro-benchmarks for the OTP computations (run by "make bench"). Each benchmark times
+ * the code path used before an optimization against the one used now, on this CPU.
+ *
+ * Usage: otpbench [benchmark ...]
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/md5.h>
+
+#include "md5.h"
+#include "sha1.h"
+
+/* Minimum time spent on each measurement */
+#define MIN_NANOS                   200000000LL
+
+/* mOTP message limits, as in otptool.h */
+#define MOTP_MAX_MESSAGE            255
+#define MOTP_MAX_COUNTER            20
+
+/* mOTP window: MOTP/T10 with a maximum offset of 180 (half an hour either way) */
+#define MOTP_WINDOW                 361
+
+/* Reverse index (OTPAuthUsernameless): 100k users with 6 digit TOTP tokens and a maximum offset of 1 */
+#define INDEX_USERS                 100000
+#define INDEX_WINDOW                3
+#define INDEX_DIGITS                6
+#define INDEX_SAMPLES               100000
+#define INDEX_MAX_CANDIDATES        64
+
+/* Benchmark function; returns the number of operations done */
+typedef long (*bench_t)(long iterations);
+
+/* Internal functions */
+static void         bench_sha1(void);
+static void         bench_window(void);
+static void         bench_motp(void);
+static void         bench_index(void);
+static double       measure(bench_t func);
+static long long    nanos(void);
+static long         sha1_hmac_oneshot(long iterations);
+static long         sha1_openssl_states(long iterations);
+static long         sha1_internal(long iterations);
+static long         window_sequential(long iterations);
+static long         window_batch(long iterations);
+static long         motp_format_each(long iterations);
+static long         motp_suffix_single(long iterations);
+static long         motp_suffix_batch(long iterations);
+static void         index_build(long step);
+static long         index_lookup(long iterations);
+static int          index_candidates(int value);
+static u_int        index_bucket(int value);
+static void         hex(char *buf, const u_char *data, size_t len);
+
+/* Benchmarks */
+static const struct benchmark {
+    const char      *name;
+    const char      *description;
+    void            (*func)(void);
+} benchmarks[] = {
+    { "sha1",   "one HOTP value: HMAC(), OpenSSL with precomputed key states, internal SHA-1",  bench_sha1 },
+    { "window", "counter windows: one value at a time vs. multi-buffer batches",                  bench_window },
+    { "motp",   "mOTP windows: formatting each message vs. a precomputed suffix, MD5() vs. batches", bench_motp },
+    { "index",  "username-less lookup: reverse index vs. every token's window, and OTP collisions", bench_index },
+    { NULL }
+};
+
+/* Key and states shared by the benchmarks */
+static const u_char bench_key[] = "12345678901234567890";
+static struct hmac_sha1_key bench_hkey;
+static EVP_MD_CTX   *bench_ictx;
+static EVP_MD_CTX   *bench_octx;
+static EVP_MD_CTX   *bench_ctx;
+
+/* Window size for the window benchmark */
+static int          bench_window_size;
+
+/* mOTP key and PIN, and the precomputed messages (one per batch lane) */
+static const u_char motp_key[] = { 0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef,
+                                   0xfe, 0xdc, 0xba, 0x98, 0x76, 0x54, 0x32, 0x10 };
+static const char   motp_pin[] = "1234";
+static char         motp_msgs[MD5_MAX_BATCH][MOTP_MAX_COUNTER + MOTP_MAX_MESSAGE + 1];
+static int          motp_suffix_len;
+
+/* Reverse index: each token's OTPs are its nodes token * INDEX_WINDOW ..., chained by hash bucket */
+static struct hmac_sha1_key *index_keys;
+static int          *index_values;
+static int          *index_next;
+static int          *index_buckets;
+static u_int        index_mask;
+
+/* Prevents the compiler from discarding results */
+static volatile u_int bench_sink;
+
+int
+main(int argc, char **argv)
+{
+    const struct benchmark *b;
+    u_char pad[SHA1_BLOCK_LEN];
+    char keybuf[sizeof(motp_key) * 2 + 1];
+    const char *impl;
+    int i;
+    int j;
+
+    /* Select the internal implementations, as the module does at startup */
+    if ((impl = hmac_sha1_select()) == NULL) {
+        fprintf(stderr, "otpbench: internal SHA-1 failed self-check\n");
+        return 1;
+    }
+    printf("internal SHA-1: %s (%d lanes)\n", impl, hmac_sha1_batch_size());
+    if ((impl = md5_select()) == NULL) {
+        fprintf(stderr, "otpbench: internal MD5 failed self-check\n");
+        return 1;
+    }
+    printf("internal MD5: %s (%d lanes)\n", impl, md5_batch_size());
+    hmac_sha1_key_init(&bench_hkey, bench_key, sizeof(bench_key) - 1);
+
+    /* Precompute the OpenSSL key states, as the module does without the internal SHA-1 */
+    bench_ictx = EVP_MD_CTX_create();
+    bench_octx = EVP_MD_CTX_create();
+    bench_ctx = EVP_MD_CTX_create();
+    memset(pad, 0x36, sizeof(pad));
+    for (i = 0; i < sizeof(bench_key) - 1; i++)
+        pad[i] ^= bench_key[i];
+    EVP_DigestInit_ex(bench_ictx, EVP_sha1(), NULL);
+    EVP_DigestUpdate(bench_ictx, pad, sizeof(pad));
+    for (i = 0; i < sizeof(pad); i++)
+        pad[i] ^= 0x36 ^ 0x5c;
+    EVP_DigestInit_ex(bench_octx, EVP_sha1(), NULL);
+    EVP_DigestUpdate(bench_octx, pad, sizeof(pad));
+
+    /* Precompute the mOTP message suffix in each lane, as the module does once per request */
+    hex(keybuf, motp_key, sizeof(motp_key));
+    motp_suffix_len = snprintf(motp_msgs[0] + MOTP_MAX_COUNTER, MOTP_MAX_MESSAGE + 1, "%s%s", keybuf, motp_pin);
+    for (i = 1; i < MD5_MAX_BATCH; i++)
+        memcpy(motp_msgs[i] + MOTP_MAX_COUNTER, motp_msgs[0] + MOTP_MAX_COUNTER, motp_suffix_len);
+
+    /* Run the requested benchmarks, or all of them */
+    for (b = benchmarks; b->name != NULL; b++) {
+        if (argc > 1) {
+            for (j = 1; j < argc && strcmp(argv[j], b->name) != 0; j++)
+                ;
+            if (j == argc)
+                continue;
+        }
+        printf("\n%s: %s\n", b->name, b->description);
+        (*b->func)();
+    }
+    return 0;
+}
+
+/*
+ * SHA-1: the cost of one HOTP value.
+ */
+static void
+bench_sha1(void)
+{
+    const double oneshot = measure(sha1_hmac_oneshot);
+    const double states = measure(sha1_openssl_states);
+    const double internal = measure(sha1_internal);
+
+    printf("  HMAC() per value             %8.1f ns\n", oneshot);
+    printf("  OpenSSL precomputed states   %8.1f ns  (%.1fx)\n", states, oneshot / states);
+    printf("  internal SHA-1               %8.1f ns  (%.1fx)\n", internal, oneshot / internal);
+}
+
+static long
+sha1_hmac_oneshot(long iterations)
+{
+    u_char hash[EVP_MAX_MD_SIZE];
+    u_char tosign[8];
+    u_int hash_len;
+    long i;
+    int j;
+
+    for (i = 0; i < iterations; i++) {
+        for (j = 0; j < 8; j++)
+            tosign[j] = (u_char)(i >> (56 - 8 * j));
+        HMAC(EVP_sha1(), bench_key, sizeof(bench_key) - 1, tosign, sizeof(tosign), hash, &hash_len);
+        bench_sink += hash[0];
+    }
+    return iterations;
+}
+
+static long
+sha1_openssl_states(long iterations)
+{
+    u_char hash[EVP_MAX_MD_SIZE];
+    u_char tosign[8];
+    u_int hash_len;
+    long i;
+    int j;
+
+    for (i = 0; i < iterations; i++) {
+        for (j = 0; j < 8; j++)
+            tosign[j] = (u_char)(i >> (56 - 8 * j));
+        EVP_MD_CTX_copy_ex(bench_ctx, bench_ictx);
+        EVP_DigestUpdate(bench_ctx, tosign, sizeof(tosign));
+        EVP_DigestFinal_ex(bench_ctx, hash, &hash_len);
+        EVP_MD_CTX_copy_ex(bench_ctx, bench_octx);
+        EVP_DigestUpdate(bench_ctx, hash, hash_len);
+        EVP_DigestFinal_ex(bench_ctx, hash, &hash_len);
+        bench_sink += hash[0];
+    }
+    return iterations;
+}
+
+static long
+sha1_internal(long iterations)
+{
+    u_char hash[SHA1_DIGEST_LEN];
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        hmac_sha1_counter(&bench_hkey, (uint64_t)i, hash);
+        bench_sink += hash[0];
+    }
+    return iterations;
+}
+
+/*
+ * SHA-1: the cost of a counter window, as searched for an OTP or a resynchronization.
+ */
+static void
+bench_window(void)
+{
+    static const int sizes[] = { 3, 21, 201, 20001 };
+    double sequential;
+    double batch;
+    int i;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+        bench_window_size = sizes[i];
+        sequential = measure(window_sequential);
+        batch = measure(window_batch);
+        printf("  %6d counters: %8.1f ns/value sequential, %8.1f ns/value batched  (%.1fx)\n",
+          sizes[i], sequential, batch, sequential / batch);
+    }
+}
+
+static long
+window_sequential(long iterations)
+{
+    u_char hash[SHA1_DIGEST_LEN];
+    long i;
+    int c;
+
+    for (i = 0; i < iterations; i++) {
+        for (c = 0; c < bench_window_size; c++) {
+            hmac_sha1_counter(&bench_hkey, (uint64_t)(i + c), hash);
+            bench_sink += hash[0];
+        }
+    }
+    return iterations * bench_window_size;
+}
+
+static long
+window_batch(long iterations)
+{
+    u_char hashes[HMAC_SHA1_MAX_BATCH][SHA1_DIGEST_LEN];
+    uint64_t counters[HMAC_SHA1_MAX_BATCH];
+    long i;
+    int num;
+    int c;
+    int j;
+
+    for (i = 0; i < iterations; i++) {
+        for (c = 0; c < bench_window_size; c += num) {
+            num = bench_window_size - c < HMAC_SHA1_MAX_BATCH ? bench_window_size - c : HMAC_SHA1_MAX_BATCH;
+            for (j = 0; j < num; j++)
+                counters[j] = (uint64_t)(i + c + j);
+            hmac_sha1_counter_batch(&bench_hkey, counters, num, hashes);
+            bench_sink += hashes[0][0];
+        }
+    }
+    return iterations * bench_window_size;
+}
+
+/*
+ * MD5: the cost of an mOTP window.
+ */
+static void
+bench_motp(void)
+{
+    const double each = measure(motp_format_each);
+    const double single = measure(motp_suffix_single);
+    const double batch = measure(motp_suffix_batch);
+
+    printf("  %d counters, formatting each message   %8.1f ns/value\n", MOTP_WINDOW, each);
+    printf("  %d counters, precomputed suffix, MD5() %8.1f ns/value  (%.1fx)\n", MOTP_WINDOW, single, each / single);
+    printf("  %d counters, precomputed suffix, batch %8.1f ns/value  (%.1fx)\n", MOTP_WINDOW, batch, each / batch);
+}
+
+static long
+motp_format_each(long iterations)
+{
+    char keybuf[sizeof(motp_key) * 2 + 1];
+    char msg[MOTP_MAX_MESSAGE + 1];
+    u_char digest[MD5_DIGEST_LENGTH];
+    long i;
+    int len;
+    int c;
+
+    for (i = 0; i < iterations; i++) {
+        for (c = 0; c < MOTP_WINDOW; c++) {
+            hex(keybuf, motp_key, sizeof(motp_key));
+            len = snprintf(msg, sizeof(msg), "%lu%s%s", (u_long)(i + c), keybuf, motp_pin);
+            MD5((u_char *)msg, len < MOTP_MAX_MESSAGE ? len : MOTP_MAX_MESSAGE, digest);
+            bench_sink += digest[0];
+        }
+    }
+    return iterations * MOTP_WINDOW;
+}
+
+static long
+motp_suffix_single(long iterations)
+{
+    char *const suffix = motp_msgs[0] + MOTP_MAX_COUNTER;
+    u_char digest[MD5_DIGEST_LENGTH];
+    u_long value;
+    long i;
+    char *s;
+    int c;
+
+    for (i = 0; i < iterations; i++) {
+        for (c = 0; c < MOTP_WINDOW; c++) {
+            s = suffix;
+            value = i + c;
+            do {
+                *--s = '0' + (char)(value % 10);
+                value /= 10;
+            } while (value != 0);
+            MD5((u_char *)s, (suffix - s) + motp_suffix_len, digest);
+            bench_sink += digest[0];
+        }
+    }
+    return iterations * MOTP_WINDOW;
+}
+
+static long
+motp_suffix_batch(long iterations)
+{
+    u_char digests[MD5_MAX_BATCH][MD5_DIGEST_LEN];
+    const u_char *msgs[MD5_MAX_BATCH];
+    size_t lens[MD5_MAX_BATCH];
+    u_long value;
+    long i;
+    char *s;
+    int num;
+    int c;
+    int j;
+
+    for (i = 0; i < iterations; i++) {
+        for (c = 0; c < MOTP_WINDOW; c += num) {
+            num = MOTP_WINDOW - c < MD5_MAX_BATCH ? MOTP_WINDOW - c : MD5_MAX_BATCH;
+            for (j = 0; j < num; j++) {
+                s = motp_msgs[j] + MOTP_MAX_COUNTER;
+                value = i + c + j;
+                do {
+                    *--s = '0' + (char)(value % 10);
+                    value /= 10;
+                } while (value != 0);
+                msgs[j] = (const u_char *)s;
+                lens[j] = (motp_msgs[j] + MOTP_MAX_COUNTER - s) + motp_suffix_len;
+            }
+            md5_batch(msgs, lens, num, digests);
+            bench_sink += digests[0][0];
+        }
+    }
+    return iterations * MOTP_WINDOW;
+}
+
+/*
+ * Reverse index: the cost of finding the users whose tokens show an OTP given without a username, compared to
+ * computing every token's window, and how many users each OTP shown matches before the PIN is checked.
+ */
+static void
+bench_index(void)
+{
+    const int num_nodes = INDEX_USERS * INDEX_WINDOW;
+    u_char key[20];
+    long long elapsed;
+    double lookup;
+    long total = 0;
+    int multiple = 0;
+    int most = 0;
+    int num;
+    int i;
+    int j;
+
+    /* Give each user a random key */
+    srandom(4226);
+    index_keys = malloc(INDEX_USERS * sizeof(*index_keys));
+    index_values = malloc(num_nodes * sizeof(*index_values));
+    index_next = malloc(num_nodes * sizeof(*index_next));
+    for (index_mask = 1; index_mask < (u_int)num_nodes; index_mask <<= 1)
+        ;
+    index_buckets = malloc(index_mask * sizeof(*index_buckets));
+    index_mask--;
+    if (index_keys == NULL || index_values == NULL || index_next == NULL || index_buckets == NULL) {
+        fprintf(stderr, "otpbench: out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < INDEX_USERS; i++) {
+        for (j = 0; j < sizeof(key); j++)
+            key[j] = (u_char)random();
+        hmac_sha1_key_init(&index_keys[i], key, sizeof(key));
+    }
+
+    /* Index every token's window, as at each time step; without the index, each lookup costs this much */
+    elapsed = nanos();
+    index_build(time(NULL) / 30);
+    elapsed = nanos() - elapsed;
+    lookup = measure(index_lookup);
+    printf("  %d users, %d OTPs: index %8.1f ms, lookup %8.1f ns  (%.0fx)\n",
+      INDEX_USERS, num_nodes, elapsed / 1e6, lookup, elapsed / lookup);
+
+    /* Look up the OTPs shown by random users' tokens, counting the users each one matches */
+    for (i = 0; i < INDEX_SAMPLES; i++) {
+        num = index_candidates(index_values[random() % num_nodes]);
+        total += num;
+        if (num > 1)
+            multiple++;
+        if (num > most)
+            most = num;
+    }
+    printf("  candidates per OTP shown: %.3f average (%.3f expected), %.2f%% more than one, %d at most\n",
+      (double)total / INDEX_SAMPLES, 1 + (double)(INDEX_USERS - 1) * INDEX_WINDOW / 1e6,
+      100.0 * multiple / INDEX_SAMPLES, most);
+
+    free(index_keys);
+    free(index_values);
+    free(index_next);
+    free(index_buckets);
+}
+
+/*
+ * Compute the OTPs of every token's window at time step "step" in multi-buffer batches that mix the keys,
+ * and chain them by hash bucket, as otp_index_advance() does.
+ */
+static void
+index_build(long step)
+{
+    const struct hmac_sha1_key *keys[HMAC_SHA1_MAX_BATCH];
+    u_char hashes[HMAC_SHA1_MAX_BATCH][SHA1_DIGEST_LEN];
+    uint64_t counters[HMAC_SHA1_MAX_BATCH];
+    const int num_nodes = INDEX_USERS * INDEX_WINDOW;
+    const u_char *h;
+    u_int b;
+    int num;
+    int n;
+    int j;
+
+    memset(index_buckets, 0xff, (index_mask + 1) * sizeof(*index_buckets));
+    for (n = 0; n < num_nodes; n += num) {
+        num = num_nodes - n < HMAC_SHA1_MAX_BATCH ? num_nodes - n : HMAC_SHA1_MAX_BATCH;
+        for (j = 0; j < num; j++) {
+            keys[j] = &index_keys[(n + j) / INDEX_WINDOW];
+            counters[j] = (uint64_t)(step - 1 + (n + j) % INDEX_WINDOW);
+        }
+        hmac_sha1_multi_batch(keys, counters, num, hashes);
+        for (j = 0; j < num; j++) {
+            h = hashes[j] + (hashes[j][SHA1_DIGEST_LEN - 1] & 0x0f);
+            index_values[n + j] = (int)((((u_int)(h[0] & 0x7f) << 24) | ((u_int)h[1] << 16)
+              | ((u_int)h[2] << 8) | (u_int)h[3]) % 1000000);
+            b = index_bucket(index_values[n + j]);
+            index_next[n + j] = index_buckets[b];
+            index_buckets[b] = n + j;
+        }
+    }
+}
+
+static long
+index_lookup(long iterations)
+{
+    const int num_nodes = INDEX_USERS * INDEX_WINDOW;
+    long i;
+
+    for (i = 0; i < iterations; i++)
+        bench_sink += index_candidates(index_values[(u_long)i * 2654435761UL % num_nodes]);
+    return iterations;
+}
+
+/*
+ * Count the users whose tokens show "value", as otp_index_lookup() finds them.
+ */
+static int
+index_candidates(int value)
+{
+    int users[INDEX_MAX_CANDIDATES];
+    int num = 0;
+    int n;
+    int i;
+
+    for (n = index_buckets[index_bucket(value)]; n != -1 && num < INDEX_MAX_CANDIDATES; n = index_next[n]) {
+        if (index_values[n] != value)
+            continue;
+        for (i = 0; i < num && users[i] != n / INDEX_WINDOW; i++)
+            ;
+        if (i == num)
+            users[num++] = n / INDEX_WINDOW;
+    }
+    return num;
+}
+
+/*
+ * Get the hash bucket for a value, like otp_index_bucket().
+ */
+static u_int
+index_bucket(int value)
+{
+    u_int hash;
+
+    hash = ((u_int)value ^ ((u_int)INDEX_DIGITS << 27)) * 2654435761U;
+    return (hash ^ (hash >> 15)) & index_mask;
+}
+
+/*
+ * Format bytes as lowercase hex digits, like printhex().
+ */
+static void
+hex(char *buf, const u_char *data, size_t len)
+{
+    const char *hexdig = "0123456789abcdef";
+
+    while (len-- > 0) {
+        *buf++ = hexdig[*data >> 4];
+        *buf++ = hexdig[*data++ & 0x0f];
+    }
+    *buf = '\0';
+}
+
+/*
+ * Run a benchmark for at least MIN_NANOS, doubling the iterations until it does.
+ * Returns the nanoseconds per operation.
+ */
+static double
+measure(bench_t func)
+{
+    long long start;
+    long long elapsed;
+    long iterations;
+    long ops;
+
+    for (iterations = 64; ; iterations *= 2) {
+        start = nanos();
+        ops = (*func)(iterations);
+        if ((elapsed = nanos() - start) >= MIN_NANOS)
+            return (double)elapsed / ops;
+    }
+}
+
+static long long
+nanos(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
@@ -0,0 +1,280 @@
+/*
+ * mod_authn_otp - Apache module for one-time password authentication
+ *
+ * Copyright 2009 Archie L. Cobbs <archie@dellroad.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * $Id$
+ */
+
+/*
+ * Known answer tests for the internal SHA-1 and MD5 implementations (run by "make check").
+ * Every implementation this CPU supports is selected in turn and checked against the RFC 4226
+ * and RFC 1321 test vectors, and against OpenSSL for random keys, counters, and messages.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/md5.h>
+
+#include "cpu.h"
+#include "md5.h"
+#include "sha1.h"
+
+/* Number of random cases checked against OpenSSL for each implementation */
+#define NUM_RANDOM                  2000
+
+/* Longest random mOTP-like message */
+#define MAX_MESSAGE                 300
+
+/* Internal functions */
+static int          test_sha1(const char *name);
+static int          test_md5(const char *name);
+static uint32_t     truncate31(const u_char *hash);
+static void         random_bytes(u_char *buf, size_t len);
+
+/* Test vectors from RFC 4226, appendix D: 31 bit truncated values for counters 0..9 */
+static const char   rfc4226_key[] = "12345678901234567890";
+static const uint32_t rfc4226_values[] = {
+    1284755224, 1094287082, 137359152, 1726969429, 1640338314,
+    868254676, 1918287922, 82162583, 673399871, 645520489
+};
+
+/* Test vectors from RFC 1321, appendix A.5 */
+static const char   *const rfc1321_msgs[] = {
+    "",
+    "a",
+    "abc",
+    "message digest",
+    "abcdefghijklmnopqrstuvwxyz",
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+    "12345678901234567890123456789012345678901234567890123456789012345678901234567890",
+};
+static const char   *const rfc1321_digests[] = {
+    "d41d8cd98f00b204e9800998ecf8427e",
+    "0cc175b9c0f1b6a831c399e269772661",
+    "900150983cd24fb0d6963f7d28e17f72",
+    "f96b697d7cb7938d525a2f31aaf161d0",
+    "c3fcd3d76192e4007dfb496cca67e13b",
+    "d174ab98d277d9f5a5611c2c9f419d9f",
+    "57edf4a22be3c955ac49da2e2107b67a",
+};
+
+/* Sets of CPU features to disable, from none to all, so each implementation gets selected */
+static const int    disable_masks[] = {
+    0,
+    CPU_AVX512,
+    CPU_AVX512 | CPU_AVX2,
+    CPU_AVX512 | CPU_AVX2 | CPU_SHANI,
+};
+
+int
+main(int argc, char **argv)
+{
+    const char *last_sha1 = NULL;
+    const char *last_md5 = NULL;
+    const char *name;
+    int failures = 0;
+    int i;
+
+    srandom(4226);
+    for (i = 0; i < sizeof(disable_masks) / sizeof(*disable_masks); i++) {
+        cpu_disable(disable_masks[i]);
+
+        /* SHA-1 */
+        if ((name = hmac_sha1_select()) == NULL) {
+            fprintf(stderr, "FAIL: SHA-1 self-check failed with CPU features 0x%02x\n", cpu_features());
+            failures++;
+        } else if (last_sha1 == NULL || strcmp(name, last_sha1) != 0) {
+            failures += test_sha1(name);
+            last_sha1 = name;
+        }
+
+        /* MD5 */
+        if ((name = md5_select()) == NULL) {
+            fprintf(stderr, "FAIL: MD5 self-check failed with CPU features 0x%02x\n", cpu_features());
+            failures++;
+        } else if (last_md5 == NULL || strcmp(name, last_md5) != 0) {
+            failures += test_md5(name);
+            last_md5 = name;
+        }
+    }
+    return failures != 0 ? 1 : 0;
+}
+
+/*
+ * Check the selected SHA-1 implementation. Returns the number of failures.
+ */
+static int
+test_sha1(const char *name)
+{
+    const struct hmac_sha1_key *hkeys[HMAC_SHA1_MAX_BATCH * 2 + 3];
+    u_char hashes[HMAC_SHA1_MAX_BATCH * 2 + 3][SHA1_DIGEST_LEN];
+    uint64_t counters[HMAC_SHA1_MAX_BATCH * 2 + 3];
+    struct hmac_sha1_key keys[4];
+    u_char keybufs[4][100];
+    size_t keylens[4];
+    u_char expect[EVP_MAX_MD_SIZE];
+    u_char ctrbuf[8];
+    u_int len;
+    int failures = 0;
+    int count;
+    int i;
+    int j;
+    int k;
+
+    /* RFC 4226 values, one at a time and as batches of every size */
+    hmac_sha1_key_init(&keys[0], (const u_char *)rfc4226_key, sizeof(rfc4226_key) - 1);
+    for (i = 0; i < 10; i++) {
+        hmac_sha1_counter(&keys[0], i, hashes[0]);
+        if (truncate31(hashes[0]) != rfc4226_values[i]) {
+            fprintf(stderr, "FAIL: %s SHA-1: RFC 4226 counter %d\n", name, i);
+            failures++;
+        }
+    }
+    for (count = 1; count <= 10; count++) {
+        for (i = 0; i < count; i++)
+            counters[i] = 10 - count + i;
+        hmac_sha1_counter_batch(&keys[0], counters, count, hashes);
+        for (i = 0; i < count; i++) {
+            if (truncate31(hashes[i]) != rfc4226_values[10 - count + i]) {
+                fprintf(stderr, "FAIL: %s SHA-1: RFC 4226 counter %d in batch of %d\n", name, 10 - count + i, count);
+                failures++;
+            }
+        }
+    }
+
+    /* Random keys, including ones longer than a block, and counters, with lanes mixing the keys */
+    for (k = 0; k < NUM_RANDOM / HMAC_SHA1_MAX_BATCH; k++) {
+        for (i = 0; i < 4; i++) {
+            keylens[i] = 1 + random() % sizeof(keybufs[i]);
+            random_bytes(keybufs[i], keylens[i]);
+            hmac_sha1_key_init(&keys[i], keybufs[i], keylens[i]);
+        }
+        count = 1 + random() % (HMAC_SHA1_MAX_BATCH * 2 + 3);
+        for (i = 0; i < count; i++) {
+            hkeys[i] = &keys[random() % 4];
+            random_bytes(ctrbuf, sizeof(ctrbuf));
+            for (counters[i] = 0, j = 0; j < sizeof(ctrbuf); j++)
+                counters[i] = (counters[i] << 8) | ctrbuf[j];
+        }
+        hmac_sha1_multi_batch(hkeys, counters, count, hashes);
+        for (i = 0; i < count; i++) {
+            j = hkeys[i] - keys;
+            for (len = 0; len < sizeof(ctrbuf); len++)
+                ctrbuf[len] = (u_char)(counters[i] >> (56 - 8 * len));
+            HMAC(EVP_sha1(), keybufs[j], (int)keylens[j], ctrbuf, sizeof(ctrbuf), expect, &len);
+            if (memcmp(hashes[i], expect, SHA1_DIGEST_LEN) != 0) {
+                fprintf(stderr, "FAIL: %s SHA-1: random key length %d lane %d of %d differs from OpenSSL\n",
+                  name, (int)keylens[j], i, count);
+                failures++;
+            }
+        }
+    }
+    printf("%s: SHA-1 %s (%d lanes)\n", failures == 0 ? "PASS" : "FAIL", name, hmac_sha1_batch_size());
+    return failures;
+}
+
+/*
+ * Check the selected MD5 implementation. Returns the number of failures.
+ */
+static int
+test_md5(const char *name)
+{
+    const u_char *msgs[MD5_MAX_BATCH * 2 + 3];
+    u_char digests[MD5_MAX_BATCH * 2 + 3][MD5_DIGEST_LEN];
+    u_char bufs[MD5_MAX_BATCH * 2 + 3][MAX_MESSAGE];
+    size_t lens[MD5_MAX_BATCH * 2 + 3];
+    u_char expect[MD5_DIGEST_LENGTH];
+    char hex[MD5_DIGEST_LEN * 2 + 1];
+    int failures = 0;
+    int count;
+    int i;
+    int j;
+    int k;
+
+    /* RFC 1321 values, as one batch */
+    count = sizeof(rfc1321_msgs) / sizeof(*rfc1321_msgs);
+    for (i = 0; i < count; i++) {
+        msgs[i] = (const u_char *)rfc1321_msgs[i];
+        lens[i] = strlen(rfc1321_msgs[i]);
+    }
+    md5_batch(msgs, lens, count, digests);
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < MD5_DIGEST_LEN; j++)
+            sprintf(hex + 2 * j, "%02x", digests[i][j]);
+        if (strcmp(hex, rfc1321_digests[i]) != 0) {
+            fprintf(stderr, "FAIL: %s MD5: RFC 1321 message \"%s\"\n", name, rfc1321_msgs[i]);
+            failures++;
+        }
+    }
+
+    /* Random messages with lengths around the padding boundaries and up to a whole mOTP message */
+    for (k = 0; k < NUM_RANDOM / MD5_MAX_BATCH; k++) {
+        count = 1 + random() % (MD5_MAX_BATCH * 2 + 3);
+        for (i = 0; i < count; i++) {
+            switch (random() % 3) {
+            case 0:
+                lens[i] = 55 + random() % 10;
+                break;
+            case 1:
+                lens[i] = 119 + random() % 10;
+                break;
+            default:
+                lens[i] = random() % MAX_MESSAGE;
+                break;
+            }
+            random_bytes(bufs[i], lens[i]);
+            msgs[i] = bufs[i];
+        }
+        md5_batch(msgs, lens, count, digests);
+        for (i = 0; i < count; i++) {
+            MD5(msgs[i], lens[i], expect);
+            if (memcmp(digests[i], expect, MD5_DIGEST_LEN) != 0) {
+                fprintf(stderr, "FAIL: %s MD5: random message length %d lane %d of %d differs from OpenSSL\n",
+                  name, (int)lens[i], i, count);
+                failures++;
+            }
+        }
+    }
+    printf("%s: MD5 %s (%d lanes)\n", failures == 0 ? "PASS" : "FAIL", name, md5_batch_size());
+    return failures;
+}
+
+/*
+ * Extract the 31 bit HOTP value from an HMAC-SHA1 hash (RFC 4226, section 5.3).
+ */
+static uint32_t
+truncate31(const u_char *hash)
+{
+    const int offset = hash[SHA1_DIGEST_LEN - 1] & 0x0f;
+
+    return ((uint32_t)(hash[offset] & 0x7f) << 24) | ((uint32_t)hash[offset + 1] << 16)
+      | ((uint32_t)hash[offset + 2] << 8) | (uint32_t)hash[offset + 3];
+}
+
+static void
+random_bytes(u_char *buf, size_t len)
+{
+    while (len-- > 0)
+        *buf++ = (u_char)random();
+}
@@ -25,15 +25,22 @@
 #define OTP_BUF_SIZE       16
 
 /* Internal functions */
+static int          otp_matches(const char *otp, int value, struct motp_key *mkey, u_long counter, int ndigits);
+static int          otp_matches_next(const char *otp2, struct hotp_key *hkey, struct motp_key *mkey, u_long counter, int ndigits);
 static void         usage(void);
 
 int
 main(int argc, char **argv)
 {
     const char *otp = NULL;
+    const char *otp2 = NULL;
     const char *key = NULL;
     const char *motp_pin = NULL;
     unsigned char keybuf[128];
+    struct hotp_key hkey;
+    struct motp_key mkey;
+    u_long counters[2 * HMAC_SHA1_MAX_BATCH];
+    int values[2 * HMAC_SHA1_MAX_BATCH];
     char otpbuf10[OTP_BUF_SIZE];
     char otpbuf16[OTP_BUF_SIZE];
     size_t keylen;
@@ -45,8 +52,11 @@ main(int argc, char **argv)
     int counter = -1;
     int use_time = 0;
     int window = 0;
+    int batch;
+    int num;
     int ch;
     int i;
+    int j;
 
     /* Parse command line */
     while ((ch = getopt(argc, argv, "c:d:fhi:m:tvw:")) != -1) {
@@ -96,12 +106,17 @@ main(int argc, char **argv)
 
     /* Parse command line arguments */
     switch (argc - optind) {
+    case 3:
+        otp2 = argv[optind + 2];
+        // FALLTHROUGH
     case 2:
         otp = argv[optind + 1];
         if (ndigits == -1)
             ndigits = strlen(otp);
         if (strlen(otp) != ndigits)
             errx(EXIT_NOT_MATCHED, "the given OTP `%s' has the wrong length %d != %d", otp, (int)strlen(otp), ndigits);
+        if (otp2 != NULL && strlen(otp2) != ndigits)
+            errx(EXIT_NOT_MATCHED, "the given OTP `%s' has the wrong length %d != %d", otp2, (int)strlen(otp2), ndigits);
         // FALLTHROUGH
     case 1:
         key = argv[optind];
@@ -145,13 +160,21 @@ main(int argc, char **argv)
         }
     }
 
+    /* Precompute HMAC state or mOTP message */
+    if (motp_pin != NULL)
+        motp_key_init(&mkey, keybuf, keylen, motp_pin);
+    else if (hotp_key_init(&hkey, keybuf, keylen) != 0)
+        errx(EXIT_SYSTEM_ERROR, "error initializing HMAC state");
+
     /* Determine target counter */
     if (use_time)
         counter = time(NULL) / time_interval;
     else if (counter < 0)
         counter = 0;
 
-    /* Search or generate */
+    /* Search or generate; HOTP values are computed in batches */
+    batch = motp_pin == NULL ? HMAC_SHA1_MAX_BATCH : 1;
+    memset(values, 0, sizeof(values));
     if (otp == NULL) {
         if (use_time) {
             counter_start = counter - window;
@@ -160,51 +183,104 @@ main(int argc, char **argv)
             counter_start = counter;
             counter_stop = counter + window;
         }
-        for (counter = counter_start; counter <= counter_stop; counter++) {
-            if (motp_pin != NULL)
-                motp(keybuf, keylen, motp_pin, counter, ndigits, otpbuf16, OTP_BUF_SIZE);
-            else
-                hotp(keybuf, keylen, counter, ndigits, otpbuf10, otpbuf16, OTP_BUF_SIZE);
-            printf("%d: %s%s%s\n", counter, otpbuf10, *otpbuf10 != '\0' && *otpbuf16 != '\0' ? " " : "", otpbuf16);
+        for (counter = counter_start; counter <= counter_stop; counter += num) {
+            num = counter_stop - counter < batch - 1 ? counter_stop - counter + 1 : batch;
+            if (motp_pin == NULL) {
+                for (i = 0; i < num; i++)
+                    counters[i] = counter + i;
+                hotp_values(&hkey, counters, num, values);
+            }
+            for (i = 0; i < num; i++) {
+                if (motp_pin != NULL)
+                    motp(&mkey, counter + i, ndigits, otpbuf16, OTP_BUF_SIZE);
+                else
+                    hotp_format(values[i], ndigits, otpbuf10, otpbuf16, OTP_BUF_SIZE);
+                printf("%d: %s%s%s\n", counter + i, otpbuf10, *otpbuf10 != '\0' && *otpbuf16 != '\0' ? " " : "", otpbuf16);
+            }
         }
         return 0;
     } else {
-        for (i = 0; i <= window; i++) {
+        for (i = 0; i <= window; i += num) {
             int try;
 
-            try = counter + i;
-            if (motp_pin != NULL)
-                motp(keybuf, keylen, motp_pin, try, ndigits, otpbuf16, OTP_BUF_SIZE);
-            else
-                hotp(keybuf, keylen, try, ndigits, otpbuf10, otpbuf16, OTP_BUF_SIZE);
-            if (strcasecmp(otp, otpbuf10) == 0 || strcasecmp(otp, otpbuf16) == 0)
-                goto match;
-            if (use_time && i != 0) {
-                try = counter - i;
-                if (motp_pin != NULL)
-                    motp(keybuf, keylen, motp_pin, try, ndigits, otpbuf16, OTP_BUF_SIZE);
-                else
-                    hotp(keybuf, keylen, try, ndigits, otpbuf10, otpbuf16, OTP_BUF_SIZE);
-                if (strcasecmp(otp, otpbuf10) == 0 || strcasecmp(otp, otpbuf16) == 0)
+            /* Compute values for counter + i ... and (if time-based) counter - i ... */
+            num = window - i < batch - 1 ? window - i + 1 : batch;
+            if (motp_pin == NULL) {
+                for (j = 0; j < num; j++) {
+                    counters[j] = counter + i + j;
+                    counters[num + j] = counter - (i + j);
+                }
+                hotp_values(&hkey, counters, use_time ? 2 * num : num, values);
+            }
+
+            /* Check them in order */
+            for (j = 0; j < num; j++) {
+                try = counter + i + j;
+                if (otp_matches(otp, values[j], motp_pin != NULL ? &mkey : NULL, try, ndigits)
+                  && otp_matches_next(otp2, &hkey, motp_pin != NULL ? &mkey : NULL, try, ndigits))
                     goto match;
+                if (use_time && i + j != 0) {
+                    try = counter - (i + j);
+                    if (otp_matches(otp, values[num + j], motp_pin != NULL ? &mkey : NULL, try, ndigits)
+                      && otp_matches_next(otp2, &hkey, motp_pin != NULL ? &mkey : NULL, try, ndigits))
+                        goto match;
+                }
             }
             continue;
 match:
-            printf("%d\n", try);
+            printf("%d\n", otp2 != NULL ? try + 1 : try);
             return 0;
         }
     }
 
     /* Not found */
-    fprintf(stderr, "one-time password \"%s\" was not found within the counter range %d ... %d\n", otp,
-      use_time ? counter - window : counter, counter + window);
+    if (otp2 != NULL) {
+        fprintf(stderr, "one-time passwords \"%s\" \"%s\" were not found within the counter range %d ... %d\n", otp, otp2,
+          use_time ? counter - window : counter, counter + window);
+    } else {
+        fprintf(stderr, "one-time password \"%s\" was not found within the counter range %d ... %d\n", otp,
+          use_time ? counter - window : counter, counter + window);
+    }
     return EXIT_NOT_MATCHED;
 }
 
+/*
+ * Compare the given OTP against an HOTP value, or (if "mkey" is not NULL) compute and compare the Mobile-OTP value.
+ */
+static int
+otp_matches(const char *otp, int value, struct motp_key *mkey, u_long counter, int ndigits)
+{
+    char otpbuf10[OTP_BUF_SIZE];
+    char otpbuf16[OTP_BUF_SIZE];
+
+    if (mkey != NULL) {
+        motp(mkey, counter, ndigits, otpbuf16, OTP_BUF_SIZE);
+        return strcasecmp(otp, otpbuf16) == 0;
+    }
+    hotp_format(value, ndigits, otpbuf10, otpbuf16, OTP_BUF_SIZE);
+    return strcasecmp(otp, otpbuf10) == 0 || strcasecmp(otp, otpbuf16) == 0;
+}
+
+/*
+ * If a second OTP was given, compare it against the OTP for the counter following "counter".
+ */
+static int
+otp_matches_next(const char *otp2, struct hotp_key *hkey, struct motp_key *mkey, u_long counter, int ndigits)
+{
+    int value = 0;
+
+    if (otp2 == NULL)
+        return 1;
+    counter++;
+    if (mkey == NULL)
+        hotp_values(hkey, &counter, 1, &value);
+    return otp_matches(otp2, value, mkey, counter, ndigits);
+}
+
 static void
 usage()
 {
-    fprintf(stderr, "Usage: %s [-fht] [-c counter] [-d digits] [-i interval] [-m PIN] [-w window] key [otp]\n", PROG_NAME);
+    fprintf(stderr, "Usage: %s [-fht] [-c counter] [-d digits] [-i interval] [-m PIN] [-w window] key [otp [next-otp]]\n", PROG_NAME);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -c\tSpecify the initial counter value (conflicts with `-t')\n");
     fprintf(stderr, "  -f\t`key' refers to the file containing the key\n");
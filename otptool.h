@@ -60,6 +60,10 @@
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
 #include <openssl/md5.h>
+#include <openssl/sha.h>
+
+#include "md5.h"
+#include "sha1.h"
 
 /* Program name */
 #define PROG_NAME                   "otptool"
@@ -74,11 +78,32 @@
 #define DEFAULT_TIME_INTERVAL       30
 #define DEFAULT_WINDOW              0
 
+/* mOTP message: decimal counter, hex key, and PIN, truncated to MOTP_MAX_MESSAGE bytes */
+#define MOTP_MAX_MESSAGE            255
+#define MOTP_MAX_COUNTER            20          /* decimal digits in a 64 bit counter */
+
+/* Precomputed HMAC-SHA1 key state */
+struct hotp_key {
+    struct hmac_sha1_key state;             /* inner and outer states for the internal SHA-1 */
+    EVP_MD_CTX      *ictx;                  /* inner hash state after absorbing (key ^ ipad), or NULL if internal */
+    EVP_MD_CTX      *octx;                  /* outer hash state after absorbing (key ^ opad), or NULL if internal */
+};
+
+/* Precomputed mOTP message; holds room for the counter followed by the suffix */
+struct motp_key {
+    char            msg[MOTP_MAX_COUNTER + MOTP_MAX_MESSAGE + 1];
+    int             suffix_len;             /* length of hex key plus PIN */
+};
+
 /* hotp.c */
-extern void         hotp(const u_char *key, size_t keylen, u_long counter, int ndigits, char *buf10, char *buf16, size_t buflen);
+extern int          hotp_key_init(struct hotp_key *hkey, const u_char *key, size_t keylen);
+extern void         hotp(const struct hotp_key *hkey, u_long counter, int ndigits, char *buf10, char *buf16, size_t buflen);
+extern void         hotp_values(const struct hotp_key *hkey, const u_long *counters, int count, int *values);
+extern void         hotp_format(int value, int ndigits, char *buf10, char *buf16, size_t buflen);
 
 /* motp.c */
-extern void         motp(const u_char *key, size_t keylen, const char *pin, u_long counter, int ndigits, char *buf, size_t buflen);
+extern void         motp_key_init(struct motp_key *mkey, const u_char *key, size_t keylen, const char *pin);
+extern void         motp(struct motp_key *mkey, u_long counter, int ndigits, char *buf, size_t buflen);
 
 /* phex.c */
 extern void         printhex(char *buf, size_t buflen, const u_char *data, size_t dlen, int max_digits);
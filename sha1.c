@@ -0,0 +1,788 @@
+
+/*
+ * mod_authn_otp - Apache module for one-time password authentication
+ *
+ * Copyright 2009 Archie L. Cobbs <archie@dellroad.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * $Id$
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "cpu.h"
+#include "sha1.h"
+
+#if CPU_X86
+#include <immintrin.h>
+#endif
+
+/* HMAC pads, as 32 bit words */
+#define HMAC_IPAD_WORD              0x36363636
+#define HMAC_OPAD_WORD              0x5c5c5c5c
+
+/* Rotate left */
+#define ROL(x, n)                   (((x) << (n)) | ((x) >> (32 - (n))))
+
+/* Compression function: update state with one block given as sixteen big-endian message words */
+typedef void (*sha1_compress_t)(uint32_t *state, const uint32_t *words);
+
+/* Multi-buffer HMAC: compute the HMACs of up to one lane's worth of counters, each under its own key */
+typedef void (*hmac_sha1_batch_t)(const struct hmac_sha1_key *const *hkeys, const uint64_t *counters, int count,
+    u_char (*hashes)[SHA1_DIGEST_LEN]);
+
+/* Internal functions */
+static void         sha1_compress_generic(uint32_t *state, const uint32_t *words);
+#if CPU_X86
+static void         sha1_compress_shani(uint32_t *state, const uint32_t *words);
+static void         hmac_sha1_batch_avx2(const struct hmac_sha1_key *const *hkeys, const uint64_t *counters,
+                        int count, u_char (*hashes)[SHA1_DIGEST_LEN]);
+static void         hmac_sha1_batch_avx512(const struct hmac_sha1_key *const *hkeys, const uint64_t *counters,
+                        int count, u_char (*hashes)[SHA1_DIGEST_LEN]);
+#endif
+static void         sha1_hash(const u_char *data, size_t len, u_char *digest);
+static void         sha1_decode(uint32_t *words, const u_char *data, int nwords);
+static void         sha1_encode(u_char *data, const uint32_t *words, int nwords);
+static int          hmac_sha1_self_check(void);
+static int          hmac_sha1_batch_self_check(void);
+static int          hmac_sha1_multi_self_check(void);
+
+/* SHA-1 initial hash value */
+static const uint32_t sha1_iv[SHA1_STATE_WORDS] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+
+/* Test vectors from RFC 4226, appendix D: 31 bit truncated values for counters 0..9 */
+static const char   rfc4226_key[] = "12345678901234567890";
+static const uint32_t rfc4226_values[] = {
+    1284755224, 1094287082, 137359152, 1726969429, 1640338314,
+    868254676, 1918287922, 82162583, 673399871, 645520489
+};
+
+/* The selected compression function */
+static sha1_compress_t sha1_compress = sha1_compress_generic;
+
+/* The selected multi-buffer HMAC function and its number of lanes, if any */
+static hmac_sha1_batch_t hmac_sha1_batch;
+static int          hmac_sha1_lanes = 1;
+
+/*
+ * Select the fastest SHA-1 compression function supported by this CPU that passes
+ * the RFC 4226 self-check. This should be invoked once at startup, before any other
+ * threads are using this code.
+ *
+ * Returns the name of the selected implementation, or NULL if the self-check failed.
+ */
+const char *
+hmac_sha1_select(void)
+{
+    const char *name = NULL;
+#if CPU_X86
+    const int features = cpu_features();
+
+    /* Single-buffer compression function */
+    if ((features & CPU_SHANI) != 0) {
+        sha1_compress = sha1_compress_shani;
+        if (hmac_sha1_self_check() == 0)
+            name = "SHA-NI";
+    }
+#endif
+    if (name == NULL) {
+        sha1_compress = sha1_compress_generic;
+        if (hmac_sha1_self_check() != 0)
+            return NULL;
+        name = "generic";
+    }
+
+    /* Multi-buffer HMAC for hmac_sha1_counter_batch() */
+    hmac_sha1_batch = NULL;
+    hmac_sha1_lanes = 1;
+#if CPU_X86
+    if ((features & CPU_AVX512) != 0) {
+        hmac_sha1_batch = hmac_sha1_batch_avx512;
+        hmac_sha1_lanes = 16;
+        if (hmac_sha1_batch_self_check() == 0 && hmac_sha1_multi_self_check() == 0)
+            return (features & CPU_SHANI) != 0 ? "SHA-NI+AVX-512" : "generic+AVX-512";
+    }
+    if ((features & CPU_AVX2) != 0) {
+        hmac_sha1_batch = hmac_sha1_batch_avx2;
+        hmac_sha1_lanes = 8;
+        if (hmac_sha1_batch_self_check() == 0 && hmac_sha1_multi_self_check() == 0)
+            return (features & CPU_SHANI) != 0 ? "SHA-NI+AVX2" : "generic+AVX2";
+    }
+    hmac_sha1_batch = NULL;
+    hmac_sha1_lanes = 1;
+#endif
+    return name;
+}
+
+/*
+ * Get the number of counters hmac_sha1_counter_batch() computes in parallel.
+ * Returns 1 if there is no multi-buffer implementation for this CPU.
+ */
+int
+hmac_sha1_batch_size(void)
+{
+    return hmac_sha1_lanes;
+}
+
+/*
+ * Precompute the HMAC-SHA1 inner and outer states for a key.
+ */
+void
+hmac_sha1_key_init(struct hmac_sha1_key *hkey, const u_char *key, size_t keylen)
+{
+    u_char keybuf[SHA1_BLOCK_LEN];
+    uint32_t words[SHA1_BLOCK_LEN / 4];
+    int i;
+
+    /* Keys longer than the block size are hashed first (RFC 2104) */
+    memset(keybuf, 0, sizeof(keybuf));
+    if (keylen > sizeof(keybuf))
+        sha1_hash(key, keylen, keybuf);
+    else
+        memcpy(keybuf, key, keylen);
+    sha1_decode(words, keybuf, SHA1_BLOCK_LEN / 4);
+
+    /* Compress (key ^ ipad) and (key ^ opad) */
+    for (i = 0; i < SHA1_BLOCK_LEN / 4; i++)
+        words[i] ^= HMAC_IPAD_WORD;
+    memcpy(hkey->istate, sha1_iv, sizeof(hkey->istate));
+    (*sha1_compress)(hkey->istate, words);
+    for (i = 0; i < SHA1_BLOCK_LEN / 4; i++)
+        words[i] ^= HMAC_IPAD_WORD ^ HMAC_OPAD_WORD;
+    memcpy(hkey->ostate, sha1_iv, sizeof(hkey->ostate));
+    (*sha1_compress)(hkey->ostate, words);
+}
+
+/*
+ * Compute HMAC-SHA1 of an eight byte big-endian counter. Both the inner and outer messages
+ * fit in a single padded block, so this is exactly two compressions.
+ */
+void
+hmac_sha1_counter(const struct hmac_sha1_key *hkey, uint64_t counter, u_char *hash)
+{
+    uint32_t words[SHA1_BLOCK_LEN / 4];
+    uint32_t state[SHA1_STATE_WORDS];
+
+    /* Inner: counter, padding, and length of ipad block plus counter in bits */
+    memset(words, 0, sizeof(words));
+    words[0] = (uint32_t)(counter >> 32);
+    words[1] = (uint32_t)counter;
+    words[2] = 0x80000000;
+    words[15] = (SHA1_BLOCK_LEN + 8) * 8;
+    memcpy(state, hkey->istate, sizeof(state));
+    (*sha1_compress)(state, words);
+
+    /* Outer: inner digest, padding, and length of opad block plus digest in bits */
+    memcpy(words, state, sizeof(state));
+    words[SHA1_STATE_WORDS] = 0x80000000;
+    words[15] = (SHA1_BLOCK_LEN + SHA1_DIGEST_LEN) * 8;
+    memcpy(state, hkey->ostate, sizeof(state));
+    (*sha1_compress)(state, words);
+
+    /* Output digest */
+    sha1_encode(hash, state, SHA1_STATE_WORDS);
+}
+
+/*
+ * Compute HMAC-SHA1 of several eight byte counters under the same key. Up to
+ * hmac_sha1_batch_size() counters are computed in parallel in separate vector lanes.
+ */
+void
+hmac_sha1_counter_batch(const struct hmac_sha1_key *hkey, const uint64_t *counters, int count,
+    u_char (*hashes)[SHA1_DIGEST_LEN])
+{
+    const struct hmac_sha1_key *hkeys[HMAC_SHA1_MAX_BATCH];
+    int num;
+    int i;
+
+    if (hmac_sha1_batch == NULL) {
+        for (i = 0; i < count; i++)
+            hmac_sha1_counter(hkey, counters[i], hashes[i]);
+        return;
+    }
+    for (i = 0; i < hmac_sha1_lanes; i++)
+        hkeys[i] = hkey;
+    for (i = 0; i < count; i += num) {
+        num = count - i < hmac_sha1_lanes ? count - i : hmac_sha1_lanes;
+        (*hmac_sha1_batch)(hkeys, counters + i, num, hashes + i);
+    }
+}
+
+/*
+ * Compute HMAC-SHA1 of several eight byte counters, each under its own key. This is the same
+ * as hmac_sha1_counter_batch() except that lanes are not tied to one key, so the counters of
+ * several keys can share a batch instead of each key leaving a partially filled one.
+ */
+void
+hmac_sha1_multi_batch(const struct hmac_sha1_key *const *hkeys, const uint64_t *counters, int count,
+    u_char (*hashes)[SHA1_DIGEST_LEN])
+{
+    int num;
+    int i;
+
+    if (hmac_sha1_batch == NULL) {
+        for (i = 0; i < count; i++)
+            hmac_sha1_counter(hkeys[i], counters[i], hashes[i]);
+        return;
+    }
+    for (i = 0; i < count; i += num) {
+        num = count - i < hmac_sha1_lanes ? count - i : hmac_sha1_lanes;
+        (*hmac_sha1_batch)(hkeys + i, counters + i, num, hashes + i);
+    }
+}
+
+/*
+ * Verify the selected compression function using the RFC 4226 test vectors.
+ * Returns 0 if successful, else -1.
+ */
+static int
+hmac_sha1_self_check(void)
+{
+    struct hmac_sha1_key hkey;
+    u_char hash[SHA1_DIGEST_LEN];
+    uint32_t value;
+    int offset;
+    int i;
+
+    hmac_sha1_key_init(&hkey, (const u_char *)rfc4226_key, sizeof(rfc4226_key) - 1);
+    for (i = 0; i < sizeof(rfc4226_values) / sizeof(*rfc4226_values); i++) {
+        hmac_sha1_counter(&hkey, i, hash);
+        offset = hash[SHA1_DIGEST_LEN - 1] & 0x0f;
+        value = ((uint32_t)(hash[offset] & 0x7f) << 24) | ((uint32_t)hash[offset + 1] << 16)
+          | ((uint32_t)hash[offset + 2] << 8) | (uint32_t)hash[offset + 3];
+        if (value != rfc4226_values[i])
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Verify the selected multi-buffer HMAC function using the RFC 4226 test vectors,
+ * including a partially filled batch. Returns 0 if successful, else -1.
+ */
+static int
+hmac_sha1_batch_self_check(void)
+{
+    const int num = sizeof(rfc4226_values) / sizeof(*rfc4226_values);
+    u_char hashes[sizeof(rfc4226_values) / sizeof(*rfc4226_values)][SHA1_DIGEST_LEN];
+    uint64_t counters[sizeof(rfc4226_values) / sizeof(*rfc4226_values)];
+    struct hmac_sha1_key hkey;
+    uint32_t value;
+    int offset;
+    int i;
+
+    hmac_sha1_key_init(&hkey, (const u_char *)rfc4226_key, sizeof(rfc4226_key) - 1);
+    for (i = 0; i < num; i++)
+        counters[i] = i;
+    hmac_sha1_counter_batch(&hkey, counters, num, hashes);
+    for (i = 0; i < num; i++) {
+        offset = hashes[i][SHA1_DIGEST_LEN - 1] & 0x0f;
+        value = ((uint32_t)(hashes[i][offset] & 0x7f) << 24) | ((uint32_t)hashes[i][offset + 1] << 16)
+          | ((uint32_t)hashes[i][offset + 2] << 8) | (uint32_t)hashes[i][offset + 3];
+        if (value != rfc4226_values[i])
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Verify the selected multi-buffer HMAC function with lanes alternating between two keys
+ * against the single-buffer results. Returns 0 if successful, else -1.
+ */
+static int
+hmac_sha1_multi_self_check(void)
+{
+    const struct hmac_sha1_key *hkeys[HMAC_SHA1_MAX_BATCH + 3];
+    u_char hashes[HMAC_SHA1_MAX_BATCH + 3][SHA1_DIGEST_LEN];
+    uint64_t counters[HMAC_SHA1_MAX_BATCH + 3];
+    struct hmac_sha1_key hkey[2];
+    u_char hash[SHA1_DIGEST_LEN];
+    int i;
+
+    hmac_sha1_key_init(&hkey[0], (const u_char *)rfc4226_key, sizeof(rfc4226_key) - 1);
+    hmac_sha1_key_init(&hkey[1], (const u_char *)rfc4226_key, 10);
+    for (i = 0; i < HMAC_SHA1_MAX_BATCH + 3; i++) {
+        hkeys[i] = &hkey[i % 3 == 0];
+        counters[i] = i * 0x100000001ULL;
+    }
+    hmac_sha1_multi_batch(hkeys, counters, HMAC_SHA1_MAX_BATCH + 3, hashes);
+    for (i = 0; i < HMAC_SHA1_MAX_BATCH + 3; i++) {
+        hmac_sha1_counter(hkeys[i], counters[i], hash);
+        if (memcmp(hash, hashes[i], SHA1_DIGEST_LEN) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Compute the SHA-1 digest of an arbitrary message (used for long HMAC keys).
+ */
+static void
+sha1_hash(const u_char *data, size_t len, u_char *digest)
+{
+    uint32_t state[SHA1_STATE_WORDS];
+    uint32_t words[SHA1_BLOCK_LEN / 4];
+    u_char tail[SHA1_BLOCK_LEN * 2];
+    uint64_t bits = (uint64_t)len * 8;
+    size_t tail_len;
+    size_t off;
+    int i;
+
+    /* Compress full blocks */
+    memcpy(state, sha1_iv, sizeof(state));
+    for (off = 0; len - off >= SHA1_BLOCK_LEN; off += SHA1_BLOCK_LEN) {
+        sha1_decode(words, data + off, SHA1_BLOCK_LEN / 4);
+        (*sha1_compress)(state, words);
+    }
+
+    /* Pad remainder and append length */
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, data + off, len - off);
+    tail[len - off] = 0x80;
+    tail_len = len - off + 1 + 8 <= SHA1_BLOCK_LEN ? SHA1_BLOCK_LEN : SHA1_BLOCK_LEN * 2;
+    for (i = 1; i <= 8; i++) {
+        tail[tail_len - i] = (u_char)bits;
+        bits >>= 8;
+    }
+    for (off = 0; off < tail_len; off += SHA1_BLOCK_LEN) {
+        sha1_decode(words, tail + off, SHA1_BLOCK_LEN / 4);
+        (*sha1_compress)(state, words);
+    }
+    sha1_encode(digest, state, SHA1_STATE_WORDS);
+}
+
+static void
+sha1_decode(uint32_t *words, const u_char *data, int nwords)
+{
+    int i;
+
+    for (i = 0; i < nwords; i++, data += 4)
+        words[i] = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | (uint32_t)data[3];
+}
+
+static void
+sha1_encode(u_char *data, const uint32_t *words, int nwords)
+{
+    int i;
+
+    for (i = 0; i < nwords; i++, data += 4) {
+        data[0] = (u_char)(words[i] >> 24);
+        data[1] = (u_char)(words[i] >> 16);
+        data[2] = (u_char)(words[i] >> 8);
+        data[3] = (u_char)words[i];
+    }
+}
+
+/*
+ * SHA-1 round structure, shared by the scalar and multi-buffer compression functions.
+ * Each implementation defines ADD(), ROTL(), XOR4(), F1(), F2(), and F3() over its word
+ * type, and provides the message schedule in "w" and round constants in k1 ... k4.
+ */
+#define W(i)                        (w[(i) & 15] = ROTL(XOR4(w[((i) + 13) & 15], w[((i) + 8) & 15], \
+                                      w[((i) + 2) & 15], w[(i) & 15]), 1))
+#define R(a, b, c, d, e, f, k, x)   do {                                                    \
+                                        e = ADD(ADD(e, ROTL(a, 5)), ADD(f(b, c, d), ADD(k, x)));  \
+                                        b = ROTL(b, 30);                                    \
+                                    } while (0)
+#define R0(a, b, c, d, e, i)        R(a, b, c, d, e, F1, k1, w[i])
+#define R1(a, b, c, d, e, i)        R(a, b, c, d, e, F1, k1, W(i))
+#define R2(a, b, c, d, e, i)        R(a, b, c, d, e, F2, k2, W(i))
+#define R3(a, b, c, d, e, i)        R(a, b, c, d, e, F3, k3, W(i))
+#define R4(a, b, c, d, e, i)        R(a, b, c, d, e, F2, k4, W(i))
+#define R5(r, a, b, c, d, e, i)     do {                                                    \
+                                        r(a, b, c, d, e, (i));                              \
+                                        r(e, a, b, c, d, (i) + 1);                          \
+                                        r(d, e, a, b, c, (i) + 2);                          \
+                                        r(c, d, e, a, b, (i) + 3);                          \
+                                        r(b, c, d, e, a, (i) + 4);                          \
+                                    } while (0)
+#define SHA1_ROUNDS(a, b, c, d, e)  do {                                                    \
+                                        R5(R0, a, b, c, d, e, 0);                           \
+                                        R5(R0, a, b, c, d, e, 5);                           \
+                                        R5(R0, a, b, c, d, e, 10);                          \
+                                        R0(a, b, c, d, e, 15);                              \
+                                        R1(e, a, b, c, d, 16);                              \
+                                        R1(d, e, a, b, c, 17);                              \
+                                        R1(c, d, e, a, b, 18);                              \
+                                        R1(b, c, d, e, a, 19);                              \
+                                        R5(R2, a, b, c, d, e, 20);                          \
+                                        R5(R2, a, b, c, d, e, 25);                          \
+                                        R5(R2, a, b, c, d, e, 30);                          \
+                                        R5(R2, a, b, c, d, e, 35);                          \
+                                        R5(R3, a, b, c, d, e, 40);                          \
+                                        R5(R3, a, b, c, d, e, 45);                          \
+                                        R5(R3, a, b, c, d, e, 50);                          \
+                                        R5(R3, a, b, c, d, e, 55);                          \
+                                        R5(R4, a, b, c, d, e, 60);                          \
+                                        R5(R4, a, b, c, d, e, 65);                          \
+                                        R5(R4, a, b, c, d, e, 70);                          \
+                                        R5(R4, a, b, c, d, e, 75);                          \
+                                    } while (0)
+
+/*
+ * Portable SHA-1 compression function (FIPS 180-4). The message schedule is kept in a
+ * sixteen word circular buffer and the rounds are fully unrolled.
+ */
+#define ADD(x, y)                   ((x) + (y))
+#define ROTL(x, n)                  ROL(x, n)
+#define XOR4(w, x, y, z)            ((w) ^ (x) ^ (y) ^ (z))
+#define F1(b, c, d)                 ((d) ^ ((b) & ((c) ^ (d))))
+#define F2(b, c, d)                 ((b) ^ (c) ^ (d))
+#define F3(b, c, d)                 (((b) & (c)) | ((d) & ((b) | (c))))
+
+static void
+sha1_compress_generic(uint32_t *state, const uint32_t *words)
+{
+    const uint32_t k1 = 0x5a827999;
+    const uint32_t k2 = 0x6ed9eba1;
+    const uint32_t k3 = 0x8f1bbcdc;
+    const uint32_t k4 = 0xca62c1d6;
+    uint32_t w[16];
+    uint32_t a, b, c, d, e;
+
+    memcpy(w, words, sizeof(w));
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    SHA1_ROUNDS(a, b, c, d, e);
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+#undef ADD
+#undef ROTL
+#undef XOR4
+#undef F1
+#undef F2
+#undef F3
+
+#if CPU_X86
+
+/*
+ * SHA-1 compression function using the x86 SHA extensions.
+ */
+__attribute__((target("sha,sse4.1")))
+static void
+sha1_compress_shani(uint32_t *state, const uint32_t *words)
+{
+    __m128i abcd, abcd_save, e0, e0_save, e1;
+    __m128i msg0, msg1, msg2, msg3;
+
+    /* Load state and message words; the instructions expect word zero in the most significant lane */
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1b);
+    e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+    abcd_save = abcd;
+    e0_save = e0;
+    msg0 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(words + 0)), 0x1b);
+    msg1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(words + 4)), 0x1b);
+    msg2 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(words + 8)), 0x1b);
+    msg3 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(words + 12)), 0x1b);
+
+    /* Rounds 0-3 */
+    e0 = _mm_add_epi32(e0, msg0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+    /* Rounds 4-7 */
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+    /* Rounds 8-11 */
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    /* Rounds 12-15 */
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    /* Rounds 16-19 */
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    /* Rounds 20-23 */
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    /* Rounds 24-27 */
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    /* Rounds 28-31 */
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    /* Rounds 32-35 */
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    /* Rounds 36-39 */
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    /* Rounds 40-43 */
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    /* Rounds 44-47 */
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    /* Rounds 48-51 */
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    /* Rounds 52-55 */
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    /* Rounds 56-59 */
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    /* Rounds 60-63 */
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    /* Rounds 64-67 */
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    /* Rounds 68-71 */
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    /* Rounds 72-75 */
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+    /* Rounds 76-79 */
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+    /* Add this block's result to the state */
+    e0 = _mm_sha1nexte_epu32(e0, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+/*
+ * Multi-buffer HMAC-SHA1 over eight byte counters. Each vector lane holds one message
+ * and its own key state; the inner and outer blocks are built directly in transposed
+ * form. Lanes beyond "count" repeat the last counter and key and are discarded.
+ */
+#define HMAC_SHA1_BATCH(VEC, LANES)                                                        \
+    const VEC k1 = SET1(0x5a827999);                                                        \
+    const VEC k2 = SET1(0x6ed9eba1);                                                        \
+    const VEC k3 = SET1(0x8f1bbcdc);                                                        \
+    const VEC k4 = SET1(0xca62c1d6);                                                        \
+    uint32_t hi[LANES];                                                                     \
+    uint32_t lo[LANES];                                                                     \
+    uint32_t istate[SHA1_STATE_WORDS][LANES];                                               \
+    uint32_t ostate[SHA1_STATE_WORDS][LANES];                                               \
+    uint32_t out[SHA1_STATE_WORDS][LANES];                                                  \
+    VEC state[SHA1_STATE_WORDS];                                                            \
+    VEC w[16];                                                                              \
+    VEC a, b, c, d, e;                                                                      \
+    int i;                                                                                  \
+    int j;                                                                                  \
+                                                                                            \
+    /* Inner block: counter, padding, and length of ipad block plus counter in bits */      \
+    for (i = 0; i < LANES; i++) {                                                           \
+        const struct hmac_sha1_key *const hkey = hkeys[i < count ? i : count - 1];          \
+        const uint64_t counter = counters[i < count ? i : count - 1];                       \
+                                                                                            \
+        hi[i] = (uint32_t)(counter >> 32);                                                  \
+        lo[i] = (uint32_t)counter;                                                          \
+        for (j = 0; j < SHA1_STATE_WORDS; j++) {                                            \
+            istate[j][i] = hkey->istate[j];                                                 \
+            ostate[j][i] = hkey->ostate[j];                                                 \
+        }                                                                                   \
+    }                                                                                       \
+    w[0] = LOADU(hi);                                                                       \
+    w[1] = LOADU(lo);                                                                       \
+    w[2] = SET1(0x80000000);                                                                \
+    for (i = 3; i < 15; i++)                                                                \
+        w[i] = SET1(0);                                                                     \
+    w[15] = SET1((SHA1_BLOCK_LEN + 8) * 8);                                                 \
+    for (i = 0; i < SHA1_STATE_WORDS; i++)                                                  \
+        state[i] = LOADU(istate[i]);                                                        \
+    a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];                   \
+    SHA1_ROUNDS(a, b, c, d, e);                                                             \
+    state[0] = ADD(state[0], a);                                                            \
+    state[1] = ADD(state[1], b);                                                            \
+    state[2] = ADD(state[2], c);                                                            \
+    state[3] = ADD(state[3], d);                                                            \
+    state[4] = ADD(state[4], e);                                                            \
+                                                                                            \
+    /* Outer block: inner digest, padding, and length of opad block plus digest in bits */  \
+    for (i = 0; i < SHA1_STATE_WORDS; i++)                                                  \
+        w[i] = state[i];                                                                    \
+    w[SHA1_STATE_WORDS] = SET1(0x80000000);                                                 \
+    for (i = SHA1_STATE_WORDS + 1; i < 15; i++)                                             \
+        w[i] = SET1(0);                                                                     \
+    w[15] = SET1((SHA1_BLOCK_LEN + SHA1_DIGEST_LEN) * 8);                                   \
+    for (i = 0; i < SHA1_STATE_WORDS; i++)                                                  \
+        state[i] = LOADU(ostate[i]);                                                        \
+    a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];                   \
+    SHA1_ROUNDS(a, b, c, d, e);                                                             \
+    STOREU(out[0], ADD(state[0], a));                                                       \
+    STOREU(out[1], ADD(state[1], b));                                                       \
+    STOREU(out[2], ADD(state[2], c));                                                       \
+    STOREU(out[3], ADD(state[3], d));                                                       \
+    STOREU(out[4], ADD(state[4], e));                                                       \
+                                                                                            \
+    /* Output digests */                                                                    \
+    for (i = 0; i < count; i++) {                                                           \
+        uint32_t digest[SHA1_STATE_WORDS];                                                  \
+                                                                                            \
+        for (j = 0; j < SHA1_STATE_WORDS; j++)                                              \
+            digest[j] = out[j][i];                                                          \
+        sha1_encode(hashes[i], digest, SHA1_STATE_WORDS);                                   \
+    }
+
+/* AVX2: eight lanes */
+#define ADD(x, y)                   _mm256_add_epi32(x, y)
+#define ROTL(x, n)                  _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+#define XOR4(w, x, y, z)            _mm256_xor_si256(_mm256_xor_si256(w, x), _mm256_xor_si256(y, z))
+#define F1(b, c, d)                 _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)))
+#define F2(b, c, d)                 _mm256_xor_si256(_mm256_xor_si256(b, c), d)
+#define F3(b, c, d)                 _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)))
+#define SET1(x)                     _mm256_set1_epi32((int)(x))
+#define LOADU(p)                    _mm256_loadu_si256((const __m256i *)(p))
+#define STOREU(p, x)                _mm256_storeu_si256((__m256i *)(p), x)
+
+__attribute__((target("avx2")))
+static void
+hmac_sha1_batch_avx2(const struct hmac_sha1_key *const *hkeys, const uint64_t *counters, int count,
+    u_char (*hashes)[SHA1_DIGEST_LEN])
+{
+    HMAC_SHA1_BATCH(__m256i, 8)
+}
+
+#undef ADD
+#undef ROTL
+#undef XOR4
+#undef F1
+#undef F2
+#undef F3
+#undef SET1
+#undef LOADU
+#undef STOREU
+
+/* AVX-512: sixteen lanes, with native rotates and three-input logic */
+#define ADD(x, y)                   _mm512_add_epi32(x, y)
+#define ROTL(x, n)                  _mm512_rol_epi32(x, n)
+#define XOR4(w, x, y, z)            _mm512_xor_si512(_mm512_ternarylogic_epi32(w, x, y, 0x96), z)
+#define F1(b, c, d)                 _mm512_ternarylogic_epi32(b, c, d, 0xca)
+#define F2(b, c, d)                 _mm512_ternarylogic_epi32(b, c, d, 0x96)
+#define F3(b, c, d)                 _mm512_ternarylogic_epi32(b, c, d, 0xe8)
+#define SET1(x)                     _mm512_set1_epi32((int)(x))
+#define LOADU(p)                    _mm512_loadu_si512((const void *)(p))
+#define STOREU(p, x)                _mm512_storeu_si512((void *)(p), x)
+
+__attribute__((target("avx512f")))
+static void
+hmac_sha1_batch_avx512(const struct hmac_sha1_key *const *hkeys, const uint64_t *counters, int count,
+    u_char (*hashes)[SHA1_DIGEST_LEN])
+{
+    HMAC_SHA1_BATCH(__m512i, 16)
+}
+
+#undef ADD
+#undef ROTL
+#undef XOR4
+#undef F1
+#undef F2
+#undef F3
+#undef SET1
+#undef LOADU
+#undef STOREU
+
+#endif  /* CPU_X86 */
+
@@ -0,0 +1,55 @@
+
+/*
+ * mod_authn_otp - Apache module for one-time password authentication
+ *
+ * Copyright 2009 Archie L. Cobbs <archie@dellroad.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * $Id$
+ */
+
+/*
+ * Internal SHA-1 used for HOTP. This is specialized for computing HMAC-SHA1 of an
+ * eight byte counter from a precomputed key state, which always costs exactly two
+ * SHA-1 compressions. The compression function is selected once at startup, along
+ * with a multi-buffer implementation for computing several counters at once.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/* SHA-1 sizes */
+#define SHA1_BLOCK_LEN              64
+#define SHA1_DIGEST_LEN             20
+#define SHA1_STATE_WORDS            5
+
+/* Maximum number of counters hmac_sha1_counter_batch() and hmac_sha1_multi_batch() compute in parallel */
+#define HMAC_SHA1_MAX_BATCH         16
+
+/* Precomputed HMAC-SHA1 key state */
+struct hmac_sha1_key {
+    uint32_t    istate[SHA1_STATE_WORDS];   /* state after compressing (key ^ ipad) */
+    uint32_t    ostate[SHA1_STATE_WORDS];   /* state after compressing (key ^ opad) */
+};
+
+/* sha1.c */
+extern const char   *hmac_sha1_select(void);
+extern void         hmac_sha1_key_init(struct hmac_sha1_key *hkey, const u_char *key, size_t keylen);
+extern void         hmac_sha1_counter(const struct hmac_sha1_key *hkey, uint64_t counter, u_char *hash);
+extern int          hmac_sha1_batch_size(void);
+extern void         hmac_sha1_counter_batch(const struct hmac_sha1_key *hkey, const uint64_t *counters, int count,
+                        u_char (*hashes)[SHA1_DIGEST_LEN]);
+extern void         hmac_sha1_multi_batch(const struct hmac_sha1_key *const *hkeys, const uint64_t *counters,
+                        int count, u_char (*hashes)[SHA1_DIGEST_LEN]);
+